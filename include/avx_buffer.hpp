@@ -43,7 +43,7 @@ class AVX_ALIGNED avx_buffer {
     size_type _count{};
     T* _ptr{};
 
-    void _resize(size_type new_count) {
+    void _resize(size_type new_count, bool zero) {
         clear();
         _count = new_count;
 
@@ -54,26 +54,36 @@ class AVX_ALIGNED avx_buffer {
         /* Over-allocate by 1x the AVX alignment at both the start and the end */
         char* raw_ptr = static_cast<char*>(operator new[](total_size, std::align_val_t { AVX_ALIGNMENT }));
 
-        /* Zero-initialize everything so everything can be read */
-        std::fill_n(raw_ptr, total_size, 0);
-        
+        /* Zero-initialize the padding so everything can be read. The elements themselves only when asked,
+         * anything that's about to overwrite them would just pay for touching them twice.
+         */
+        const size_t elements_size = sizeof(T) * _count;
+        std::fill_n(raw_ptr, AVX_ALIGNMENT, 0);
+        std::fill_n(raw_ptr + AVX_ALIGNMENT + elements_size, total_size - AVX_ALIGNMENT - elements_size, 0);
+
+        if (zero) {
+            std::fill_n(raw_ptr + AVX_ALIGNMENT, elements_size, 0);
+        }
+
         /* Keep a buffer the size of the AVX alignemnt before our start */
         _ptr = reinterpret_cast<T*>(raw_ptr + AVX_ALIGNMENT);
     }
 
+    constexpr avx_buffer(size_t count, bool zero) { _resize(count, zero); }
+
     public:
 
     constexpr ~avx_buffer() { clear(); }
 
     constexpr avx_buffer() : _ptr { nullptr } { }
-    constexpr explicit avx_buffer(size_t count) { _resize(count); }
+    constexpr explicit avx_buffer(size_t count) { _resize(count, true); }
 
-    constexpr avx_buffer(const avx_buffer& other) : avx_buffer { other._count } {
+    constexpr avx_buffer(const avx_buffer& other) : avx_buffer { other._count, false } {
         std::ranges::copy(other, _ptr);
     }
 
     constexpr avx_buffer& operator=(const avx_buffer& other) {
-        _resize(other._count);
+        _resize(other._count, false);
         std::ranges::copy(other, _ptr);
 
         return *this;
@@ -94,13 +104,13 @@ class AVX_ALIGNED avx_buffer {
     }
 
     template <std::ranges::sized_range R>
-    constexpr explicit avx_buffer(R&& range) : avx_buffer { std::ranges::size(range) } {  // NOLINT(bugprone-forwarding-reference-overload)
+    constexpr explicit avx_buffer(R&& range) : avx_buffer { std::ranges::size(range), false } {  // NOLINT(bugprone-forwarding-reference-overload)
         std::ranges::copy(range, _ptr);
     }
 
     template <std::ranges::sized_range R>
     constexpr avx_buffer& operator=(R&& range) {
-        _resize(std::ranges::size(range));
+        _resize(std::ranges::size(range), false);
         std::ranges::copy(range, _ptr);
 
         return *this;
@@ -109,25 +119,25 @@ class AVX_ALIGNED avx_buffer {
     template <std::ranges::range R> requires (!std::ranges::sized_range<R>)
     constexpr explicit avx_buffer(R&& range) {  // NOLINT(bugprone-forwarding-reference-overload)
         auto vec = range_to_vec(range);
-        _resize(vec.size());
+        _resize(vec.size(), false);
         std::ranges::move(vec, _ptr);
     }
 
     template <std::ranges::range R> requires (!std::ranges::sized_range<R>)
     constexpr avx_buffer& operator=(R&& range) {
         auto vec = range_to_vec(range);
-        _resize(vec.size());
+        _resize(vec.size(), false);
         std::ranges::move(vec, _ptr);
 
         return *this;
     }
 
-    constexpr explicit avx_buffer(std::span<T> elements) : avx_buffer { elements.size() } {
+    constexpr explicit avx_buffer(std::span<T> elements) : avx_buffer { elements.size(), false } {
         std::ranges::copy(elements, _ptr);
     }
 
     constexpr avx_buffer& operator=(std::span<T> elements) {
-        _resize(elements.size());
+        _resize(elements.size(), false);
         std::ranges::copy(elements, _ptr);
 
         return *this;
@@ -137,15 +147,19 @@ class AVX_ALIGNED avx_buffer {
         return avx_buffer { count };
     }
 
+    /* Elements are left as they come from the allocator, for buffers that are written in full anyway */
+    [[nodiscard]] static constexpr avx_buffer uninitialized(size_type count) {
+        return avx_buffer { count, false };
+    }
+
     [[nodiscard]] static constexpr avx_buffer iota(size_type bound) {
         return avx_buffer { std::views::iota(T{ 0 }, bound) };
     }
 
     [[nodiscard]] static constexpr avx_buffer fill(size_type count, T val) {
-        avx_buffer buf { count };
+        avx_buffer buf { count, val == T {} };
 
-        /* Zero-initialized is the default*/
-        if (val) {
+        if (val != T {}) {
             std::ranges::fill(buf, val);
         }
 
@@ -0,0 +1,633 @@
+#ifndef BITMAP_OPS_H
+#define BITMAP_OPS_H
+
+#include <span>
+#include <array>
+#include <vector>
+#include <string_view>
+#include <bit>
+#include <cstdint>
+#include <cstddef>
+#include <cstdlib>
+
+#include <immintrin.h>
+
+#ifdef _MSC_VER
+#   include <intrin.h>
+#endif
+
+#include "simd.hpp"
+
+/* Functions using AVX-512 on top of the AVX2 baseline, only called when the CPU has it */
+#ifdef _MSC_VER
+#   define TARGET_AVX512
+#else
+#   define TARGET_AVX512 __attribute__((target("avx512f,avx512bw,avx512vl,avx512vpopcntdq")))
+#endif
+
+/* Kernels over bitmaps of post IDs, viewed as 64-bit words where bit b of word w is post (w * 64) + b.
+ *
+ * Like the rest of the SIMD code, the kernels require AVX2. CPUs that also have AVX-512 get kernels
+ * using it instead, picked on first use. Setting SEARCH_ISA to avx2 keeps the AVX2 ones, for comparisons.
+ */
+namespace bitmap_ops {
+    /* Room extract() may write past the end of the result */
+    static constexpr size_t slack = 16;
+
+    enum class isa { avx2, avx512 };
+
+    static constexpr std::array isa_names { "AVX2", "AVX-512" };
+
+    namespace detail {
+        /* Positions of the set bits of every byte, padded with zeroes */
+        constexpr std::array<std::array<uint8_t, 8>, 256> make_positions_table() {
+            std::array<std::array<uint8_t, 8>, 256> result {};
+            for (uint32_t byte = 0; byte < 256; ++byte) {
+                uint32_t next = 0;
+                for (uint8_t bit = 0; bit < 8; ++bit) {
+                    if (byte & (1u << bit)) {
+                        result[byte][next++] = bit;
+                    }
+                }
+            }
+
+            return result;
+        }
+
+        alignas(64) inline constexpr std::array<std::array<uint8_t, 8>, 256> positions_table = make_positions_table();
+
+        /* Write the positions of a word with at most 8 bits by tzcnt/blsr. Always writes 8 of them,
+         * so the loop doesn't depend on the number of bits.
+         */
+        FORCE_INLINE void extract_sparse(uint64_t word, uint32_t word_base, uint32_t* out) {
+            for (size_t k = 0; k < 8; ++k) {
+                out[k] = word_base + static_cast<uint32_t>(std::countr_zero(word));
+                word &= word - 1;
+            }
+        }
+
+        /* Batches that probe() prefetches the bitmap words of ahead, so the gathers don't wait on memory */
+        static constexpr size_t probe_prefetch = 4;
+
+        FORCE_INLINE void prefetch_words(const uint64_t* words, const uint32_t* ids, size_t count) {
+            for (size_t k = 0; k < count; ++k) {
+                _mm_prefetch(reinterpret_cast<const char*>(words + (ids[k] / 64)), _MM_HINT_T0);
+            }
+        }
+    }
+
+    /* Plain loops, for the tails the vector kernels leave */
+    namespace scalar {
+        inline void and_into(std::span<uint64_t> dst, std::span<const uint64_t> src) {
+            for (size_t i = 0; i < dst.size(); ++i) {
+                dst[i] &= src[i];
+            }
+        }
+
+        inline void andnot_into(std::span<uint64_t> dst, std::span<const uint64_t> src) {
+            for (size_t i = 0; i < dst.size(); ++i) {
+                dst[i] &= ~src[i];
+            }
+        }
+
+        inline void or_into(std::span<uint64_t> dst, std::span<const uint64_t> src) {
+            for (size_t i = 0; i < dst.size(); ++i) {
+                dst[i] |= src[i];
+            }
+        }
+
+        inline size_t count(std::span<const uint64_t> words) {
+            size_t result = 0;
+            for (uint64_t word : words) {
+                result += std::popcount(word);
+            }
+
+            return result;
+        }
+
+        inline size_t and_count(std::span<const uint64_t> lhs, std::span<const uint64_t> rhs) {
+            size_t result = 0;
+            for (size_t i = 0; i < lhs.size(); ++i) {
+                result += std::popcount(lhs[i] & rhs[i]);
+            }
+
+            return result;
+        }
+
+        inline size_t andnot_count(std::span<const uint64_t> lhs, std::span<const uint64_t> rhs) {
+            size_t result = 0;
+            for (size_t i = 0; i < lhs.size(); ++i) {
+                result += std::popcount(lhs[i] & ~rhs[i]);
+            }
+
+            return result;
+        }
+
+        inline size_t extract(std::span<const uint64_t> words, uint32_t base, uint32_t* out) {
+            uint32_t* begin = out;
+
+            for (size_t i = 0; i < words.size(); ++i) {
+                for (uint64_t word = words[i]; word; word &= word - 1) {
+                    *out++ = base + static_cast<uint32_t>((i * 64) + std::countr_zero(word));
+                }
+            }
+
+            return out - begin;
+        }
+
+        inline size_t probe(std::span<const uint64_t> words, std::span<const uint32_t> ids, bool keep, uint32_t* out) {
+            size_t found = 0;
+            for (uint32_t id : ids) {
+                out[found] = id;
+                found += (((words[id / 64] >> (id % 64)) & 1) != 0) == keep;
+            }
+
+            return found;
+        }
+
+        inline size_t probe_count(std::span<const uint64_t> words, std::span<const uint32_t> ids) {
+            size_t found = 0;
+            for (uint32_t id : ids) {
+                found += (words[id / 64] >> (id % 64)) & 1;
+            }
+
+            return found;
+        }
+    }
+
+    namespace avx2 {
+        inline void and_into(std::span<uint64_t> dst, std::span<const uint64_t> src) {
+            using namespace simd::epi32_operators;
+
+            size_t i = 0;
+            for (; i + 4 <= dst.size(); i += 4) {
+                simd::epi32::storeu(dst.data() + i, simd::epi32::loadu(dst.data() + i) & simd::epi32::loadu(src.data() + i));
+            }
+
+            scalar::and_into(dst.subspan(i), src.subspan(i));
+        }
+
+        inline void andnot_into(std::span<uint64_t> dst, std::span<const uint64_t> src) {
+            size_t i = 0;
+            for (; i + 4 <= dst.size(); i += 4) {
+                simd::epi32::storeu(dst.data() + i, _mm256_andnot_si256(simd::epi32::loadu(src.data() + i), simd::epi32::loadu(dst.data() + i)));
+            }
+
+            scalar::andnot_into(dst.subspan(i), src.subspan(i));
+        }
+
+        inline void or_into(std::span<uint64_t> dst, std::span<const uint64_t> src) {
+            using namespace simd::epi32_operators;
+
+            size_t i = 0;
+            for (; i + 4 <= dst.size(); i += 4) {
+                simd::epi32::storeu(dst.data() + i, simd::epi32::loadu(dst.data() + i) | simd::epi32::loadu(src.data() + i));
+            }
+
+            scalar::or_into(dst.subspan(i), src.subspan(i));
+        }
+
+        /* Bits per 64-bit lane, by a nibble lookup through vpshufb summed by vpsadbw */
+        FORCE_INLINE __m256i popcount_lanes(__m256i val) {
+            const __m256i lookup = _mm256_setr_epi8(
+                0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+            const __m256i low_mask = _mm256_set1_epi8(0x0F);
+
+            const __m256i lo = _mm256_shuffle_epi8(lookup, _mm256_and_si256(val, low_mask));
+            const __m256i hi = _mm256_shuffle_epi8(lookup, _mm256_and_si256(_mm256_srli_epi16(val, 4), low_mask));
+
+            return _mm256_sad_epu8(_mm256_add_epi8(lo, hi), _mm256_setzero_si256());
+        }
+
+        /* Carry-save adder: the bits of a + b + c, as high and low bit */
+        FORCE_INLINE void csa(__m256i& high, __m256i& low, __m256i a, __m256i b, __m256i c) {
+            const __m256i u = _mm256_xor_si256(a, b);
+            high = _mm256_or_si256(_mm256_and_si256(a, b), _mm256_and_si256(u, c));
+            low = _mm256_xor_si256(u, c);
+        }
+
+        /* Harley-Seal population count of `vectors` 256-bit vectors given by load(i).
+         * Sixteen vectors at a time are added up bit-wise through a tree of carry-save adders,
+         * so only one in sixteen needs an actual population count.
+         */
+        template <typename Load>
+        FORCE_INLINE size_t harley_seal(size_t vectors, Load&& load) {
+            __m256i total = _mm256_setzero_si256();
+            __m256i ones = _mm256_setzero_si256();
+            __m256i twos = _mm256_setzero_si256();
+            __m256i fours = _mm256_setzero_si256();
+            __m256i eights = _mm256_setzero_si256();
+            __m256i sixteens;
+            __m256i twos_a;
+            __m256i twos_b;
+            __m256i fours_a;
+            __m256i fours_b;
+            __m256i eights_a;
+            __m256i eights_b;
+
+            size_t i = 0;
+            for (; i + 16 <= vectors; i += 16) {
+                csa(twos_a, ones, ones, load(i + 0), load(i + 1));
+                csa(twos_b, ones, ones, load(i + 2), load(i + 3));
+                csa(fours_a, twos, twos, twos_a, twos_b);
+                csa(twos_a, ones, ones, load(i + 4), load(i + 5));
+                csa(twos_b, ones, ones, load(i + 6), load(i + 7));
+                csa(fours_b, twos, twos, twos_a, twos_b);
+                csa(eights_a, fours, fours, fours_a, fours_b);
+                csa(twos_a, ones, ones, load(i + 8), load(i + 9));
+                csa(twos_b, ones, ones, load(i + 10), load(i + 11));
+                csa(fours_a, twos, twos, twos_a, twos_b);
+                csa(twos_a, ones, ones, load(i + 12), load(i + 13));
+                csa(twos_b, ones, ones, load(i + 14), load(i + 15));
+                csa(fours_b, twos, twos, twos_a, twos_b);
+                csa(eights_b, fours, fours, fours_a, fours_b);
+                csa(sixteens, eights, eights, eights_a, eights_b);
+
+                total = _mm256_add_epi64(total, popcount_lanes(sixteens));
+            }
+
+            total = _mm256_slli_epi64(total, 4);
+            total = _mm256_add_epi64(total, _mm256_slli_epi64(popcount_lanes(eights), 3));
+            total = _mm256_add_epi64(total, _mm256_slli_epi64(popcount_lanes(fours), 2));
+            total = _mm256_add_epi64(total, _mm256_slli_epi64(popcount_lanes(twos), 1));
+            total = _mm256_add_epi64(total, popcount_lanes(ones));
+
+            for (; i < vectors; ++i) {
+                total = _mm256_add_epi64(total, popcount_lanes(load(i)));
+            }
+
+            alignas(32) std::array<uint64_t, 4> lanes;
+            _mm256_store_si256(reinterpret_cast<__m256i*>(lanes.data()), total);
+
+            return lanes[0] + lanes[1] + lanes[2] + lanes[3];
+        }
+
+        inline size_t count(std::span<const uint64_t> words) {
+            const size_t vectors = words.size() / 4;
+            return harley_seal(vectors, [&](size_t i) FORCE_INLINE_LAMBDA {
+                return simd::epi32::loadu(words.data() + (i * 4));
+            }) + scalar::count(words.subspan(vectors * 4));
+        }
+
+        /* The AND is fused into the loads of the population count, nothing is written */
+        inline size_t and_count(std::span<const uint64_t> lhs, std::span<const uint64_t> rhs) {
+            const size_t vectors = lhs.size() / 4;
+            return harley_seal(vectors, [&](size_t i) FORCE_INLINE_LAMBDA {
+                return _mm256_and_si256(simd::epi32::loadu(lhs.data() + (i * 4)), simd::epi32::loadu(rhs.data() + (i * 4)));
+            }) + scalar::and_count(lhs.subspan(vectors * 4), rhs.subspan(vectors * 4));
+        }
+
+        inline size_t andnot_count(std::span<const uint64_t> lhs, std::span<const uint64_t> rhs) {
+            const size_t vectors = lhs.size() / 4;
+            return harley_seal(vectors, [&](size_t i) FORCE_INLINE_LAMBDA {
+                return _mm256_andnot_si256(simd::epi32::loadu(rhs.data() + (i * 4)), simd::epi32::loadu(lhs.data() + (i * 4)));
+            }) + scalar::andnot_count(lhs.subspan(vectors * 4), rhs.subspan(vectors * 4));
+        }
+
+        /* Denser words expand every byte through a table of positions with one 8-lane store each */
+        inline size_t extract(std::span<const uint64_t> words, uint32_t base, uint32_t* out) {
+            using namespace simd::epi32_operators;
+
+            uint32_t* begin = out;
+
+            for (size_t i = 0; i < words.size(); ++i) {
+                const uint64_t word = words[i];
+                if (word == 0) {
+                    continue;
+                }
+
+                const uint32_t word_base = base + static_cast<uint32_t>(i * 64);
+                const int bits = std::popcount(word);
+
+                if (bits <= 8) {
+                    detail::extract_sparse(word, word_base, out);
+                    out += bits;
+                    continue;
+                }
+
+                m256i byte_base = simd::epi32::from_value(static_cast<int>(word_base));
+                for (size_t k = 0; k < 8; ++k) {
+                    const auto byte = static_cast<uint8_t>(word >> (k * 8));
+                    const m256i positions = _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(detail::positions_table[byte].data())));
+
+                    simd::epi32::storeu(out, positions + byte_base);
+                    out += std::popcount(byte);
+                    byte_base = byte_base + simd::epi32::from_value(8);
+                }
+            }
+
+            return out - begin;
+        }
+
+        /* Bit of every ID moved into the sign bit of its lane, from one gather of the 32-bit words */
+        FORCE_INLINE m256i probe_lanes(const uint32_t* bits, m256i ids) {
+            using namespace simd::epi32_operators;
+
+            const m256i gathered = simd::epi32::gather(bits, _mm256_srli_epi32(ids, 5));
+            return _mm256_sllv_epi32(gathered, simd::epi32::from_value(31) - (ids & simd::epi32::from_value(31)));
+        }
+
+        FORCE_INLINE uint32_t probe_mask(const uint32_t* bits, m256i ids) {
+            return static_cast<uint32_t>(_mm256_movemask_ps(_mm256_castsi256_ps(probe_lanes(bits, ids))));
+        }
+
+        /* 8 IDs per gather, the survivors are moved to the front through the positions table and stored at once */
+        inline size_t probe(std::span<const uint64_t> words, std::span<const uint32_t> ids, bool keep, uint32_t* out) {
+            const auto* bits = reinterpret_cast<const uint32_t*>(words.data());
+            const uint32_t flip = keep ? 0 : 0xFF;
+
+            size_t found = 0;
+            size_t i = 0;
+            for (; i + 8 <= ids.size(); i += 8) {
+                if (i + ((detail::probe_prefetch + 1) * 8) <= ids.size()) {
+                    detail::prefetch_words(words.data(), ids.data() + i + (detail::probe_prefetch * 8), 8);
+                }
+
+                const m256i values = simd::epi32::loadu(ids.data() + i);
+                const uint32_t mask = probe_mask(bits, values) ^ flip;
+
+                const m256i positions = _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(detail::positions_table[mask].data())));
+                simd::epi32::storeu(out + found, _mm256_permutevar8x32_epi32(values, positions));
+                found += std::popcount(mask);
+            }
+
+            return found + scalar::probe(words, ids.subspan(i), keep, out + found);
+        }
+
+        inline size_t probe_count(std::span<const uint64_t> words, std::span<const uint32_t> ids) {
+            const auto* bits = reinterpret_cast<const uint32_t*>(words.data());
+
+            size_t found = 0;
+            size_t i = 0;
+            for (; i + 8 <= ids.size(); i += 8) {
+                if (i + ((detail::probe_prefetch + 1) * 8) <= ids.size()) {
+                    detail::prefetch_words(words.data(), ids.data() + i + (detail::probe_prefetch * 8), 8);
+                }
+
+                found += std::popcount(probe_mask(bits, simd::epi32::loadu(ids.data() + i)));
+            }
+
+            return found + scalar::probe_count(words, ids.subspan(i));
+        }
+    }
+
+    /* The tail of every loop goes through masked loads and stores instead of a scalar loop */
+    namespace avx512 {
+        TARGET_AVX512 inline __mmask8 tail_mask(size_t remaining) {
+            return static_cast<__mmask8>((1u << remaining) - 1);
+        }
+
+        TARGET_AVX512 inline void and_into(std::span<uint64_t> dst, std::span<const uint64_t> src) {
+            for (size_t i = 0; i < dst.size(); i += 8) {
+                const __mmask8 mask = (i + 8 <= dst.size()) ? 0xFF : tail_mask(dst.size() - i);
+                const __m512i val = _mm512_and_si512(_mm512_maskz_loadu_epi64(mask, dst.data() + i), _mm512_maskz_loadu_epi64(mask, src.data() + i));
+                _mm512_mask_storeu_epi64(dst.data() + i, mask, val);
+            }
+        }
+
+        TARGET_AVX512 inline void andnot_into(std::span<uint64_t> dst, std::span<const uint64_t> src) {
+            for (size_t i = 0; i < dst.size(); i += 8) {
+                const __mmask8 mask = (i + 8 <= dst.size()) ? 0xFF : tail_mask(dst.size() - i);
+                const __m512i val = _mm512_andnot_si512(_mm512_maskz_loadu_epi64(mask, src.data() + i), _mm512_maskz_loadu_epi64(mask, dst.data() + i));
+                _mm512_mask_storeu_epi64(dst.data() + i, mask, val);
+            }
+        }
+
+        TARGET_AVX512 inline void or_into(std::span<uint64_t> dst, std::span<const uint64_t> src) {
+            for (size_t i = 0; i < dst.size(); i += 8) {
+                const __mmask8 mask = (i + 8 <= dst.size()) ? 0xFF : tail_mask(dst.size() - i);
+                const __m512i val = _mm512_or_si512(_mm512_maskz_loadu_epi64(mask, dst.data() + i), _mm512_maskz_loadu_epi64(mask, src.data() + i));
+                _mm512_mask_storeu_epi64(dst.data() + i, mask, val);
+            }
+        }
+
+        /* VPOPCNTQ per lane */
+        TARGET_AVX512 inline size_t count(std::span<const uint64_t> words) {
+            __m512i total = _mm512_setzero_si512();
+            for (size_t i = 0; i < words.size(); i += 8) {
+                const __mmask8 mask = (i + 8 <= words.size()) ? 0xFF : tail_mask(words.size() - i);
+                total = _mm512_add_epi64(total, _mm512_popcnt_epi64(_mm512_maskz_loadu_epi64(mask, words.data() + i)));
+            }
+
+            return static_cast<size_t>(_mm512_reduce_add_epi64(total));
+        }
+
+        TARGET_AVX512 inline size_t and_count(std::span<const uint64_t> lhs, std::span<const uint64_t> rhs) {
+            __m512i total = _mm512_setzero_si512();
+            for (size_t i = 0; i < lhs.size(); i += 8) {
+                const __mmask8 mask = (i + 8 <= lhs.size()) ? 0xFF : tail_mask(lhs.size() - i);
+                const __m512i val = _mm512_and_si512(_mm512_maskz_loadu_epi64(mask, lhs.data() + i), _mm512_maskz_loadu_epi64(mask, rhs.data() + i));
+                total = _mm512_add_epi64(total, _mm512_popcnt_epi64(val));
+            }
+
+            return static_cast<size_t>(_mm512_reduce_add_epi64(total));
+        }
+
+        TARGET_AVX512 inline size_t andnot_count(std::span<const uint64_t> lhs, std::span<const uint64_t> rhs) {
+            __m512i total = _mm512_setzero_si512();
+            for (size_t i = 0; i < lhs.size(); i += 8) {
+                const __mmask8 mask = (i + 8 <= lhs.size()) ? 0xFF : tail_mask(lhs.size() - i);
+                const __m512i val = _mm512_andnot_si512(_mm512_maskz_loadu_epi64(mask, rhs.data() + i), _mm512_maskz_loadu_epi64(mask, lhs.data() + i));
+                total = _mm512_add_epi64(total, _mm512_popcnt_epi64(val));
+            }
+
+            return static_cast<size_t>(_mm512_reduce_add_epi64(total));
+        }
+
+        /* Denser words compress 16 consecutive positions per 16 bits of the word with one store each */
+        TARGET_AVX512 inline size_t extract(std::span<const uint64_t> words, uint32_t base, uint32_t* out) {
+            const __m512i lanes = _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15);
+
+            uint32_t* begin = out;
+
+            for (size_t i = 0; i < words.size(); ++i) {
+                const uint64_t word = words[i];
+                if (word == 0) {
+                    continue;
+                }
+
+                const uint32_t word_base = base + static_cast<uint32_t>(i * 64);
+                const int bits = std::popcount(word);
+
+                if (bits <= 8) {
+                    detail::extract_sparse(word, word_base, out);
+                    out += bits;
+                    continue;
+                }
+
+                for (uint32_t k = 0; k < 4; ++k) {
+                    const auto chunk = static_cast<__mmask16>(word >> (k * 16));
+                    const __m512i positions = _mm512_add_epi32(lanes, _mm512_set1_epi32(static_cast<int>(word_base + (k * 16))));
+
+                    _mm512_storeu_si512(out, _mm512_maskz_compress_epi32(chunk, positions));
+                    out += std::popcount(chunk);
+                }
+            }
+
+            return out - begin;
+        }
+
+        /* Which of 16 IDs have their bit set, from one gather of the 32-bit words */
+        TARGET_AVX512 inline __mmask16 probe_mask(const uint32_t* bits, __m512i ids) {
+            const __m512i gathered = _mm512_i32gather_epi32(_mm512_srli_epi32(ids, 5), bits, 4);
+            return _mm512_test_epi32_mask(gathered, _mm512_sllv_epi32(_mm512_set1_epi32(1), _mm512_and_si512(ids, _mm512_set1_epi32(31))));
+        }
+
+        /* 16 IDs per gather, the survivors are compressed into place with one store */
+        TARGET_AVX512 inline size_t probe(std::span<const uint64_t> words, std::span<const uint32_t> ids, bool keep, uint32_t* out) {
+            const auto* bits = reinterpret_cast<const uint32_t*>(words.data());
+            const __mmask16 flip = keep ? 0 : 0xFFFF;
+
+            size_t found = 0;
+            size_t i = 0;
+            for (; i + 16 <= ids.size(); i += 16) {
+                if (i + ((detail::probe_prefetch + 1) * 16) <= ids.size()) {
+                    detail::prefetch_words(words.data(), ids.data() + i + (detail::probe_prefetch * 16), 16);
+                }
+
+                const __m512i values = _mm512_loadu_si512(ids.data() + i);
+                const auto mask = static_cast<__mmask16>(probe_mask(bits, values) ^ flip);
+
+                _mm512_storeu_si512(out + found, _mm512_maskz_compress_epi32(mask, values));
+                found += std::popcount(mask);
+            }
+
+            return found + scalar::probe(words, ids.subspan(i), keep, out + found);
+        }
+
+        TARGET_AVX512 inline size_t probe_count(std::span<const uint64_t> words, std::span<const uint32_t> ids) {
+            const auto* bits = reinterpret_cast<const uint32_t*>(words.data());
+
+            size_t found = 0;
+            size_t i = 0;
+            for (; i + 16 <= ids.size(); i += 16) {
+                if (i + ((detail::probe_prefetch + 1) * 16) <= ids.size()) {
+                    detail::prefetch_words(words.data(), ids.data() + i + (detail::probe_prefetch * 16), 16);
+                }
+
+                found += std::popcount(probe_mask(bits, _mm512_loadu_si512(ids.data() + i)));
+            }
+
+            return found + scalar::probe_count(words, ids.subspan(i));
+        }
+    }
+
+    namespace detail {
+        /* Best instruction set the CPU and OS support, AVX2 is the baseline the binaries are built for */
+        [[nodiscard]] inline isa detect() {
+#ifdef _MSC_VER
+            std::array<int, 4> regs;
+
+            /* The OS must save the opmask and ZMM registers as well */
+            const uint64_t xcr0 = _xgetbv(0);
+
+            __cpuidex(regs.data(), 7, 0);
+            const bool avx512 = (regs[1] & (1 << 16)) && (regs[1] & (1 << 30)) && (regs[1] & (1 << 31))
+                && (regs[2] & (1 << 14)) && ((xcr0 & 0xE6) == 0xE6);
+#else
+            __builtin_cpu_init();
+            const bool avx512 = __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw")
+                && __builtin_cpu_supports("avx512vl") && __builtin_cpu_supports("avx512vpopcntdq");
+#endif
+
+            return avx512 ? isa::avx512 : isa::avx2;
+        }
+
+        struct kernels {
+            isa level;
+
+            void (*and_into)(std::span<uint64_t>, std::span<const uint64_t>);
+            void (*andnot_into)(std::span<uint64_t>, std::span<const uint64_t>);
+            void (*or_into)(std::span<uint64_t>, std::span<const uint64_t>);
+            size_t (*count)(std::span<const uint64_t>);
+            size_t (*and_count)(std::span<const uint64_t>, std::span<const uint64_t>);
+            size_t (*andnot_count)(std::span<const uint64_t>, std::span<const uint64_t>);
+            size_t (*extract)(std::span<const uint64_t>, uint32_t, uint32_t*);
+            size_t (*probe)(std::span<const uint64_t>, std::span<const uint32_t>, bool, uint32_t*);
+            size_t (*probe_count)(std::span<const uint64_t>, std::span<const uint32_t>);
+        };
+
+        [[nodiscard]] inline kernels select() {
+            isa level = detect();
+
+            if (const char* requested = std::getenv("SEARCH_ISA"); requested && std::string_view { requested } == "avx2") {
+                level = isa::avx2;
+            }
+
+            if (level == isa::avx512) {
+                return { level, avx512::and_into, avx512::andnot_into, avx512::or_into, avx512::count, avx512::and_count, avx512::andnot_count, avx512::extract, avx512::probe, avx512::probe_count };
+            }
+
+            return { level, avx2::and_into, avx2::andnot_into, avx2::or_into, avx2::count, avx2::and_count, avx2::andnot_count, avx2::extract, avx2::probe, avx2::probe_count };
+        }
+
+        [[nodiscard]] inline const kernels& active() {
+            static const kernels selected = select();
+            return selected;
+        }
+    }
+
+    /* Instruction set of the kernels in use */
+    [[nodiscard]] inline isa active_isa() {
+        return detail::active().level;
+    }
+
+    /* dst &= src, src must be at least as long as dst */
+    inline void and_into(std::span<uint64_t> dst, std::span<const uint64_t> src) {
+        detail::active().and_into(dst, src);
+    }
+
+    /* dst &= ~src */
+    inline void andnot_into(std::span<uint64_t> dst, std::span<const uint64_t> src) {
+        detail::active().andnot_into(dst, src);
+    }
+
+    /* dst |= src */
+    inline void or_into(std::span<uint64_t> dst, std::span<const uint64_t> src) {
+        detail::active().or_into(dst, src);
+    }
+
+    /* Number of set bits */
+    [[nodiscard]] inline size_t count(std::span<const uint64_t> words) {
+        return detail::active().count(words);
+    }
+
+    /* Number of bits set in both, without writing anything */
+    [[nodiscard]] inline size_t and_count(std::span<const uint64_t> lhs, std::span<const uint64_t> rhs) {
+        return detail::active().and_count(lhs, rhs);
+    }
+
+    /* Number of bits set in lhs but not in rhs */
+    [[nodiscard]] inline size_t andnot_count(std::span<const uint64_t> lhs, std::span<const uint64_t> rhs) {
+        return detail::active().andnot_count(lhs, rhs);
+    }
+
+    /* Write base + the position of every set bit to `out` in ascending order, returns the number of IDs.
+     * `out` must hold count(words) + slack IDs.
+     */
+    inline size_t extract(std::span<const uint64_t> words, uint32_t base, uint32_t* out) {
+        return detail::active().extract(words, base, out);
+    }
+
+    /* Write the IDs of a list whose bits are set (or, without keep, clear) to `out`, in order. Returns the
+     * number of IDs written, `out` must hold ids.size() + slack IDs.
+     */
+    inline size_t probe(std::span<const uint64_t> words, std::span<const uint32_t> ids, bool keep, uint32_t* out) {
+        return detail::active().probe(words, ids, keep, out);
+    }
+
+    /* Number of IDs of a list whose bits are set */
+    [[nodiscard]] inline size_t probe_count(std::span<const uint64_t> words, std::span<const uint32_t> ids) {
+        return detail::active().probe_count(words, ids);
+    }
+
+    /* All IDs of a bitmap as a list */
+    [[nodiscard]] inline std::vector<uint32_t> to_list(std::span<const uint64_t> words, uint32_t base = 0) {
+        std::vector<uint32_t> result(count(words) + slack);
+        result.resize(extract(words, base, result.data()));
+        return result;
+    }
+}
+
+#endif /* BITMAP_OPS_H */
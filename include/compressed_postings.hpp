@@ -0,0 +1,233 @@
+#ifndef COMPRESSED_POSTINGS_H
+#define COMPRESSED_POSTINGS_H
+
+#include <span>
+#include <array>
+#include <vector>
+#include <algorithm>
+#include <bit>
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+
+#include "index_format.hpp"
+#include "simd.hpp"
+
+/* Encode a sorted posting list, see index_format::block_entry for the layout. `out` is cleared first */
+inline void encode_postings(std::span<const uint32_t> posts, std::vector<std::byte>& out) {
+    using index_format::block_entry;
+    using index_format::block_posts;
+
+    const size_t block_count = (posts.size() + block_posts - 1) / block_posts;
+
+    std::vector<block_entry> entries(block_count);
+    size_t offset = (block_count * sizeof(block_entry) + 31) & ~size_t { 31 };
+
+    /* Deltas first, so every block knows its width before anything is laid out */
+    std::vector<std::array<uint32_t, block_posts>> deltas(block_count);
+    uint32_t previous = 0;
+    for (size_t b = 0; b < block_count; ++b) {
+        std::span<const uint32_t> block = posts.subspan(b * block_posts, std::min(block_posts, posts.size() - (b * block_posts)));
+
+        uint32_t widest = 0;
+        for (size_t i = 0; i < block.size(); ++i) {
+            deltas[b][i] = block[i] - ((i == 0) ? previous : block[i - 1]);
+            widest |= deltas[b][i];
+        }
+
+        /* A partial block would pay for all 128 slots, store its post IDs as-is instead */
+        const bool raw = block.size() < block_posts;
+
+        entries[b] = {
+            .base = previous,
+            .max = block.back(),
+            .offset = static_cast<uint32_t>(offset),
+            .bits = raw ? 0 : std::max<uint32_t>(std::bit_width(widest), 1),
+        };
+
+        offset += raw ? block.size_bytes() : (entries[b].bits * sizeof(__m256i));
+        previous = block.back();
+    }
+
+    out.assign(offset, std::byte { 0 });
+    std::memcpy(out.data(), entries.data(), entries.size() * sizeof(block_entry));
+
+    for (size_t b = 0; b < block_count; ++b) {
+        if (entries[b].bits == 0) {
+            std::memcpy(out.data() + entries[b].offset, posts.data() + (b * block_posts), (posts.size() - (b * block_posts)) * sizeof(uint32_t));
+        } else {
+            simd::bitpack::pack(deltas[b].data(), entries[b].bits, reinterpret_cast<uint32_t*>(out.data() + entries[b].offset));
+        }
+    }
+}
+
+/* View of a single compressed posting list inside a mapping */
+class compressed_list {
+    const std::byte* _data = nullptr;
+    uint32_t _count = 0;
+
+    public:
+    compressed_list() = default;
+    compressed_list(const std::byte* data, uint32_t count) : _data { data }, _count { count } { }
+
+    [[nodiscard]] uint32_t size() const { return _count; }
+    [[nodiscard]] bool empty() const { return _count == 0; }
+
+    [[nodiscard]] std::span<const index_format::block_entry> blocks() const {
+        return { reinterpret_cast<const index_format::block_entry*>(_data), (_count + index_format::block_posts - 1) / index_format::block_posts };
+    }
+
+    /* Number of posts in a block, only the last one can be partial */
+    [[nodiscard]] uint32_t block_size(size_t block) const {
+        return std::min<uint32_t>(index_format::block_posts, _count - (block * index_format::block_posts));
+    }
+
+    /* Decode the block_size(block) posts of a block, `out` must be 32-byte aligned and hold 128 posts */
+    void decode_block(size_t block, uint32_t* out) const {
+        const index_format::block_entry& entry = blocks()[block];
+        if (entry.bits == 0) {
+            std::memcpy(out, _data + entry.offset, block_size(block) * sizeof(uint32_t));
+        } else {
+            simd::bitpack::unpack_deltas(_data + entry.offset, entry.bits, entry.base, out);
+        }
+    }
+
+    /* Decode the entire list, `out` must hold size() posts */
+    void decode(uint32_t* out) const {
+        AVX_ALIGNED std::array<uint32_t, index_format::block_posts> buf;
+
+        for (size_t b = 0; b < blocks().size(); ++b) {
+            decode_block(b, buf.data());
+            std::copy_n(buf.data(), block_size(b), out + (b * index_format::block_posts));
+        }
+    }
+};
+
+/* Forward-only cursor over a compressed list that only decodes the blocks it lands in */
+class compressed_cursor {
+    compressed_list _list;
+    std::span<const index_format::block_entry> _blocks;
+
+    size_t _block = 0;
+    uint32_t _pos = 0;
+    uint32_t _size = 0;
+
+    AVX_ALIGNED std::array<uint32_t, index_format::block_posts> _buf;
+
+    void _load(size_t block) {
+        _block = block;
+        _pos = 0;
+
+        if (block < _blocks.size()) {
+            _list.decode_block(block, _buf.data());
+            _size = _list.block_size(block);
+        } else {
+            _size = 0;
+        }
+    }
+
+    public:
+    explicit compressed_cursor(compressed_list list) : _list { list }, _blocks { list.blocks() } {
+        _load(0);
+    }
+
+    [[nodiscard]] bool done() const { return _pos >= _size; }
+    [[nodiscard]] uint32_t value() const { return _buf[_pos]; }
+
+    void next() {
+        if (++_pos == _size) {
+            _load(_block + 1);
+        }
+    }
+
+    /* Move to the first post >= target, skipping whole blocks by their maximum. Returns false when exhausted */
+    bool seek(uint32_t target) {
+        if (done()) {
+            return false;
+        }
+
+        if (_blocks[_block].max < target) {
+            /* Gallop over the block maxima, far targets are common when the other lists are much smaller */
+            size_t step = 1;
+            size_t lo = _block;
+            size_t hi = _block + 1;
+            while (hi < _blocks.size() && _blocks[hi].max < target) {
+                lo = hi;
+                step *= 2;
+                hi = _block + step;
+            }
+
+            hi = std::min(hi, _blocks.size());
+            const size_t block = std::ranges::lower_bound(_blocks.begin() + lo + 1, _blocks.begin() + hi, target, {}, &index_format::block_entry::max) - _blocks.begin();
+
+            _load(block);
+            if (done()) {
+                return false;
+            }
+        }
+
+        /* The block's maximum is >= target, so this stops inside the block */
+        while (_buf[_pos] < target) {
+            ++_pos;
+        }
+
+        return true;
+    }
+};
+
+/* Backward cursor over a compressed list, for walking it from the newest post down.
+ * Every seek finds its block by binary searching the block maxima, so starting anywhere costs
+ * a logarithmic seek and a single block decode.
+ */
+class compressed_reverse_cursor {
+    compressed_list _list;
+    std::span<const index_format::block_entry> _blocks;
+
+    /* Decoded block, _blocks.size() if none */
+    size_t _block = 0;
+
+    /* Number of posts of the block below the last bound, the current post is the one before */
+    uint32_t _pos = 0;
+
+    AVX_ALIGNED std::array<uint32_t, index_format::block_posts> _buf;
+
+    void _load(size_t block) {
+        if (block != _block) {
+            _list.decode_block(block, _buf.data());
+            _block = block;
+        }
+    }
+
+    public:
+    explicit compressed_reverse_cursor(compressed_list list) : _list { list }, _blocks { list.blocks() }, _block { _blocks.size() } { }
+
+    /* Move to the last post below bound, bounds must not increase. Returns false when there is none */
+    bool seek_below(uint32_t bound) {
+        /* Only blocks up to the current one can hold it */
+        const size_t end = std::min(_block + 1, _blocks.size());
+        const size_t block = std::ranges::lower_bound(_blocks.begin(), _blocks.begin() + end, bound, {}, &index_format::block_entry::max) - _blocks.begin();
+
+        /* The first block with a maximum >= bound holds it, unless all of its posts are >= bound */
+        if (block < end) {
+            _load(block);
+            _pos = static_cast<uint32_t>(std::lower_bound(_buf.data(), _buf.data() + _list.block_size(block), bound) - _buf.data());
+            if (_pos > 0) {
+                return true;
+            }
+        }
+
+        /* Otherwise it's the last post of the block before */
+        if (block == 0) {
+            _pos = 0;
+            return false;
+        }
+
+        _load(block - 1);
+        _pos = _list.block_size(block - 1);
+        return true;
+    }
+
+    [[nodiscard]] uint32_t value() const { return _buf[_pos - 1]; }
+};
+
+#endif /* COMPRESSED_POSTINGS_H */
@@ -0,0 +1,281 @@
+#ifndef INDEX_FILE_H
+#define INDEX_FILE_H
+
+#include <filesystem>
+#include <stdexcept>
+#include <optional>
+#include <span>
+#include <string>
+#include <cstdint>
+#include <cstring>
+
+#include "index_format.hpp"
+#include "mapped_file.hpp"
+#include "name_dictionary.hpp"
+#include "compressed_postings.hpp"
+#include "roaring.hpp"
+
+/* Memory-mapped index.bin, everything is served directly out of the mapping */
+class index_file {
+    mapped_file _file;
+
+    index_format::header _header {};
+
+    std::span<const index_format::section_entry> _sections;
+    std::span<const index_format::tag_entry> _tags;
+    std::span<const uint32_t> _postings;
+    std::span<const uint32_t> _skips;
+    const std::byte* _compressed = nullptr;
+
+    index_format::bitmap_header _bitmap_header {};
+    std::span<const uint32_t> _bitmap_tags;
+    const std::byte* _bitmaps = nullptr;
+
+    /* Zone maps of the bitmaps, empty without a zones section */
+    std::span<const uint64_t> _zones;
+    uint64_t _zone_words = 0;
+
+    /* Container sets of large tags, empty without a containers section */
+    std::span<const index_format::container_set_entry> _container_sets;
+    const std::byte* _containers = nullptr;
+
+    name_dictionary _names;
+
+    template <typename T>
+    [[nodiscard]] std::span<const T> _typed_section(index_format::section_type type) const {
+        auto bytes = section(type);
+        if (!bytes) {
+            throw std::runtime_error { "index is missing section " + std::to_string(static_cast<uint32_t>(type)) };
+        }
+
+        return { reinterpret_cast<const T*>(bytes->data()), bytes->size() / sizeof(T) };
+    }
+
+    public:
+    index_file() = default;
+
+    explicit index_file(const std::filesystem::path& path) : _file { path } {
+        if (_file.size() < sizeof(index_format::header)) {
+            throw std::runtime_error { "index file too small" };
+        }
+
+        std::memcpy(&_header, _file.data(), sizeof(_header));
+
+        if (_header.magic != index_format::magic) {
+            throw std::runtime_error { "error reading magic string" };
+        }
+
+        if (_header.version != index_format::version) {
+            throw std::runtime_error { "unsupported index version " + std::to_string(_header.version) + ", rebuild the index" };
+        }
+
+        const size_t directory_end = sizeof(index_format::header)
+            + (_header.section_count * sizeof(index_format::section_entry));
+
+        if (directory_end > _file.size()) {
+            throw std::runtime_error { "truncated section directory" };
+        }
+
+        _sections = {
+            reinterpret_cast<const index_format::section_entry*>(_file.data() + sizeof(index_format::header)),
+            _header.section_count
+        };
+
+        for (const index_format::section_entry& entry : _sections) {
+            if (entry.offset + entry.size > _file.size() || (entry.offset % index_format::alignment) != 0) {
+                throw std::runtime_error { "invalid section " + std::to_string(static_cast<uint32_t>(entry.type)) };
+            }
+        }
+
+        _tags = _typed_section<index_format::tag_entry>(index_format::section_type::tag_table);
+        if (auto compressed = section(index_format::section_type::compressed_postings); compressed) {
+            _compressed = compressed->data();
+        } else {
+            _postings = _typed_section<uint32_t>(index_format::section_type::postings);
+
+            /* Indexes written before skip entries existed just don't have them */
+            if (section(index_format::section_type::skips)) {
+                _skips = _typed_section<uint32_t>(index_format::section_type::skips);
+            }
+        }
+
+        if (_tags.size() != _header.tag_count) {
+            throw std::runtime_error { "tag table size mismatch" };
+        }
+
+        if (auto bitmaps = section(index_format::section_type::bitmaps); bitmaps) {
+            std::memcpy(&_bitmap_header, bitmaps->data(), sizeof(_bitmap_header));
+
+            const size_t tags_size = _bitmap_header.count * sizeof(uint32_t);
+            const size_t bitmaps_offset = index_format::align(sizeof(_bitmap_header) + tags_size);
+
+            if (bitmaps_offset + (_bitmap_header.count * _bitmap_header.bitmap_size) > bitmaps->size()
+                || _bitmap_header.bitmap_size < index_format::bitmap_size(_header.max_post)) {
+                throw std::runtime_error { "invalid bitmaps section" };
+            }
+
+            _bitmap_tags = {
+                reinterpret_cast<const uint32_t*>(bitmaps->data() + sizeof(_bitmap_header)),
+                _bitmap_header.count
+            };
+
+            _bitmaps = bitmaps->data() + bitmaps_offset;
+        }
+
+        /* Indexes written before zone maps existed just don't have them */
+        if (auto zones = section(index_format::section_type::zones); zones) {
+            index_format::zones_header zones_header {};
+            if (zones->size() < sizeof(zones_header)) {
+                throw std::runtime_error { "invalid zones section" };
+            }
+
+            std::memcpy(&zones_header, zones->data(), sizeof(zones_header));
+
+            if (zones_header.zone_posts != index_format::zone_posts
+                || zones_header.count != _bitmap_header.count
+                || zones_header.zone_words < index_format::zone_words(_header.max_post)
+                || sizeof(zones_header) + (zones_header.count * zones_header.zone_words * sizeof(uint64_t)) > zones->size()) {
+                throw std::runtime_error { "invalid zones section" };
+            }
+
+            _zones = {
+                reinterpret_cast<const uint64_t*>(zones->data() + sizeof(zones_header)),
+                zones_header.count * zones_header.zone_words
+            };
+
+            _zone_words = zones_header.zone_words;
+        }
+
+        /* Indexes written before container sets existed just don't have them */
+        if (auto containers = section(index_format::section_type::containers); containers) {
+            index_format::containers_header containers_header {};
+            if (containers->size() < sizeof(containers_header)) {
+                throw std::runtime_error { "invalid containers section" };
+            }
+
+            std::memcpy(&containers_header, containers->data(), sizeof(containers_header));
+            if (sizeof(containers_header) + (containers_header.count * sizeof(index_format::container_set_entry)) > containers->size()) {
+                throw std::runtime_error { "invalid containers section" };
+            }
+
+            _container_sets = {
+                reinterpret_cast<const index_format::container_set_entry*>(containers->data() + sizeof(containers_header)),
+                containers_header.count
+            };
+
+            for (const index_format::container_set_entry& entry : _container_sets) {
+                const uint64_t size = roaring_bitmap::serialized_size(entry.container_count, entry.value_count, entry.word_count);
+
+                if (entry.tag >= _header.tag_count || (entry.offset % index_format::alignment) != 0 || entry.offset + size > containers->size()) {
+                    throw std::runtime_error { "invalid containers section" };
+                }
+            }
+
+            _containers = containers->data();
+        }
+
+        if (auto names = section(index_format::section_type::tag_names); names) {
+            _names = name_dictionary { *names };
+        }
+    }
+
+    [[nodiscard]] std::optional<std::span<const std::byte>> section(index_format::section_type type) const {
+        for (const index_format::section_entry& entry : _sections) {
+            if (entry.type == type) {
+                return std::span { _file.data() + entry.offset, entry.size };
+            }
+        }
+
+        return std::nullopt;
+    }
+
+    [[nodiscard]] const mapped_file& file() const { return _file; }
+    [[nodiscard]] uint32_t max_post() const { return _header.max_post; }
+    [[nodiscard]] uint32_t tag_count() const { return _header.tag_count; }
+    [[nodiscard]] size_t size() const { return _header.tag_count; }
+    [[nodiscard]] size_t size_bytes() const { return _file.size(); }
+
+    [[nodiscard]] uint32_t post_count(uint32_t tag) const {
+        return _tags[tag].count;
+    }
+
+    /* Minimum post count for a precomputed bitmap, 0 if the index has no bitmaps */
+    [[nodiscard]] uint32_t bitmap_threshold() const { return _bitmap_header.threshold; }
+
+    /* Tags that have a bitmap, ascending */
+    [[nodiscard]] std::span<const uint32_t> bitmap_tags() const { return _bitmap_tags; }
+
+    /* Bitmap for the i-th entry of bitmap_tags() */
+    [[nodiscard]] std::span<const std::byte> bitmap(size_t i) const {
+        return { _bitmaps + (i * _bitmap_header.bitmap_size), _bitmap_header.bitmap_size };
+    }
+
+    /* Zone map for the i-th entry of bitmap_tags(), see index_format::zones_header. Empty if the index has none */
+    [[nodiscard]] std::span<const uint64_t> zones(size_t i) const {
+        if (_zones.empty()) {
+            return {};
+        }
+
+        return _zones.subspan(i * _zone_words, _zone_words);
+    }
+
+    /* Tags with a container set, see index_format::containers_header */
+    [[nodiscard]] std::span<const index_format::container_set_entry> container_sets() const { return _container_sets; }
+
+    /* View of the i-th entry of container_sets(), valid as long as the index is mapped */
+    [[nodiscard]] roaring_bitmap containers(size_t i) const {
+        const index_format::container_set_entry& entry = _container_sets[i];
+        const uint64_t size = roaring_bitmap::serialized_size(entry.container_count, entry.value_count, entry.word_count);
+        return roaring_bitmap::view({ _containers + entry.offset, size }, entry.container_count, entry.value_count, entry.word_count, entry.cardinality);
+    }
+
+    /* Tag name -> tag ID, empty if the index has no tag names */
+    [[nodiscard]] const name_dictionary& tag_names() const { return _names; }
+
+    [[nodiscard]] std::optional<uint32_t> find_tag(std::string_view name) const {
+        return _names.find(name);
+    }
+
+    /* Whether posting lists are only available through compressed() */
+    [[nodiscard]] bool is_compressed() const { return _compressed != nullptr; }
+
+    [[nodiscard]] compressed_list compressed(uint32_t tag) const {
+        const index_format::tag_entry& entry = _tags[tag];
+        return { _compressed + entry.offset, entry.count };
+    }
+
+    /* Raw posting list, only valid if the index isn't compressed */
+    [[nodiscard]] std::span<const uint32_t> operator[](uint32_t tag) const {
+        const index_format::tag_entry& entry = _tags[tag];
+        return _postings.subspan(entry.offset, entry.count);
+    }
+
+    /* Skip entries of a raw posting list, empty for short lists or without a skips section */
+    [[nodiscard]] std::span<const uint32_t> skips(uint32_t tag) const {
+        const index_format::tag_entry& entry = _tags[tag];
+        if (_skips.empty() || entry.count <= index_format::skip_posts) {
+            return {};
+        }
+
+        const size_t count = (entry.count + index_format::skip_posts - 1) / index_format::skip_posts;
+        if (entry.skip_offset + count > _skips.size()) {
+            throw std::runtime_error { "invalid skip entries for tag " + std::to_string(tag) };
+        }
+
+        return _skips.subspan(entry.skip_offset, count);
+    }
+
+    [[nodiscard]] std::span<const uint32_t> at(uint32_t tag) const {
+        if (tag >= _tags.size()) {
+            throw std::out_of_range { "tag " + std::to_string(tag) + " out of range" };
+        }
+
+        if (is_compressed()) {
+            throw std::logic_error { "posting lists are compressed" };
+        }
+
+        return (*this)[tag];
+    }
+};
+
+#endif /* INDEX_FILE_H */
@@ -0,0 +1,226 @@
+#ifndef INDEX_FORMAT_H
+#define INDEX_FORMAT_H
+
+#include <array>
+#include <cstdint>
+#include <cstddef>
+
+/* On-disk layout of index.bin, version 2.
+ *
+ * All integers are little-endian. The file is laid out as:
+ *
+ *   header                      64 bytes
+ *   section directory           section_count * sizeof(section_entry)
+ *   sections                    each starting on an `alignment` boundary
+ *
+ * Sections are found through the directory by their type, so readers can skip
+ * sections they don't know about. Every posting array starts on an `alignment`
+ * boundary as well, so the query tools can use them in-place from a memory mapping.
+ */
+namespace index_format {
+    static constexpr std::array<char, 4> magic { 'A', 'w', 'o', 'o' };
+    static constexpr uint32_t version = 2;
+
+    /* Alignment of every section and every posting array, in bytes */
+    static constexpr size_t alignment = 64;
+
+    /* Number of post IDs in one aligned unit */
+    static constexpr size_t posts_per_alignment = alignment / sizeof(uint32_t);
+
+    enum class section_type : uint32_t {
+        /* tag_count tag_entry structs */
+        tag_table = 1,
+
+        /* Sorted post IDs of every tag, each list padded to the alignment */
+        postings = 2,
+
+        /* Precomputed bitmaps for dense tags, see bitmap_header */
+        bitmaps = 3,
+
+        /* Sorted, front-coded tag name -> tag ID dictionary, see names_header */
+        tag_names = 4,
+
+        /* Delta-encoded, bit-packed posting lists, replaces the postings section. See block_entry */
+        compressed_postings = 5,
+
+        /* Skip entries of the raw posting lists, see tag_entry::skip_offset */
+        skips = 6,
+
+        /* Zone maps of the bitmaps, see zones_header */
+        zones = 7,
+
+        /* Roaring sets of large tags, see containers_header */
+        containers = 8,
+    };
+
+    struct header {
+        std::array<char, 4> magic;
+        uint32_t version;
+
+        /* Highest post ID in the index */
+        uint32_t max_post;
+
+        /* Number of entries in the tag table, highest tag ID + 1 */
+        uint32_t tag_count;
+
+        uint32_t section_count;
+
+        uint32_t reserved[11];
+    };
+
+    struct section_entry {
+        section_type type;
+        uint32_t reserved;
+
+        /* Absolute byte offset and size */
+        uint64_t offset;
+        uint64_t size;
+    };
+
+    struct tag_entry {
+        /* Offset into the postings section in post IDs,
+         * or into the compressed postings section in bytes
+         */
+        uint64_t offset;
+
+        /* Number of posts with this tag */
+        uint32_t count;
+
+        /* Offset into the skips section in entries. A raw list with more than skip_posts posts has
+         * ceil(count / skip_posts) entries there, the last post ID of every run of skip_posts posts.
+         * Compressed lists have their block entries instead.
+         */
+        uint32_t skip_offset;
+    };
+
+    /* Start of the bitmaps section, followed by `count` ascending tag IDs,
+     * padding up to the alignment, and `count` bitmaps of `bitmap_size` bytes each.
+     *
+     * Post ID p is bit (p % 8) of byte (p / 8) of a bitmap.
+     */
+    struct bitmap_header {
+        /* Every tag with at least this many posts has a bitmap */
+        uint32_t threshold;
+        uint32_t count;
+
+        /* Size of a single bitmap in bytes, a multiple of the alignment */
+        uint64_t bitmap_size;
+
+        uint32_t reserved[12];
+    };
+
+    /* Start of the zones section, followed by one zone map of `zone_words` uint64 words for every
+     * bitmap, in the order of the bitmaps section.
+     *
+     * Zone z covers post IDs [z * zone_posts, (z + 1) * zone_posts), and is bit (z % 64) of word
+     * (z / 64) of a zone map when the bitmap has any bit set in that range.
+     */
+    struct zones_header {
+        uint32_t zone_posts;
+        uint32_t count;
+
+        uint64_t zone_words;
+
+        uint32_t reserved[12];
+    };
+
+    /* Start of the containers section, followed by `count` container_set_entry structs, padding
+     * up to the alignment, and the sets, each starting on an alignment boundary. A set is laid out
+     * as written by roaring_bitmap::write_to().
+     *
+     * Tags with a bitmap only have a set when it's less than half the size of the bitmap.
+     */
+    struct containers_header {
+        /* Tags with at least this many posts are considered */
+        uint32_t threshold;
+        uint32_t count;
+
+        uint32_t reserved[14];
+    };
+
+    struct container_set_entry {
+        uint32_t tag;
+        uint32_t container_count;
+
+        /* Offset of the set from the start of the section, in bytes */
+        uint64_t offset;
+
+        uint64_t word_count;
+        uint32_t value_count;
+        uint32_t reserved;
+
+        /* Number of posts in the set */
+        uint64_t cardinality;
+    };
+
+    /* Start of the tag names section, followed by `block_count` uint32 block offsets,
+     * padding up to the alignment, and the blocks themselves.
+     *
+     * Names are sorted bytewise and grouped into blocks of `block_size`. Every entry is
+     *   varint shared prefix length, varint suffix length, suffix bytes, varint tag ID
+     * where the shared prefix is relative to the previous name in the block. The first
+     * name of every block is stored in full, so blocks can be binary searched.
+     */
+    struct names_header {
+        uint32_t count;
+        uint32_t block_size;
+        uint32_t block_count;
+
+        uint32_t reserved[13];
+    };
+
+    /* A compressed posting list is ceil(count / 128) block entries, padding up to 32 bytes,
+     * then the blocks. Every full block holds 128 deltas of `bits` bits each, relative to the
+     * previous post ID, laid out as described in simd::bitpack. A partial last block has
+     * `bits` 0 and stores its post IDs as-is.
+     */
+    struct block_entry {
+        /* Post ID preceding the block, 0 for the first block */
+        uint32_t base;
+
+        /* Last post ID in the block */
+        uint32_t max;
+
+        /* Offset of the packed block from the start of the list, in bytes */
+        uint32_t offset;
+
+        /* Bits per delta, 0 for a raw block */
+        uint32_t bits;
+    };
+
+    static constexpr size_t block_posts = 128;
+
+    /* Posts per zone, 4 KiB of a bitmap */
+    static constexpr size_t zone_posts = 4096 * 8;
+
+    /* Posts per skip entry */
+    static constexpr size_t skip_posts = 128;
+
+    static_assert(sizeof(header) == alignment);
+    static_assert(sizeof(bitmap_header) == alignment);
+    static_assert(sizeof(names_header) == alignment);
+    static_assert(sizeof(zones_header) == alignment);
+    static_assert(sizeof(containers_header) == alignment);
+    static_assert(sizeof(container_set_entry) == 40);
+    static_assert(sizeof(section_entry) == 24);
+    static_assert(sizeof(tag_entry) == 16);
+    static_assert(sizeof(block_entry) == 16);
+
+    [[nodiscard]] constexpr uint64_t align(uint64_t n) {
+        return (n + alignment - 1) & ~uint64_t { alignment - 1 };
+    }
+
+    [[nodiscard]] constexpr uint64_t bitmap_size(uint32_t max_post) {
+        return align((max_post / 8) + 1);
+    }
+
+    [[nodiscard]] constexpr uint64_t zone_words(uint32_t max_post) {
+        return ((max_post / zone_posts) + 64) / 64;
+    }
+
+    [[nodiscard]] constexpr uint64_t align_posts(uint64_t n) {
+        return (n + posts_per_alignment - 1) & ~uint64_t { posts_per_alignment - 1 };
+    }
+}
+
+#endif /* INDEX_FORMAT_H */
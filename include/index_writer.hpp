@@ -0,0 +1,433 @@
+#ifndef INDEX_WRITER_H
+#define INDEX_WRITER_H
+
+#include <filesystem>
+#include <fstream>
+#include <stdexcept>
+#include <span>
+#include <vector>
+#include <array>
+#include <algorithm>
+#include <cstdint>
+#include <cstddef>
+#include <utility>
+
+#include "index_format.hpp"
+#include "mapped_file.hpp"
+#include "compressed_postings.hpp"
+#include "roaring.hpp"
+
+/* Writes index.bin, see index_format.hpp for the layout.
+ *
+ * Posting lists are appended in ascending tag order, either piece by piece or as a
+ * complete, already aligned postings section. Everything derived from the posting
+ * lists is written by finish(), which reads them back from the file itself.
+ *
+ * When compressing, the raw posting lists go to a temporary file next to the index instead,
+ * and finish() writes the compressed postings section from there.
+ */
+class index_writer {
+    public:
+    /* Space reserved for the section directory */
+    static constexpr size_t max_sections = 16;
+
+    private:
+    /* A stream and the number of bytes written to it */
+    struct output {
+        std::ofstream stream;
+        uint64_t offset = 0;
+
+        void write(const void* data, size_t size) {
+            stream.write(static_cast<const char*>(data), size);
+            offset += size;
+        }
+
+        /* Zero-fill up to the next aligned offset */
+        void pad() {
+            static constexpr std::array<char, index_format::alignment> zeroes {};
+            write(zeroes.data(), index_format::align(offset) - offset);
+        }
+    };
+
+    std::filesystem::path _path;
+    output _out;
+
+    uint32_t _mask_threshold;
+
+    /* Raw posting lists when compressing */
+    bool _compress;
+    std::filesystem::path _raw_path;
+    output _raw;
+
+    std::vector<index_format::section_entry> _sections;
+    std::vector<index_format::tag_entry> _tags;
+
+    /* Tag currently being appended to */
+    uint32_t _current_tag = 0;
+    bool _has_tag = false;
+
+    /* Sections that don't depend on the posting lists, written by finish() */
+    std::vector<std::pair<index_format::section_type, std::vector<std::byte>>> _extra_sections;
+
+    uint64_t _posts_written = 0;
+    uint32_t _bitmaps_written = 0;
+    uint32_t _containers_written = 0;
+
+    void _write(const void* data, size_t size) { _out.write(data, size); }
+    void _pad() { _out.pad(); }
+
+    /* Where posting lists go */
+    [[nodiscard]] output& _postings_out() { return _compress ? _raw : _out; }
+
+    void _begin_section(index_format::section_type type) {
+        if (_sections.size() == max_sections) {
+            throw std::runtime_error { "too many index sections" };
+        }
+
+        _pad();
+        _sections.push_back({ .type = type, .reserved = 0, .offset = _out.offset, .size = 0 });
+    }
+
+    void _end_section() {
+        _sections.back().size = _out.offset - _sections.back().offset;
+        _pad();
+    }
+
+    [[nodiscard]] const index_format::section_entry& _section(index_format::section_type type) const {
+        return *std::ranges::find(_sections, type, &index_format::section_entry::type);
+    }
+
+    /* Offset of the next post in the raw posting lists, in post IDs */
+    [[nodiscard]] uint64_t _postings_position() const {
+        const uint64_t start = _compress ? 0 : _sections.back().offset;
+        return ((_compress ? _raw.offset : _out.offset) - start) / sizeof(uint32_t);
+    }
+
+    void _end_tag() {
+        if (_has_tag) {
+            _postings_out().pad();
+            _has_tag = false;
+        }
+    }
+
+    void _write_compressed(const uint32_t* postings) {
+        _begin_section(index_format::section_type::compressed_postings);
+
+        std::vector<std::byte> encoded;
+        for (index_format::tag_entry& entry : _tags) {
+            if (entry.count == 0) {
+                continue;
+            }
+
+            encode_postings({ postings + entry.offset, entry.count }, encoded);
+
+            /* Tag entries now point into the compressed section */
+            entry.offset = _out.offset - _sections.back().offset;
+            _write(encoded.data(), encoded.size());
+            _pad();
+        }
+
+        _end_section();
+    }
+
+    void _write_skips(const uint32_t* postings) {
+        _begin_section(index_format::section_type::skips);
+
+        uint32_t entries = 0;
+        std::vector<uint32_t> skips;
+        for (index_format::tag_entry& entry : _tags) {
+            if (entry.count <= index_format::skip_posts) {
+                continue;
+            }
+
+            skips.clear();
+            for (size_t i = index_format::skip_posts - 1; i < entry.count; i += index_format::skip_posts) {
+                skips.push_back(postings[entry.offset + i]);
+            }
+
+            if (entry.count % index_format::skip_posts != 0) {
+                skips.push_back(postings[entry.offset + entry.count - 1]);
+            }
+
+            entry.skip_offset = entries;
+            entries += static_cast<uint32_t>(skips.size());
+            _write(skips.data(), skips.size() * sizeof(uint32_t));
+        }
+
+        _end_section();
+    }
+
+    void _write_bitmaps(const uint32_t* postings, uint32_t max_post) {
+        std::vector<uint32_t> bitmap_tags;
+        if (_mask_threshold > 0) {
+            for (uint32_t i = 0; i < _tags.size(); ++i) {
+                if (_tags[i].count >= _mask_threshold) {
+                    bitmap_tags.push_back(i);
+                }
+            }
+        }
+
+        index_format::bitmap_header header {
+            .threshold = _mask_threshold,
+            .count = static_cast<uint32_t>(bitmap_tags.size()),
+            .bitmap_size = index_format::bitmap_size(max_post),
+            .reserved = {},
+        };
+
+        _begin_section(index_format::section_type::bitmaps);
+        _write(&header, sizeof(header));
+        _write(bitmap_tags.data(), bitmap_tags.size() * sizeof(uint32_t));
+        _pad();
+
+        /* Built one at a time, the zone maps are small enough to keep until the bitmaps are done */
+        const uint64_t zone_words = index_format::zone_words(max_post);
+        std::vector<uint64_t> zones(bitmap_tags.size() * zone_words);
+
+        std::vector<uint8_t> bitmap(header.bitmap_size);
+        for (size_t i = 0; i < bitmap_tags.size(); ++i) {
+            std::ranges::fill(bitmap, 0);
+
+            uint64_t* zone_map = zones.data() + (i * zone_words);
+            for (uint32_t post : std::span { postings + _tags[bitmap_tags[i]].offset, _tags[bitmap_tags[i]].count }) {
+                bitmap[post / 8] |= uint8_t{1} << (post % 8);
+
+                const uint32_t zone = post / index_format::zone_posts;
+                zone_map[zone / 64] |= uint64_t{1} << (zone % 64);
+            }
+
+            _write(bitmap.data(), bitmap.size());
+        }
+
+        _end_section();
+
+        _bitmaps_written = header.count;
+
+        index_format::zones_header zones_header {
+            .zone_posts = index_format::zone_posts,
+            .count = header.count,
+            .zone_words = zone_words,
+            .reserved = {},
+        };
+
+        _begin_section(index_format::section_type::zones);
+        _write(&zones_header, sizeof(zones_header));
+        _write(zones.data(), zones.size() * sizeof(uint64_t));
+        _end_section();
+    }
+
+    void _write_containers(const uint32_t* postings, uint32_t max_post) {
+        std::vector<uint32_t> candidates;
+        for (uint32_t i = 0; i < _tags.size(); ++i) {
+            if (_tags[i].count >= roaring_bitmap::max_array) {
+                candidates.push_back(i);
+            }
+        }
+
+        _begin_section(index_format::section_type::containers);
+
+        /* Which candidates get a set is only known once it's built, so the header and entries
+         * are written last, into space reserved for all of them
+         */
+        const uint64_t table = _out.offset;
+        const std::vector<char> placeholder(sizeof(index_format::containers_header) + (candidates.size() * sizeof(index_format::container_set_entry)));
+        _write(placeholder.data(), placeholder.size());
+        _pad();
+
+        std::vector<index_format::container_set_entry> entries;
+        std::vector<std::byte> data;
+        for (uint32_t tag : candidates) {
+            const roaring_bitmap set = roaring_bitmap::from_sorted({ postings + _tags[tag].offset, _tags[tag].count });
+
+            /* A bitmap isn't much slower to intersect with, and it's already there */
+            const bool has_bitmap = _mask_threshold > 0 && _tags[tag].count >= _mask_threshold;
+            if (has_bitmap && (set.size_bytes() * 2) >= index_format::bitmap_size(max_post)) {
+                continue;
+            }
+
+            entries.push_back({
+                .tag = tag,
+                .container_count = static_cast<uint32_t>(set.container_count()),
+                .offset = _out.offset - _sections.back().offset,
+                .word_count = set.word_count(),
+                .value_count = static_cast<uint32_t>(set.value_count()),
+                .reserved = 0,
+                .cardinality = set.cardinality(),
+            });
+
+            data.clear();
+            set.write_to(data);
+            _write(data.data(), data.size());
+            _pad();
+        }
+
+        const uint64_t end = _out.offset;
+
+        index_format::containers_header header {
+            .threshold = roaring_bitmap::max_array,
+            .count = static_cast<uint32_t>(entries.size()),
+            .reserved = {},
+        };
+
+        _out.stream.seekp(table);
+        _out.stream.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        _out.stream.write(reinterpret_cast<const char*>(entries.data()), entries.size() * sizeof(index_format::container_set_entry));
+        _out.stream.seekp(end);
+
+        _end_section();
+
+        _containers_written = header.count;
+    }
+
+    public:
+    index_writer(std::filesystem::path path, uint32_t tag_count, uint32_t mask_threshold, bool compress = false)
+        : _path { std::move(path) }
+        , _out { .stream = std::ofstream { _path, std::ios::out | std::ios::binary | std::ios::trunc } }
+        , _mask_threshold { mask_threshold }
+        , _compress { compress }
+        , _tags(tag_count) {
+        if (!_out.stream) {
+            throw std::runtime_error { "failed to open " + _path.string() };
+        }
+
+        if (_compress) {
+            _raw_path = _path;
+            _raw_path += ".postings";
+
+            _raw.stream = std::ofstream { _raw_path, std::ios::out | std::ios::binary | std::ios::trunc };
+            if (!_raw.stream) {
+                throw std::runtime_error { "failed to open " + _raw_path.string() };
+            }
+        }
+
+        /* Header, directory and tag table are only known at the end, reserve space for them */
+        const std::vector<char> placeholder(sizeof(index_format::header) + (max_sections * sizeof(index_format::section_entry)));
+        _write(placeholder.data(), placeholder.size());
+
+        _begin_section(index_format::section_type::tag_table);
+        const std::vector<index_format::tag_entry> tag_table(tag_count);
+        _write(tag_table.data(), tag_table.size() * sizeof(index_format::tag_entry));
+        _end_section();
+
+        if (!_compress) {
+            _begin_section(index_format::section_type::postings);
+        }
+    }
+
+    index_writer(const index_writer&) = delete;
+    index_writer& operator=(const index_writer&) = delete;
+
+    ~index_writer() {
+        if (!_raw_path.empty()) {
+            _raw.stream.close();
+
+            std::error_code ec;
+            std::filesystem::remove(_raw_path, ec);
+        }
+    }
+
+    /* Append posts to a tag's posting list, tags must be appended in ascending order */
+    void append(uint32_t tag, std::span<const uint32_t> posts) {
+        if (!_has_tag || tag != _current_tag) {
+            if (_has_tag && tag < _current_tag) {
+                throw std::logic_error { "tags must be appended in ascending order" };
+            }
+
+            _end_tag();
+
+            _current_tag = tag;
+            _has_tag = true;
+            _tags[tag].offset = _postings_position();
+        }
+
+        _postings_out().write(posts.data(), posts.size_bytes());
+        _tags[tag].count += posts.size();
+        _posts_written += posts.size();
+    }
+
+    /* Write a complete postings section at once, laid out as described by offsets and counts */
+    void append_section(std::span<const uint32_t> postings, std::span<const uint64_t> offsets, std::span<const uint32_t> counts) {
+        if (_has_tag || _postings_position() != 0) {
+            throw std::logic_error { "postings section already started" };
+        }
+
+        for (uint32_t i = 0; i < _tags.size(); ++i) {
+            if (counts[i] > 0) {
+                _tags[i] = { .offset = offsets[i], .count = counts[i], .skip_offset = 0 };
+                _posts_written += counts[i];
+            }
+        }
+
+        _postings_out().write(postings.data(), postings.size_bytes());
+    }
+
+    /* Add a complete section, written after the posting lists */
+    void add_section(index_format::section_type type, std::vector<std::byte> data) {
+        _extra_sections.emplace_back(type, std::move(data));
+    }
+
+    void finish(uint32_t max_post) {
+        _end_tag();
+        if (!_compress) {
+            _end_section();
+        }
+
+        /* Read the posting lists back through the page cache instead of keeping them around */
+        _postings_out().stream.flush();
+        mapped_file raw_file { _compress ? _raw_path : _path };
+
+        const uint32_t* postings = reinterpret_cast<const uint32_t*>(raw_file.data()
+            + (_compress ? 0 : _section(index_format::section_type::postings).offset));
+
+        _write_bitmaps(postings, max_post);
+        _write_containers(postings, max_post);
+
+        if (_compress) {
+            _write_compressed(postings);
+        } else {
+            _write_skips(postings);
+        }
+
+        raw_file.unmap();
+
+        for (auto& [type, data] : _extra_sections) {
+            _begin_section(type);
+            _write(data.data(), data.size());
+            _end_section();
+
+            data = {};
+        }
+
+        const uint64_t total_size = _out.offset;
+
+        index_format::header header {
+            .magic = index_format::magic,
+            .version = index_format::version,
+            .max_post = max_post,
+            .tag_count = static_cast<uint32_t>(_tags.size()),
+            .section_count = static_cast<uint32_t>(_sections.size()),
+            .reserved = {},
+        };
+
+        _out.stream.seekp(0);
+        _out.write(&header, sizeof(header));
+        _out.write(_sections.data(), _sections.size() * sizeof(index_format::section_entry));
+
+        _out.stream.seekp(_section(index_format::section_type::tag_table).offset);
+        _out.write(_tags.data(), _tags.size() * sizeof(index_format::tag_entry));
+
+        _out.stream.flush();
+        if (!_out.stream || (_compress && !_raw.stream)) {
+            throw std::runtime_error { "failed writing " + _path.string() };
+        }
+
+        _out.offset = total_size;
+    }
+
+    [[nodiscard]] uint64_t bytes_written() const { return _out.offset; }
+    [[nodiscard]] uint64_t posts_written() const { return _posts_written; }
+    [[nodiscard]] uint32_t bitmaps_written() const { return _bitmaps_written; }
+    [[nodiscard]] uint32_t containers_written() const { return _containers_written; }
+    [[nodiscard]] size_t tag_count() const { return _tags.size(); }
+};
+
+#endif /* INDEX_WRITER_H */
@@ -0,0 +1,120 @@
+#ifndef MAPPED_FILE_H
+#define MAPPED_FILE_H
+
+#include <filesystem>
+#include <string>
+#include <string_view>
+#include <algorithm>
+#include <stdexcept>
+#include <span>
+#include <utility>
+#include <cstddef>
+#include <cerrno>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* Read-only, shared memory mapping of an entire file.
+ * Pages are shared through the page cache between every process mapping the same file.
+ */
+class mapped_file {
+    const std::byte* _ptr = nullptr;
+    size_t _size = 0;
+
+    [[noreturn]] static void _fail(const std::filesystem::path& path, std::string_view what) {
+        throw std::runtime_error {
+            std::string { what } + " " + path.string() + ": " + std::strerror(errno)
+        };
+    }
+
+    public:
+    mapped_file() = default;
+
+    explicit mapped_file(const std::filesystem::path& path) {
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            _fail(path, "couldn't open");
+        }
+
+        struct stat st {};
+        if (::fstat(fd, &st) != 0) {
+            ::close(fd);
+            _fail(path, "couldn't stat");
+        }
+
+        _size = static_cast<size_t>(st.st_size);
+
+        if (_size > 0) {
+            void* ptr = ::mmap(nullptr, _size, PROT_READ, MAP_SHARED, fd, 0);
+            if (ptr == MAP_FAILED) {
+                ::close(fd);
+                _fail(path, "couldn't map");
+            }
+
+            _ptr = static_cast<const std::byte*>(ptr);
+        }
+
+        /* The mapping keeps its own reference to the file */
+        ::close(fd);
+    }
+
+    mapped_file(const mapped_file&) = delete;
+    mapped_file& operator=(const mapped_file&) = delete;
+
+    mapped_file(mapped_file&& other) noexcept
+        : _ptr { std::exchange(other._ptr, nullptr) }
+        , _size { std::exchange(other._size, 0) } {
+    }
+
+    mapped_file& operator=(mapped_file&& other) noexcept {
+        unmap();
+
+        _ptr = std::exchange(other._ptr, nullptr);
+        _size = std::exchange(other._size, 0);
+
+        return *this;
+    }
+
+    ~mapped_file() { unmap(); }
+
+    void unmap() {
+        if (_ptr) {
+            ::munmap(const_cast<std::byte*>(_ptr), _size);
+            _ptr = nullptr;
+        }
+
+        _size = 0;
+    }
+
+    /* Hint the kernel about the expected access pattern of a range, e.g. MADV_WILLNEED */
+    void advise(size_t offset, size_t length, int advice) const {
+        if (!_ptr || offset >= _size) {
+            return;
+        }
+
+        /* madvise needs a page-aligned start */
+        static const size_t page_size = static_cast<size_t>(::sysconf(_SC_PAGESIZE));
+        size_t aligned = offset & ~(page_size - 1);
+        length = std::min(length + (offset - aligned), _size - aligned);
+
+        ::madvise(const_cast<std::byte*>(_ptr) + aligned, length, advice);
+    }
+
+    /* Number of readable (zero) bytes past the end of the file, up to the end of its last page */
+    [[nodiscard]] size_t padding() const {
+        static const size_t page_size = static_cast<size_t>(::sysconf(_SC_PAGESIZE));
+        return _ptr ? (page_size - (_size % page_size)) % page_size : 0;
+    }
+
+    [[nodiscard]] const std::byte* data() const { return _ptr; }
+    [[nodiscard]] size_t size() const { return _size; }
+    [[nodiscard]] std::span<const std::byte> bytes() const { return { _ptr, _size }; }
+    [[nodiscard]] std::string_view chars() const { return { reinterpret_cast<const char*>(_ptr), _size }; }
+
+    [[nodiscard]] explicit operator bool() const noexcept { return _ptr; }
+};
+
+#endif /* MAPPED_FILE_H */
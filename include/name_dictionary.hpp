@@ -0,0 +1,180 @@
+#ifndef NAME_DICTIONARY_H
+#define NAME_DICTIONARY_H
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <span>
+#include <optional>
+#include <stdexcept>
+#include <algorithm>
+#include <utility>
+#include <cstdint>
+#include <cstring>
+
+#include "index_format.hpp"
+
+/* Read-only view of a tag names section, see index_format::names_header for the layout.
+ *
+ * A lookup binary searches the full names at the start of every block and decodes at most
+ * one block, so nothing has to be loaded or hashed up front.
+ */
+class name_dictionary {
+    index_format::names_header _header {};
+    std::span<const uint32_t> _block_offsets;
+    std::span<const std::byte> _blocks;
+
+    [[nodiscard]] static uint32_t _read_varint(const std::byte*& p) {
+        uint32_t val = 0;
+        for (uint32_t shift = 0;; shift += 7) {
+            uint8_t b = static_cast<uint8_t>(*p++);
+            val |= uint32_t { b & 0x7fu } << shift;
+
+            if ((b & 0x80) == 0) {
+                return val;
+            }
+        }
+    }
+
+    static void _write_varint(std::vector<std::byte>& out, uint32_t val) {
+        while (val >= 0x80) {
+            out.push_back(static_cast<std::byte>((val & 0x7f) | 0x80));
+            val >>= 7;
+        }
+
+        out.push_back(static_cast<std::byte>(val));
+    }
+
+    /* Name of the first entry of a block, stored in full */
+    [[nodiscard]] std::string_view _block_head(uint32_t block) const {
+        const std::byte* p = _blocks.data() + _block_offsets[block];
+        (void) _read_varint(p);
+        uint32_t length = _read_varint(p);
+
+        return { reinterpret_cast<const char*>(p), length };
+    }
+
+    public:
+    /* Default number of names per block */
+    static constexpr uint32_t default_block_size = 16;
+
+    name_dictionary() = default;
+
+    explicit name_dictionary(std::span<const std::byte> section) {
+        if (section.size() < sizeof(_header)) {
+            throw std::runtime_error { "invalid tag names section" };
+        }
+
+        std::memcpy(&_header, section.data(), sizeof(_header));
+
+        const size_t blocks_offset = index_format::align(sizeof(_header) + (_header.block_count * sizeof(uint32_t)));
+        if (blocks_offset > section.size() || _header.block_size == 0
+            || _header.block_count != (_header.count + _header.block_size - 1) / _header.block_size) {
+            throw std::runtime_error { "invalid tag names section" };
+        }
+
+        _block_offsets = {
+            reinterpret_cast<const uint32_t*>(section.data() + sizeof(_header)),
+            _header.block_count
+        };
+
+        _blocks = section.subspan(blocks_offset);
+    }
+
+    /* Encode (name, ID) pairs as a tag names section, the pairs are sorted by name in-place */
+    [[nodiscard]] static std::vector<std::byte> encode(std::vector<std::pair<std::string_view, uint32_t>>& names,
+                                                       uint32_t block_size = default_block_size) {
+        std::ranges::sort(names);
+
+        index_format::names_header header {
+            .count = static_cast<uint32_t>(names.size()),
+            .block_size = block_size,
+            .block_count = static_cast<uint32_t>((names.size() + block_size - 1) / block_size),
+            .reserved = {},
+        };
+
+        std::vector<uint32_t> block_offsets;
+        block_offsets.reserve(header.block_count);
+
+        std::vector<std::byte> blocks;
+        std::string_view previous;
+        for (size_t i = 0; i < names.size(); ++i) {
+            const auto& [name, id] = names[i];
+
+            size_t shared = 0;
+            if (i % block_size == 0) {
+                block_offsets.push_back(static_cast<uint32_t>(blocks.size()));
+            } else {
+                shared = std::ranges::mismatch(previous, name).in2 - name.begin();
+            }
+
+            _write_varint(blocks, static_cast<uint32_t>(shared));
+            _write_varint(blocks, static_cast<uint32_t>(name.size() - shared));
+            const std::byte* suffix = reinterpret_cast<const std::byte*>(name.data() + shared);
+            blocks.insert(blocks.end(), suffix, suffix + (name.size() - shared));
+            _write_varint(blocks, id);
+
+            previous = name;
+        }
+
+        const size_t blocks_offset = index_format::align(sizeof(header) + (block_offsets.size() * sizeof(uint32_t)));
+
+        const auto* header_bytes = reinterpret_cast<const std::byte*>(&header);
+        const auto* offset_bytes = reinterpret_cast<const std::byte*>(block_offsets.data());
+
+        std::vector<std::byte> result;
+        result.reserve(blocks_offset + blocks.size());
+        result.insert(result.end(), header_bytes, header_bytes + sizeof(header));
+        result.insert(result.end(), offset_bytes, offset_bytes + (block_offsets.size() * sizeof(uint32_t)));
+        result.resize(blocks_offset, std::byte { 0 });
+        result.insert(result.end(), blocks.begin(), blocks.end());
+
+        return result;
+    }
+
+    [[nodiscard]] size_t size() const { return _header.count; }
+    [[nodiscard]] bool empty() const { return _header.count == 0; }
+
+    [[nodiscard]] std::optional<uint32_t> find(std::string_view name) const {
+        if (_header.block_count == 0) {
+            return std::nullopt;
+        }
+
+        /* Last block whose first name is <= name */
+        uint32_t lo = 0;
+        uint32_t hi = _header.block_count;
+        while (hi - lo > 1) {
+            uint32_t mid = lo + ((hi - lo) / 2);
+            if (_block_head(mid) <= name) {
+                lo = mid;
+            } else {
+                hi = mid;
+            }
+        }
+
+        const std::byte* p = _blocks.data() + _block_offsets[lo];
+        const uint32_t entries = std::min<uint32_t>(_header.block_size, _header.count - (lo * _header.block_size));
+
+        std::string current;
+        for (uint32_t i = 0; i < entries; ++i) {
+            uint32_t shared = _read_varint(p);
+            uint32_t length = _read_varint(p);
+
+            current.resize(shared);
+            current.append(reinterpret_cast<const char*>(p), length);
+            p += length;
+
+            uint32_t id = _read_varint(p);
+
+            if (current == name) {
+                return id;
+            } else if (current > name) {
+                break;
+            }
+        }
+
+        return std::nullopt;
+    }
+};
+
+#endif /* NAME_DICTIONARY_H */
@@ -0,0 +1,159 @@
+#ifndef QUERY_H
+#define QUERY_H
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <optional>
+#include <stdexcept>
+#include <algorithm>
+#include <ranges>
+#include <span>
+#include <cstdint>
+
+/* Boolean tag queries.
+ *
+ * A query is a whitespace-separated list of terms, all of which must match:
+ *   tag         posts with the tag
+ *   -tag        posts without the tag
+ *   ~tag        posts with at least one of the ~ terms of the same group
+ *   ( ... )     a sub-query, can be prefixed with - or ~ as well
+ *
+ * Tag names can contain parentheses themselves, so grouping parentheses must stand alone.
+ * Every group needs at least one term that isn't excluded, there is no "all posts" set.
+ */
+class query_error : public std::runtime_error {
+    public:
+    using std::runtime_error::runtime_error;
+};
+
+struct query_node {
+    enum class node_type {
+        /* A single tag */
+        tag,
+
+        /* All children must match, negated children must not */
+        all,
+
+        /* Any child matches */
+        any,
+    };
+
+    node_type type = node_type::all;
+    bool negated = false;
+
+    uint32_t tag = 0;
+    std::vector<query_node> children;
+
+    /* Whether this is a plain list of tags that must all match */
+    [[nodiscard]] bool is_conjunction() const {
+        if (type == node_type::tag) {
+            return !negated;
+        }
+
+        return type == node_type::all && !negated && std::ranges::all_of(children, [](const query_node& child) {
+            return child.type == node_type::tag && !child.negated;
+        });
+    }
+
+    /* Tags of a conjunction */
+    [[nodiscard]] std::vector<uint32_t> tags() const {
+        if (type == node_type::tag) {
+            return { tag };
+        }
+
+        std::vector<uint32_t> result;
+        for (const query_node& child : children) {
+            result.push_back(child.tag);
+        }
+
+        return result;
+    }
+};
+
+namespace detail {
+    template <typename Resolve>
+    query_node parse_group(std::span<const std::string_view> tokens, size_t& pos, Resolve& resolve, bool nested) {
+        std::vector<query_node> all;
+        std::vector<query_node> any;
+
+        while (pos < tokens.size()) {
+            std::string_view token = tokens[pos++];
+
+            if (token == ")") {
+                if (!nested) {
+                    throw query_error { "unbalanced )" };
+                }
+
+                nested = false;
+                break;
+            }
+
+            bool negated = false;
+            bool optional = false;
+            if (token.size() > 1 && token.front() == '-') {
+                negated = true;
+                token.remove_prefix(1);
+            } else if (token.size() > 1 && token.front() == '~') {
+                optional = true;
+                token.remove_prefix(1);
+            }
+
+            if (token.starts_with('-') || token.starts_with('~')) {
+                throw query_error { "conflicting prefixes in " + std::string { tokens[pos - 1] } };
+            }
+
+            query_node node;
+            if (token == "(") {
+                node = parse_group(tokens, pos, resolve, true);
+            } else {
+                std::optional<uint32_t> id = resolve(token);
+                if (!id) {
+                    throw query_error { "unknown tag: " + std::string { token } };
+                }
+
+                node = { .type = query_node::node_type::tag, .negated = false, .tag = *id, .children = {} };
+            }
+
+            node.negated = negated;
+            (optional ? any : all).push_back(std::move(node));
+        }
+
+        if (nested) {
+            throw query_error { "unbalanced (" };
+        }
+
+        /* A single ~ term is just a required term */
+        if (any.size() == 1) {
+            all.push_back(std::move(any.front()));
+        } else if (!any.empty()) {
+            all.push_back({ .type = query_node::node_type::any, .negated = false, .tag = 0, .children = std::move(any) });
+        }
+
+        if (std::ranges::none_of(all, [](const query_node& node) { return !node.negated; })) {
+            throw query_error { all.empty() ? "empty query" : "query only excludes tags" };
+        }
+
+        if (all.size() == 1) {
+            return std::move(all.front());
+        }
+
+        return { .type = query_node::node_type::all, .negated = false, .tag = 0, .children = std::move(all) };
+    }
+}
+
+/* Parse a query, resolving tag names through resolve(std::string_view) -> std::optional<uint32_t> */
+template <typename Resolve>
+[[nodiscard]] query_node parse_query(std::string_view query, Resolve&& resolve) {
+    std::vector<std::string_view> tokens;
+    for (const auto token : std::views::split(query, ' ')) {
+        if (!token.empty()) {
+            tokens.emplace_back(token.begin(), token.end());
+        }
+    }
+
+    size_t pos = 0;
+    return detail::parse_group(tokens, pos, resolve, false);
+}
+
+#endif /* QUERY_H */
@@ -0,0 +1,745 @@
+#ifndef ROARING_H
+#define ROARING_H
+
+#include <span>
+#include <array>
+#include <vector>
+#include <algorithm>
+#include <bit>
+#include <iterator>
+#include <type_traits>
+#include <cstdint>
+#include <cstddef>
+
+/* Roaring-style hybrid set of post IDs.
+ *
+ * IDs are split into chunks of 65536 by their upper 16 bits, and every non-empty chunk gets
+ * whichever container is smallest for it:
+ *   - array:  sorted lower 16 bits, at most 4096 of them
+ *   - bitmap: 65536 bits
+ *   - run:    sorted (start, length - 1) pairs of consecutive IDs
+ *
+ * Empty chunks take no space at all, and every set operation only visits chunks present in
+ * its operands. Full-width bitmaps (post p at bit p % 64 of word p / 64) can be combined with
+ * a set in-place, which is what the query tools keep their intermediate results in.
+ *
+ * A set either owns its storage or is a view of a serialized one, see write_to() and view().
+ */
+class roaring_bitmap {
+    public:
+    static constexpr uint32_t chunk_bits = 65536;
+    static constexpr uint32_t chunk_words = chunk_bits / 64;
+
+    /* Largest array container, anything larger is always at least as small as a bitmap */
+    static constexpr uint32_t max_array = 4096;
+
+    enum class container_type : uint8_t {
+        array,
+        bitmap,
+        run,
+    };
+
+    private:
+    struct container {
+        /* Upper 16 bits of every ID in the container */
+        uint16_t key;
+        container_type type;
+        uint8_t reserved = 0;
+
+        uint32_t cardinality;
+
+        /* Offset into _values (array, run) or _words (bitmap) */
+        uint32_t offset;
+
+        /* Number of values for an array, number of pairs for a run */
+        uint32_t size;
+    };
+
+    /* Serialized as-is */
+    static_assert(sizeof(container) == 16 && std::is_trivially_copyable_v<container>);
+
+    using chunk_t = std::array<uint64_t, chunk_words>;
+
+    /* Storage of a set built in memory, empty for views */
+    std::vector<container> _container_data;
+    std::vector<uint16_t> _value_data;
+    std::vector<uint64_t> _word_data;
+
+    std::span<const container> _containers;
+    std::span<const uint16_t> _values;
+    std::span<const uint64_t> _words;
+    uint64_t _cardinality = 0;
+
+    /* Point the views at the storage, once a set is built */
+    void _publish() {
+        _containers = _container_data;
+        _values = _value_data;
+        _words = _word_data;
+    }
+
+    [[nodiscard]] std::span<const uint16_t> _array(const container& c) const {
+        return { _values.data() + c.offset, c.size };
+    }
+
+    [[nodiscard]] std::span<const uint16_t> _runs(const container& c) const {
+        return { _values.data() + c.offset, c.size * 2 };
+    }
+
+    [[nodiscard]] std::span<const uint64_t> _bitmap(const container& c) const {
+        return { _words.data() + c.offset, chunk_words };
+    }
+
+    /* Set bits [first, last] */
+    static void _set_range(std::span<uint64_t> words, uint32_t first, uint32_t last) {
+        const uint32_t first_word = first / 64;
+        const uint32_t last_word = last / 64;
+
+        const uint64_t first_mask = ~uint64_t { 0 } << (first % 64);
+        const uint64_t last_mask = ~uint64_t { 0 } >> (63 - (last % 64));
+
+        if (first_word == last_word) {
+            words[first_word] |= first_mask & last_mask;
+            return;
+        }
+
+        words[first_word] |= first_mask;
+        std::fill(words.begin() + first_word + 1, words.begin() + last_word, ~uint64_t { 0 });
+        words[last_word] |= last_mask;
+    }
+
+    /* Expand any container into a chunk-sized bitmap */
+    void _materialize(const container& c, chunk_t& out) const {
+        switch (c.type) {
+            case container_type::bitmap:
+                std::ranges::copy(_bitmap(c), out.begin());
+                break;
+
+            case container_type::array:
+                out.fill(0);
+                for (uint16_t v : _array(c)) {
+                    out[v / 64] |= uint64_t { 1 } << (v % 64);
+                }
+                break;
+
+            case container_type::run: {
+                out.fill(0);
+                std::span<const uint16_t> runs = _runs(c);
+                for (size_t i = 0; i < runs.size(); i += 2) {
+                    _set_range(out, runs[i], runs[i] + runs[i + 1]);
+                }
+                break;
+            }
+        }
+    }
+
+    [[nodiscard]] bool _contains(const container& c, uint16_t v) const {
+        switch (c.type) {
+            case container_type::bitmap:
+                return (_words[c.offset + (v / 64)] >> (v % 64)) & 1;
+
+            case container_type::array:
+                return std::ranges::binary_search(_array(c), v);
+
+            case container_type::run: {
+                std::span<const uint16_t> runs = _runs(c);
+
+                /* Last run starting at or before v */
+                size_t lo = 0;
+                size_t hi = c.size;
+                while (lo < hi) {
+                    size_t mid = (lo + hi) / 2;
+                    if (runs[mid * 2] <= v) {
+                        lo = mid + 1;
+                    } else {
+                        hi = mid;
+                    }
+                }
+
+                return lo > 0 && v <= (runs[(lo - 1) * 2] + runs[((lo - 1) * 2) + 1]);
+            }
+        }
+
+        return false;
+    }
+
+    void _append_array(uint16_t key, std::span<const uint16_t> values) {
+        if (values.empty()) {
+            return;
+        }
+
+        if (values.size() > max_array) {
+            chunk_t words {};
+            for (uint16_t v : values) {
+                words[v / 64] |= uint64_t { 1 } << (v % 64);
+            }
+
+            _append_bitmap(key, words);
+            return;
+        }
+
+        _container_data.push_back({
+            .key = key, .type = container_type::array, .cardinality = static_cast<uint32_t>(values.size()),
+            .offset = static_cast<uint32_t>(_value_data.size()), .size = static_cast<uint32_t>(values.size())
+        });
+
+        _value_data.insert(_value_data.end(), values.begin(), values.end());
+        _cardinality += values.size();
+    }
+
+    /* Append a chunk, as an array if it's sparse enough */
+    void _append_bitmap(uint16_t key, std::span<const uint64_t> words) {
+        uint32_t cardinality = 0;
+        for (uint64_t word : words) {
+            cardinality += std::popcount(word);
+        }
+
+        if (cardinality == 0) {
+            return;
+        }
+
+        if (cardinality <= max_array) {
+            _container_data.push_back({
+                .key = key, .type = container_type::array, .cardinality = cardinality,
+                .offset = static_cast<uint32_t>(_value_data.size()), .size = cardinality
+            });
+
+            for (uint32_t i = 0; i < chunk_words; ++i) {
+                for (uint64_t word = words[i]; word; word &= word - 1) {
+                    _value_data.push_back(static_cast<uint16_t>((i * 64) + std::countr_zero(word)));
+                }
+            }
+        } else {
+            _container_data.push_back({
+                .key = key, .type = container_type::bitmap, .cardinality = cardinality,
+                .offset = static_cast<uint32_t>(_word_data.size()), .size = chunk_words
+            });
+
+            _word_data.insert(_word_data.end(), words.begin(), words.end());
+        }
+
+        _cardinality += cardinality;
+    }
+
+    void _append_copy(const roaring_bitmap& other, const container& c) {
+        if (c.type == container_type::bitmap) {
+            _append_bitmap(c.key, other._bitmap(c));
+        } else if (c.type == container_type::array) {
+            _append_array(c.key, other._array(c));
+        } else {
+            std::span<const uint16_t> runs = other._runs(c);
+
+            _container_data.push_back({
+                .key = c.key, .type = container_type::run, .cardinality = c.cardinality,
+                .offset = static_cast<uint32_t>(_value_data.size()), .size = c.size
+            });
+
+            _value_data.insert(_value_data.end(), runs.begin(), runs.end());
+            _cardinality += c.cardinality;
+        }
+    }
+
+    /* Chunk of a full-width bitmap covered by a container, may be partial at the end */
+    [[nodiscard]] static std::span<uint64_t> _chunk_of(std::span<uint64_t> words, uint16_t key) {
+        const size_t begin = std::min<size_t>(size_t { key } * chunk_words, words.size());
+        return words.subspan(begin, std::min<size_t>(chunk_words, words.size() - begin));
+    }
+
+    public:
+    roaring_bitmap() = default;
+
+    roaring_bitmap(const roaring_bitmap& other)
+        : _container_data { other._container_data }
+        , _value_data { other._value_data }
+        , _word_data { other._word_data }
+        , _containers { other._containers }
+        , _values { other._values }
+        , _words { other._words }
+        , _cardinality { other._cardinality } {
+        if (!_container_data.empty()) {
+            _publish();
+        }
+    }
+
+    roaring_bitmap& operator=(const roaring_bitmap& other) {
+        if (this != &other) {
+            *this = roaring_bitmap { other };
+        }
+
+        return *this;
+    }
+
+    /* Moving a vector keeps its buffer, so the views stay valid */
+    roaring_bitmap(roaring_bitmap&&) noexcept = default;
+    roaring_bitmap& operator=(roaring_bitmap&&) noexcept = default;
+
+    /* Bytes write_to() appends for a set of the given size */
+    [[nodiscard]] static constexpr uint64_t serialized_size(uint64_t containers, uint64_t values, uint64_t words) {
+        return (words * sizeof(uint64_t)) + (containers * sizeof(container)) + (values * sizeof(uint16_t));
+    }
+
+    [[nodiscard]] size_t value_count() const { return _values.size(); }
+    [[nodiscard]] size_t word_count() const { return _words.size(); }
+
+    /* Append the bitmap container words, the container descriptors, then the array and run values to `out` */
+    void write_to(std::vector<std::byte>& out) const {
+        for (std::span<const std::byte> part : { std::as_bytes(_words), std::as_bytes(_containers), std::as_bytes(_values) }) {
+            out.insert(out.end(), part.begin(), part.end());
+        }
+    }
+
+    /* View of a set serialized by write_to(), `data` must be aligned to 8 bytes and outlive the view */
+    [[nodiscard]] static roaring_bitmap view(std::span<const std::byte> data, size_t containers, size_t values, size_t words, uint64_t cardinality) {
+        roaring_bitmap result;
+        result._words = { reinterpret_cast<const uint64_t*>(data.data()), words };
+        result._containers = { reinterpret_cast<const container*>(data.data() + result._words.size_bytes()), containers };
+        result._values = { reinterpret_cast<const uint16_t*>(data.data() + result._words.size_bytes() + result._containers.size_bytes()), values };
+        result._cardinality = cardinality;
+        return result;
+    }
+
+    /* Build from sorted, unique IDs */
+    [[nodiscard]] static roaring_bitmap from_sorted(std::span<const uint32_t> ids) {
+        roaring_bitmap result;
+
+        std::vector<uint16_t> values;
+        std::vector<uint16_t> runs;
+
+        for (auto it = ids.begin(); it != ids.end();) {
+            const uint16_t key = *it >> 16;
+
+            values.clear();
+            runs.clear();
+
+            for (; it != ids.end() && (*it >> 16) == key; ++it) {
+                const uint16_t v = *it & 0xFFFF;
+
+                if (!runs.empty() && (runs[runs.size() - 2] + runs.back() + 1) == v) {
+                    ++runs.back();
+                } else {
+                    runs.push_back(v);
+                    runs.push_back(0);
+                }
+
+                values.push_back(v);
+            }
+
+            /* Pick the smallest container */
+            const size_t array_bytes = values.size() * sizeof(uint16_t);
+            const size_t run_bytes = runs.size() * sizeof(uint16_t);
+            const size_t bitmap_bytes = chunk_words * sizeof(uint64_t);
+
+            if (run_bytes < std::min(array_bytes, bitmap_bytes)) {
+                result._container_data.push_back({
+                    .key = key, .type = container_type::run, .cardinality = static_cast<uint32_t>(values.size()),
+                    .offset = static_cast<uint32_t>(result._value_data.size()), .size = static_cast<uint32_t>(runs.size() / 2)
+                });
+
+                result._value_data.insert(result._value_data.end(), runs.begin(), runs.end());
+                result._cardinality += values.size();
+            } else {
+                result._append_array(key, values);
+            }
+        }
+
+        result._publish();
+        return result;
+    }
+
+    [[nodiscard]] uint64_t cardinality() const { return _cardinality; }
+    [[nodiscard]] bool empty() const { return _cardinality == 0; }
+    [[nodiscard]] size_t container_count() const { return _containers.size(); }
+
+    [[nodiscard]] size_t count(container_type type) const {
+        return std::ranges::count(_containers, type, &container::type);
+    }
+
+    [[nodiscard]] size_t size_bytes() const {
+        return (_containers.size() * sizeof(container)) + (_values.size() * sizeof(uint16_t)) + (_words.size() * sizeof(uint64_t));
+    }
+
+    [[nodiscard]] bool contains(uint32_t id) const {
+        auto it = std::ranges::lower_bound(_containers, static_cast<uint16_t>(id >> 16), {}, &container::key);
+        return it != _containers.end() && it->key == (id >> 16) && _contains(*it, id & 0xFFFF);
+    }
+
+    /* Call func(id) for every ID, in ascending order */
+    template <typename Func>
+    void for_each(Func&& func) const {
+        for (const container& c : _containers) {
+            const uint32_t high = uint32_t { c.key } << 16;
+
+            if (c.type == container_type::array) {
+                for (uint16_t v : _array(c)) {
+                    func(high | v);
+                }
+            } else if (c.type == container_type::run) {
+                std::span<const uint16_t> runs = _runs(c);
+                for (size_t i = 0; i < runs.size(); i += 2) {
+                    for (uint32_t v = runs[i]; v <= uint32_t { runs[i] } + runs[i + 1]; ++v) {
+                        func(high | v);
+                    }
+                }
+            } else {
+                std::span<const uint64_t> words = _bitmap(c);
+                for (uint32_t i = 0; i < chunk_words; ++i) {
+                    for (uint64_t word = words[i]; word; word &= word - 1) {
+                        func(high | ((i * 64) + std::countr_zero(word)));
+                    }
+                }
+            }
+        }
+    }
+
+    /* Call func(first, last) with the lowest and highest ID of every container, in ascending order */
+    template <typename Func>
+    void for_each_extent(Func&& func) const {
+        for (const container& c : _containers) {
+            const uint32_t high = uint32_t { c.key } << 16;
+
+            if (c.type == container_type::array) {
+                std::span<const uint16_t> values = _array(c);
+                func(high | values.front(), high | values.back());
+            } else if (c.type == container_type::run) {
+                std::span<const uint16_t> runs = _runs(c);
+                func(high | runs.front(), high | (uint32_t { runs[runs.size() - 2] } + runs.back()));
+            } else {
+                std::span<const uint64_t> words = _bitmap(c);
+                const auto first = static_cast<uint32_t>(std::ranges::find_if(words, [](uint64_t word) { return word != 0; }) - words.begin());
+                const auto last = static_cast<uint32_t>(std::ranges::find_if(words.rbegin(), words.rend(), [](uint64_t word) { return word != 0; }).base() - words.begin()) - 1;
+
+                func(high | ((first * 64) + std::countr_zero(words[first])), high | ((last * 64) + 63 - std::countl_zero(words[last])));
+            }
+        }
+    }
+
+    /* Call func(id) for every ID that is also set in a full-width bitmap, in ascending order */
+    template <typename Func>
+    void for_each_in(std::span<const uint64_t> words, Func&& func) const {
+        for (const container& c : _containers) {
+            const size_t begin = size_t { c.key } * chunk_words;
+            if (begin >= words.size()) {
+                break;
+            }
+
+            const uint32_t high = uint32_t { c.key } << 16;
+
+            if (c.type == container_type::bitmap) {
+                std::span<const uint64_t> bitmap = _bitmap(c);
+                const size_t end = std::min<size_t>(chunk_words, words.size() - begin);
+
+                for (size_t i = 0; i < end; ++i) {
+                    for (uint64_t word = bitmap[i] & words[begin + i]; word; word &= word - 1) {
+                        func(high | static_cast<uint32_t>((i * 64) + std::countr_zero(word)));
+                    }
+                }
+            } else {
+                auto test = [&](uint32_t id) {
+                    if ((id / 64) < words.size() && ((words[id / 64] >> (id % 64)) & 1)) {
+                        func(id);
+                    }
+                };
+
+                if (c.type == container_type::array) {
+                    for (uint16_t v : _array(c)) {
+                        test(high | v);
+                    }
+                } else {
+                    std::span<const uint16_t> runs = _runs(c);
+                    for (size_t i = 0; i < runs.size(); i += 2) {
+                        for (uint32_t v = runs[i]; v <= uint32_t { runs[i] } + runs[i + 1]; ++v) {
+                            test(high | v);
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    /* words &= *this */
+    void and_into(std::span<uint64_t> words) const {
+        size_t next_word = 0;
+        chunk_t chunk;
+
+        for (const container& c : _containers) {
+            std::span<uint64_t> target = _chunk_of(words, c.key);
+            if (target.empty()) {
+                break;
+            }
+
+            /* Chunks without a container are empty */
+            std::fill(words.begin() + next_word, words.begin() + (target.data() - words.data()), 0);
+            next_word = (target.data() - words.data()) + target.size();
+
+            if (c.type == container_type::array) {
+                /* Collect the bits of all values in the same word, words without any values are cleared */
+                std::span<const uint16_t> values = _array(c);
+
+                size_t next = 0;
+                for (auto it = values.begin(); it != values.end() && (*it / 64) < target.size();) {
+                    const uint32_t word = *it / 64;
+
+                    uint64_t bits = 0;
+                    for (; it != values.end() && (*it / 64) == word; ++it) {
+                        bits |= uint64_t { 1 } << (*it % 64);
+                    }
+
+                    std::fill(target.begin() + next, target.begin() + word, 0);
+                    target[word] &= bits;
+                    next = word + 1;
+                }
+
+                std::fill(target.begin() + std::min(next, target.size()), target.end(), 0);
+            } else {
+                const uint64_t* bitmap = _words.data() + c.offset;
+                if (c.type == container_type::run) {
+                    _materialize(c, chunk);
+                    bitmap = chunk.data();
+                }
+
+                for (size_t i = 0; i < target.size(); ++i) {
+                    target[i] &= bitmap[i];
+                }
+            }
+        }
+
+        std::fill(words.begin() + next_word, words.end(), 0);
+    }
+
+    /* words |= *this */
+    void or_into(std::span<uint64_t> words) const {
+        for (const container& c : _containers) {
+            std::span<uint64_t> target = _chunk_of(words, c.key);
+            if (target.empty()) {
+                break;
+            }
+
+            if (c.type == container_type::array) {
+                for (uint16_t v : _array(c)) {
+                    if ((v / 64) < target.size()) {
+                        target[v / 64] |= uint64_t { 1 } << (v % 64);
+                    }
+                }
+            } else if (c.type == container_type::run) {
+                std::span<const uint16_t> runs = _runs(c);
+                for (size_t i = 0; i < runs.size(); i += 2) {
+                    const uint32_t last = std::min<uint32_t>(runs[i] + runs[i + 1], (target.size() * 64) - 1);
+                    if (runs[i] <= last) {
+                        _set_range(target, runs[i], last);
+                    }
+                }
+            } else {
+                std::span<const uint64_t> bitmap = _bitmap(c);
+                for (size_t i = 0; i < target.size(); ++i) {
+                    target[i] |= bitmap[i];
+                }
+            }
+        }
+    }
+
+    /* out |= the words [first, first + out.size()) of *this as a full-width bitmap, for sampling ID ranges */
+    void or_range_into(size_t first, std::span<uint64_t> out) const {
+        for (size_t done = 0; done < out.size();) {
+            const size_t word = first + done;
+            const size_t offset = word % chunk_words;
+            const size_t count = std::min<size_t>(out.size() - done, chunk_words - offset);
+
+            const auto key = static_cast<uint16_t>(word / chunk_words);
+            auto it = std::ranges::lower_bound(_containers, key, {}, &container::key);
+
+            if (it != _containers.end() && it->key == key) {
+                std::span<uint64_t> target = out.subspan(done, count);
+
+                /* Range of lower bits covered by target */
+                const auto lo = static_cast<uint32_t>(offset * 64);
+                const auto hi = static_cast<uint32_t>(((offset + count) * 64) - 1);
+
+                if (it->type == container_type::bitmap) {
+                    std::span<const uint64_t> bitmap = _bitmap(*it).subspan(offset, count);
+                    for (size_t i = 0; i < count; ++i) {
+                        target[i] |= bitmap[i];
+                    }
+                } else if (it->type == container_type::array) {
+                    std::span<const uint16_t> values = _array(*it);
+                    for (auto v = std::ranges::lower_bound(values, lo); v != values.end() && *v <= hi; ++v) {
+                        target[(*v - lo) / 64] |= uint64_t { 1 } << (*v % 64);
+                    }
+                } else {
+                    std::span<const uint16_t> runs = _runs(*it);
+                    for (size_t i = 0; i < runs.size(); i += 2) {
+                        const uint32_t start = std::max<uint32_t>(runs[i], lo);
+                        const uint32_t last = std::min<uint32_t>(uint32_t { runs[i] } + runs[i + 1], hi);
+                        if (start <= last) {
+                            _set_range(target, start - lo, last - lo);
+                        }
+                    }
+                }
+            }
+
+            done += count;
+        }
+    }
+
+    /* words &= ~*this */
+    void andnot_into(std::span<uint64_t> words) const {
+        chunk_t chunk;
+
+        for (const container& c : _containers) {
+            std::span<uint64_t> target = _chunk_of(words, c.key);
+            if (target.empty()) {
+                break;
+            }
+
+            if (c.type == container_type::array) {
+                for (uint16_t v : _array(c)) {
+                    if ((v / 64) < target.size()) {
+                        target[v / 64] &= ~(uint64_t { 1 } << (v % 64));
+                    }
+                }
+            } else {
+                const uint64_t* bitmap = _words.data() + c.offset;
+                if (c.type == container_type::run) {
+                    _materialize(c, chunk);
+                    bitmap = chunk.data();
+                }
+
+                for (size_t i = 0; i < target.size(); ++i) {
+                    target[i] &= ~bitmap[i];
+                }
+            }
+        }
+    }
+
+    /* Chunk-wise intersection, only chunks present in both are visited */
+    [[nodiscard]] friend roaring_bitmap operator&(const roaring_bitmap& lhs, const roaring_bitmap& rhs) {
+        roaring_bitmap result;
+        chunk_t lhs_chunk;
+        chunk_t rhs_chunk;
+        std::vector<uint16_t> values;
+
+        auto l = lhs._containers.begin();
+        auto r = rhs._containers.begin();
+        while (l != lhs._containers.end() && r != rhs._containers.end()) {
+            if (l->key < r->key) {
+                ++l;
+            } else if (r->key < l->key) {
+                ++r;
+            } else {
+                if (l->type == container_type::array && r->type == container_type::array) {
+                    values.clear();
+                    std::ranges::set_intersection(lhs._array(*l), rhs._array(*r), std::back_inserter(values));
+                    result._append_array(l->key, values);
+                } else if (l->type == container_type::array || r->type == container_type::array) {
+                    /* Probe the other container for every array value */
+                    const bool left_array = l->type == container_type::array;
+                    const roaring_bitmap& array_set = left_array ? lhs : rhs;
+                    const roaring_bitmap& other_set = left_array ? rhs : lhs;
+                    const container& array = left_array ? *l : *r;
+                    const container& other = left_array ? *r : *l;
+
+                    values.clear();
+                    for (uint16_t v : array_set._array(array)) {
+                        if (other_set._contains(other, v)) {
+                            values.push_back(v);
+                        }
+                    }
+
+                    result._append_array(l->key, values);
+                } else {
+                    lhs._materialize(*l, lhs_chunk);
+                    rhs._materialize(*r, rhs_chunk);
+                    for (size_t i = 0; i < chunk_words; ++i) {
+                        lhs_chunk[i] &= rhs_chunk[i];
+                    }
+
+                    result._append_bitmap(l->key, lhs_chunk);
+                }
+
+                ++l;
+                ++r;
+            }
+        }
+
+        result._publish();
+        return result;
+    }
+
+    /* Chunk-wise union, chunks present in only one operand are copied as-is */
+    [[nodiscard]] friend roaring_bitmap operator|(const roaring_bitmap& lhs, const roaring_bitmap& rhs) {
+        roaring_bitmap result;
+        chunk_t lhs_chunk;
+        chunk_t rhs_chunk;
+        std::vector<uint16_t> values;
+
+        auto l = lhs._containers.begin();
+        auto r = rhs._containers.begin();
+        while (l != lhs._containers.end() || r != rhs._containers.end()) {
+            if (r == rhs._containers.end() || (l != lhs._containers.end() && l->key < r->key)) {
+                result._append_copy(lhs, *l++);
+            } else if (l == lhs._containers.end() || r->key < l->key) {
+                result._append_copy(rhs, *r++);
+            } else {
+                if (l->type == container_type::array && r->type == container_type::array
+                    && (l->cardinality + r->cardinality) <= max_array) {
+                    values.clear();
+                    std::ranges::set_union(lhs._array(*l), rhs._array(*r), std::back_inserter(values));
+                    result._append_array(l->key, values);
+                } else {
+                    lhs._materialize(*l, lhs_chunk);
+                    rhs._materialize(*r, rhs_chunk);
+                    for (size_t i = 0; i < chunk_words; ++i) {
+                        lhs_chunk[i] |= rhs_chunk[i];
+                    }
+
+                    result._append_bitmap(l->key, lhs_chunk);
+                }
+
+                ++l;
+                ++r;
+            }
+        }
+
+        result._publish();
+        return result;
+    }
+
+    /* Chunk-wise difference lhs \ rhs */
+    [[nodiscard]] friend roaring_bitmap andnot(const roaring_bitmap& lhs, const roaring_bitmap& rhs) {
+        roaring_bitmap result;
+        chunk_t lhs_chunk;
+        chunk_t rhs_chunk;
+        std::vector<uint16_t> values;
+
+        auto r = rhs._containers.begin();
+        for (const container& l : lhs._containers) {
+            while (r != rhs._containers.end() && r->key < l.key) {
+                ++r;
+            }
+
+            if (r == rhs._containers.end() || r->key != l.key) {
+                result._append_copy(lhs, l);
+            } else if (l.type == container_type::array) {
+                values.clear();
+                for (uint16_t v : lhs._array(l)) {
+                    if (!rhs._contains(*r, v)) {
+                        values.push_back(v);
+                    }
+                }
+
+                result._append_array(l.key, values);
+            } else {
+                lhs._materialize(l, lhs_chunk);
+                rhs._materialize(*r, rhs_chunk);
+                for (size_t i = 0; i < chunk_words; ++i) {
+                    lhs_chunk[i] &= ~rhs_chunk[i];
+                }
+
+                result._append_bitmap(l.key, lhs_chunk);
+            }
+        }
+
+        result._publish();
+        return result;
+    }
+};
+
+#endif /* ROARING_H */
@@ -0,0 +1,377 @@
+#ifndef SCRATCH_ARENA_H
+#define SCRATCH_ARENA_H
+
+#include <span>
+#include <vector>
+#include <algorithm>
+#include <bit>
+#include <type_traits>
+#include <utility>
+#include <cstdint>
+#include <cstddef>
+
+#include "avx_buffer.hpp"
+
+/* Per-thread buffers that queries borrow and give back, so a query in a steady state doesn't allocate.
+ *
+ * Every thread has its own arena per element type, see local(). Buffers return to the arena they came
+ * from when destroyed, which must happen on the same thread.
+ *
+ * Buffers keep track of which blocks of `block_bytes` may hold anything but zeroes, so a buffer that
+ * has to start out zeroed only clears the blocks its previous users dirtied. Anything writing into a
+ * buffer that was handed out by zero() has to record that through touch() or dirty(). Growing a buffer
+ * through resize(), push_back() or assign() records the new elements by itself.
+ */
+template <typename T> requires std::is_trivially_copyable_v<T>
+class scratch_arena {
+    public:
+    /* Granularity of the dirty tracking */
+    static constexpr size_t block_bytes = 4096;
+    static constexpr size_t block_size = block_bytes / sizeof(T);
+
+    static_assert(block_bytes % sizeof(T) == 0);
+
+    class buffer;
+
+    private:
+    struct storage {
+        avx_buffer<T> data;
+
+        /* One bit per block of data */
+        std::vector<uint64_t> dirty;
+    };
+
+    std::vector<storage> _free;
+
+    /* Number of times a buffer had to be allocated */
+    size_t _allocations = 0;
+
+    [[nodiscard]] static constexpr size_t _blocks(size_t count) {
+        return (count + block_size - 1) / block_size;
+    }
+
+    /* Smallest free storage that holds count elements. If none does, the largest one is grown to it */
+    [[nodiscard]] storage _acquire(size_t count) {
+        auto best = _free.end();
+        for (auto it = _free.begin(); it != _free.end(); ++it) {
+            const bool fits = it->data.size() >= count;
+            if (best == _free.end()
+                || (fits && (best->data.size() < count || it->data.size() < best->data.size()))
+                || (!fits && best->data.size() < count && it->data.size() > best->data.size())) {
+                best = it;
+            }
+        }
+
+        storage result;
+        if (best != _free.end()) {
+            result = std::move(*best);
+            *best = std::move(_free.back());
+            _free.pop_back();
+        }
+
+        if (result.data.size() < count) {
+            /* Nothing is known about fresh memory */
+            result.data = avx_buffer<T>::uninitialized(count);
+            result.dirty.assign((_blocks(count) + 63) / 64, ~uint64_t { 0 });
+            ++_allocations;
+        }
+
+        return result;
+    }
+
+    void _release(storage&& s) {
+        _free.push_back(std::move(s));
+    }
+
+    public:
+    scratch_arena() = default;
+
+    scratch_arena(const scratch_arena&) = delete;
+    scratch_arena& operator=(const scratch_arena&) = delete;
+
+    /* The calling thread's arena */
+    [[nodiscard]] static scratch_arena& local() {
+        thread_local scratch_arena arena;
+        return arena;
+    }
+
+    /* A buffer of count elements with unspecified contents */
+    [[nodiscard]] buffer take(size_t count) {
+        buffer result { *this, _acquire(count), count };
+        result.touch_all();
+        return result;
+    }
+
+    /* A buffer of count zeroes, only clearing the blocks that were dirtied since its storage was last clean */
+    [[nodiscard]] buffer zero(size_t count) {
+        buffer result { *this, _acquire(count), count };
+
+        /* Whole blocks are cleared, even past count, so every cleared block is clean */
+        const size_t blocks = _blocks(count);
+        std::span<uint64_t> dirty = result.dirty();
+
+        for (size_t i = 0; i < dirty.size(); ++i) {
+            const uint64_t in_range = ((i + 1) * 64 <= blocks) ? ~uint64_t { 0 } : (uint64_t { 1 } << (blocks % 64)) - 1;
+
+            for (uint64_t word = dirty[i] & in_range; word; word &= word - 1) {
+                const size_t first = ((i * 64) + std::countr_zero(word)) * block_size;
+                std::fill_n(result.data() + first, std::min(block_size, result.capacity() - first), T {});
+            }
+
+            dirty[i] &= ~in_range;
+        }
+
+        return result;
+    }
+
+    [[nodiscard]] size_t allocations() const { return _allocations; }
+
+    /* Borrowed storage, goes back to its arena when destroyed */
+    class buffer {
+        friend class scratch_arena;
+
+        scratch_arena* _arena = nullptr;
+        storage _storage;
+        size_t _count = 0;
+
+        buffer(scratch_arena& arena, storage&& s, size_t count) : _arena { &arena }, _storage { std::move(s) }, _count { count } { }
+
+        void _release() {
+            if (_arena) {
+                _arena->_release(std::move(_storage));
+                _arena = nullptr;
+            }
+
+            _count = 0;
+        }
+
+        public:
+        using value_type = T;
+
+        buffer() = default;
+
+        buffer(const buffer&) = delete;
+        buffer& operator=(const buffer&) = delete;
+
+        buffer(buffer&& other) noexcept
+            : _arena { std::exchange(other._arena, nullptr) }
+            , _storage { std::move(other._storage) }
+            , _count { std::exchange(other._count, 0) } {
+        }
+
+        buffer& operator=(buffer&& other) noexcept {
+            if (this != &other) {
+                _release();
+
+                _arena = std::exchange(other._arena, nullptr);
+                _storage = std::move(other._storage);
+                _count = std::exchange(other._count, 0);
+            }
+
+            return *this;
+        }
+
+        ~buffer() { _release(); }
+
+        [[nodiscard]] size_t size() const { return _count; }
+        [[nodiscard]] bool empty() const { return _count == 0; }
+        [[nodiscard]] size_t capacity() const { return _storage.data.size(); }
+
+        [[nodiscard]] T* data() { return _storage.data.data(); }
+        [[nodiscard]] const T* data() const { return _storage.data.data(); }
+
+        [[nodiscard]] T* begin() { return data(); }
+        [[nodiscard]] T* end() { return data() + _count; }
+        [[nodiscard]] const T* begin() const { return data(); }
+        [[nodiscard]] const T* end() const { return data() + _count; }
+
+        [[nodiscard]] T& operator[](size_t i) { return data()[i]; }
+        [[nodiscard]] const T& operator[](size_t i) const { return data()[i]; }
+
+        [[nodiscard]] T& back() { return data()[_count - 1]; }
+        [[nodiscard]] const T& back() const { return data()[_count - 1]; }
+
+        /* Change the size, keeping the elements up to the old size. Growing past the capacity moves to
+         * storage at least twice as large, anything after the old size is unspecified. Whatever the
+         * buffer grows into is marked dirty, as the caller is about to write it.
+         */
+        void resize(size_t count) {
+            const size_t kept = _count;
+
+            if (count > capacity()) {
+                scratch_arena& arena = _arena ? *_arena : local();
+
+                storage grown = arena._acquire(std::max(count, 2 * capacity()));
+                std::copy_n(data(), _count, grown.data.data());
+
+                _release();
+
+                _arena = &arena;
+                _storage = std::move(grown);
+                _count = count;
+                touch_all();
+                return;
+            }
+
+            _count = count;
+            if (count > kept) {
+                touch(kept, count - kept);
+            }
+        }
+
+        void clear() { _count = 0; }
+
+        void push_back(T value) {
+            if (_count == capacity()) {
+                resize(_count + 1);
+                data()[_count - 1] = value;
+                return;
+            }
+
+            /* The block of the previous element is already marked */
+            if (_count % block_size == 0) {
+                touch(_count, 1);
+            }
+
+            data()[_count++] = value;
+        }
+
+        void assign(std::span<const T> values) {
+            clear();
+            resize(values.size());
+            std::ranges::copy(values, data());
+        }
+
+        /* One bit per block, set where the buffer may hold anything but zeroes */
+        [[nodiscard]] std::span<uint64_t> dirty() {
+            return std::span { _storage.dirty }.first((scratch_arena::_blocks(_count) + 63) / 64);
+        }
+
+        /* Record writes to [first, first + count), a count of 0 marks the block of `first` */
+        void touch(size_t first, size_t count) {
+            const size_t last = (count == 0) ? first : first + count - 1;
+            for (size_t block = first / block_size; block <= last / block_size && block < (_storage.dirty.size() * 64); ++block) {
+                _storage.dirty[block / 64] |= uint64_t { 1 } << (block % 64);
+            }
+        }
+
+        void touch_all() {
+            std::ranges::fill(dirty(), ~uint64_t { 0 });
+        }
+    };
+};
+
+/* Per-thread std::vectors, for elements a scratch_arena can't hold, like ones owning buffers themselves.
+ *
+ * Vectors are handed out empty and go back to the pool of the thread they came from when destroyed,
+ * keeping their capacity. Nested users each get their own, so as long as a query nests the same way
+ * as the previous one, none of them has to grow.
+ */
+template <typename T>
+class scratch_vectors {
+    public:
+    class vector;
+
+    private:
+    std::vector<std::vector<T>> _free;
+
+    public:
+    scratch_vectors() = default;
+
+    scratch_vectors(const scratch_vectors&) = delete;
+    scratch_vectors& operator=(const scratch_vectors&) = delete;
+
+    /* The calling thread's pool */
+    [[nodiscard]] static scratch_vectors& local() {
+        thread_local scratch_vectors pool;
+        return pool;
+    }
+
+    [[nodiscard]] vector take() {
+        vector result;
+        result._pool = this;
+
+        if (!_free.empty()) {
+            result._items = std::move(_free.back());
+            _free.pop_back();
+        }
+
+        return result;
+    }
+
+    /* Borrowed vector, goes back to its pool when destroyed */
+    class vector {
+        friend class scratch_vectors;
+
+        scratch_vectors* _pool = nullptr;
+        std::vector<T> _items;
+
+        void _release() {
+            if (_pool) {
+                _items.clear();
+                _pool->_free.push_back(std::move(_items));
+                _pool = nullptr;
+            }
+
+            _items.clear();
+        }
+
+        public:
+        using value_type = T;
+
+        vector() = default;
+
+        vector(const vector&) = delete;
+        vector& operator=(const vector&) = delete;
+
+        vector(vector&& other) noexcept
+            : _pool { std::exchange(other._pool, nullptr) }
+            , _items { std::move(other._items) } {
+        }
+
+        vector& operator=(vector&& other) noexcept {
+            if (this != &other) {
+                _release();
+
+                _pool = std::exchange(other._pool, nullptr);
+                _items = std::move(other._items);
+            }
+
+            return *this;
+        }
+
+        ~vector() { _release(); }
+
+        [[nodiscard]] size_t size() const { return _items.size(); }
+        [[nodiscard]] bool empty() const { return _items.empty(); }
+
+        [[nodiscard]] T* data() { return _items.data(); }
+        [[nodiscard]] const T* data() const { return _items.data(); }
+
+        [[nodiscard]] T* begin() { return _items.data(); }
+        [[nodiscard]] T* end() { return _items.data() + _items.size(); }
+        [[nodiscard]] const T* begin() const { return _items.data(); }
+        [[nodiscard]] const T* end() const { return _items.data() + _items.size(); }
+
+        [[nodiscard]] T& operator[](size_t i) { return _items[i]; }
+        [[nodiscard]] const T& operator[](size_t i) const { return _items[i]; }
+
+        [[nodiscard]] T& front() { return _items.front(); }
+        [[nodiscard]] const T& front() const { return _items.front(); }
+        [[nodiscard]] T& back() { return _items.back(); }
+        [[nodiscard]] const T& back() const { return _items.back(); }
+
+        void resize(size_t count) { _items.resize(count); }
+        void clear() { _items.clear(); }
+
+        void push_back(T&& value) { _items.push_back(std::move(value)); }
+        void push_back(const T& value) { _items.push_back(value); }
+
+        template <typename... Args>
+        T& emplace_back(Args&&... args) { return _items.emplace_back(std::forward<Args>(args)...); }
+
+        void pop_back() { _items.pop_back(); }
+    };
+};
+
+#endif /* SCRATCH_ARENA_H */
@@ -0,0 +1,372 @@
+#ifndef SET_OPS_H
+#define SET_OPS_H
+
+#include <span>
+#include <array>
+#include <algorithm>
+#include <bit>
+#include <cstdint>
+#include <cstddef>
+
+#include <immintrin.h>
+
+#include "simd.hpp"
+
+/* Kernels over sorted post ID lists.
+ *
+ * All of them write to a caller-provided buffer that's large enough for every possible result
+ * (the smaller input for intersections, the left input for differences) plus `slack` IDs, and
+ * return the number of IDs written.
+ *
+ * The intersections also come as a count_only variant that takes no buffer, for queries that
+ * only need the number of results.
+ */
+namespace set_ops {
+    /* Room the SIMD kernels may write past the end of the result */
+    static constexpr size_t slack = 8;
+
+    /* First position at or after `from` whose ID is >= target.
+     * Doubles the step until it overshoots, then binary searches the last step, so the cost is
+     * logarithmic in the distance travelled rather than in the list size.
+     */
+    [[nodiscard]] inline size_t gallop_to(std::span<const uint32_t> list, size_t from, uint32_t target) {
+        if (from >= list.size() || list[from] >= target) {
+            return from;
+        }
+
+        size_t step = 1;
+        size_t lo = from;
+        size_t hi = from + 1;
+        while (hi < list.size() && list[hi] < target) {
+            lo = hi;
+            step *= 2;
+            hi = from + step;
+        }
+
+        hi = std::min(hi, list.size());
+        return std::lower_bound(list.begin() + lo + 1, list.begin() + hi, target) - list.begin();
+    }
+
+    /* Number of IDs below target, for a list whose IDs from `to` onwards are known to be >= target.
+     * Gallops backwards from `to`, for cursors that walk a list from its end.
+     */
+    [[nodiscard]] inline size_t gallop_back(std::span<const uint32_t> list, size_t to, uint32_t target) {
+        if (to == 0 || list[to - 1] < target) {
+            return to;
+        }
+
+        /* list[hi] >= target */
+        size_t step = 1;
+        size_t hi = to - 1;
+        while (hi > 0) {
+            const size_t lo = (hi > step) ? hi - step : 0;
+            if (list[lo] < target) {
+                return std::lower_bound(list.begin() + lo + 1, list.begin() + hi, target) - list.begin();
+            }
+
+            hi = lo;
+            step *= 2;
+        }
+
+        return 0;
+    }
+
+    /* Number of IDs below target, like std::lower_bound(). `skips` holds the last ID of every run of
+     * `interval` IDs of the list, so only one run of the list itself is searched.
+     */
+    [[nodiscard]] inline size_t seek_skips(std::span<const uint32_t> list, std::span<const uint32_t> skips, size_t interval, uint32_t target) {
+        if (skips.empty()) {
+            return std::ranges::lower_bound(list, target) - list.begin();
+        }
+
+        const size_t run = std::ranges::lower_bound(skips, target) - skips.begin();
+        if (run == skips.size()) {
+            return list.size();
+        }
+
+        const auto begin = list.begin() + (run * interval);
+        const auto end = list.begin() + std::min((run + 1) * interval, list.size());
+        return std::lower_bound(begin, end, target) - list.begin();
+    }
+
+    /* Linear merge, best for lists of similar sizes */
+    template <bool count_only = false>
+    inline size_t intersect_merge(std::span<const uint32_t> lhs, std::span<const uint32_t> rhs, uint32_t* out) {
+        size_t found = 0;
+
+        auto left_it = lhs.begin();
+        auto right_it = rhs.begin();
+        while (left_it != lhs.end() && right_it != rhs.end()) {
+            if (*left_it < *right_it) {
+                ++left_it;
+            } else if (*right_it < *left_it) {
+                ++right_it;
+            } else {
+                if constexpr (!count_only) {
+                    out[found] = *left_it;
+                }
+
+                ++found;
+                ++left_it;
+                ++right_it;
+            }
+        }
+
+        return found;
+    }
+
+    /* Gallops through `large` for every ID of `small`, best when the sizes are far apart */
+    template <bool count_only = false>
+    inline size_t intersect_gallop(std::span<const uint32_t> small, std::span<const uint32_t> large, uint32_t* out) {
+        size_t found = 0;
+
+        size_t pos = 0;
+        for (uint32_t id : small) {
+            pos = gallop_to(large, pos, id);
+            if (pos == large.size()) {
+                break;
+            }
+
+            if (large[pos] == id) {
+                if constexpr (!count_only) {
+                    out[found] = id;
+                }
+
+                ++found;
+            }
+        }
+
+        return found;
+    }
+
+    /* IDs of lhs that aren't in rhs, by linear merge */
+    inline size_t subtract_merge(std::span<const uint32_t> lhs, std::span<const uint32_t> rhs, uint32_t* out) {
+        uint32_t* begin = out;
+
+        auto right_it = rhs.begin();
+        for (uint32_t id : lhs) {
+            while (right_it != rhs.end() && *right_it < id) {
+                ++right_it;
+            }
+
+            if (right_it == rhs.end() || *right_it != id) {
+                *out++ = id;
+            }
+        }
+
+        return out - begin;
+    }
+
+    namespace detail {
+        /* permutevar8x32 indices that move the lanes selected by a mask to the front */
+        constexpr std::array<std::array<uint32_t, 8>, 256> make_compress_table() {
+            std::array<std::array<uint32_t, 8>, 256> result {};
+            for (uint32_t mask = 0; mask < 256; ++mask) {
+                uint32_t next = 0;
+                for (uint32_t lane = 0; lane < 8; ++lane) {
+                    if (mask & (1u << lane)) {
+                        result[mask][next++] = lane;
+                    }
+                }
+            }
+
+            return result;
+        }
+
+        alignas(32) inline constexpr std::array<std::array<uint32_t, 8>, 256> compress_table = make_compress_table();
+
+        /* Write the lanes of `values` selected by `mask` to `out`, always stores 8 lanes */
+        FORCE_INLINE uint32_t* compress_store(uint32_t* out, m256i values, uint32_t mask) {
+            const m256i indices = simd::epi32::load(compress_table[mask].data());
+            simd::epi32::storeu(out, _mm256_permutevar8x32_epi32(values, indices));
+            return out + std::popcount(mask);
+        }
+
+        /* Lanes of `a` that equal any lane of `b`, by comparing against all 8 rotations of `b` */
+        FORCE_INLINE uint32_t match_any(m256i a, m256i b) {
+            using namespace simd::epi32_operators;
+
+            const m256i swapped = _mm256_permute2x128_si256(b, b, 1);
+
+            const m256i matches = (a == b)
+                | (a == _mm256_shuffle_epi32(b, 0b00'11'10'01))
+                | (a == _mm256_shuffle_epi32(b, 0b01'00'11'10))
+                | (a == _mm256_shuffle_epi32(b, 0b10'01'00'11))
+                | (a == swapped)
+                | (a == _mm256_shuffle_epi32(swapped, 0b00'11'10'01))
+                | (a == _mm256_shuffle_epi32(swapped, 0b01'00'11'10))
+                | (a == _mm256_shuffle_epi32(swapped, 0b10'01'00'11));
+
+            return static_cast<uint32_t>(_mm256_movemask_ps(_mm256_castsi256_ps(matches)));
+        }
+    }
+
+    /* Intersection 8 by 8 IDs at a time: every block of lhs is compared against every rotation of
+     * the current block of rhs, and whichever block ends first is advanced. There are no
+     * data-dependent branches besides the loop itself, so lists of similar sizes no longer pay
+     * for mispredictions.
+     */
+    template <bool count_only = false>
+    inline size_t intersect_simd(std::span<const uint32_t> lhs, std::span<const uint32_t> rhs, uint32_t* out) {
+        size_t found = 0;
+
+        size_t i = 0;
+        size_t j = 0;
+        while (i + 8 <= lhs.size() && j + 8 <= rhs.size()) {
+            const m256i a = simd::epi32::loadu(lhs.data() + i);
+            const m256i b = simd::epi32::loadu(rhs.data() + j);
+
+            const uint32_t matches = detail::match_any(a, b);
+            if constexpr (count_only) {
+                found += std::popcount(matches);
+            } else {
+                found = detail::compress_store(out + found, a, matches) - out;
+            }
+
+            const uint32_t a_max = lhs[i + 7];
+            const uint32_t b_max = rhs[j + 7];
+            i += (a_max <= b_max) ? 8 : 0;
+            j += (b_max <= a_max) ? 8 : 0;
+        }
+
+        /* Neither tail can match a block that was already passed */
+        return found + intersect_merge<count_only>(lhs.subspan(i), rhs.subspan(j), count_only ? out : out + found);
+    }
+
+    /* Galloping intersection over blocks of 8: the search only narrows down to a window of 8 IDs of
+     * `large` that must hold the target if it's present, which is then compared in one go.
+     */
+    template <bool count_only = false>
+    inline size_t intersect_gallop_simd(std::span<const uint32_t> small, std::span<const uint32_t> large, uint32_t* out) {
+        size_t found = 0;
+
+        /* Everything before pos is smaller than the current ID */
+        size_t pos = 0;
+        size_t i = 0;
+        for (; i < small.size() && pos + 8 <= large.size(); ++i) {
+            const uint32_t id = small[i];
+
+            if (large[pos + 7] < id) {
+                /* Find window starts lo < hi with large[lo + 7] < id <= large[hi + 7] */
+                size_t step = 8;
+                size_t lo = pos;
+                size_t hi = pos + 8;
+                while (hi + 8 <= large.size() && large[hi + 7] < id) {
+                    lo = hi;
+                    step *= 2;
+                    hi = pos + step;
+                }
+
+                if (hi + 8 > large.size()) {
+                    hi = large.size() - 8;
+                    if (large[hi + 7] < id) {
+                        pos = large.size();
+                        break;
+                    }
+                }
+
+                /* Once they're at most 8 apart, the first ID >= id lies in the window at hi */
+                while (hi - lo > 8) {
+                    const size_t mid = lo + ((hi - lo) / 2);
+                    if (large[mid + 7] < id) {
+                        lo = mid;
+                    } else {
+                        hi = mid;
+                    }
+                }
+
+                pos = hi;
+            }
+
+            using namespace simd::epi32_operators;
+            const m256i window = simd::epi32::loadu(large.data() + pos);
+            const bool match = _mm256_movemask_ps(_mm256_castsi256_ps(window == simd::epi32::from_value(static_cast<int>(id)))) != 0;
+
+            if constexpr (!count_only) {
+                out[found] = id;
+            }
+
+            found += match;
+        }
+
+        /* Fewer than 8 IDs of `large` left */
+        return found + intersect_gallop<count_only>(small.subspan(i), large.subspan(std::min(pos, large.size())), count_only ? out : out + found);
+    }
+
+    /* Difference 8 by 8 IDs at a time, like intersect_simd(). A block of lhs can be compared against
+     * several blocks of rhs, so its matches are collected until it's passed.
+     */
+    inline size_t subtract_simd(std::span<const uint32_t> lhs, std::span<const uint32_t> rhs, uint32_t* out) {
+        uint32_t* begin = out;
+
+        size_t i = 0;
+        size_t j = 0;
+        uint32_t matched = 0;
+        while (i + 8 <= lhs.size() && j + 8 <= rhs.size()) {
+            const m256i a = simd::epi32::loadu(lhs.data() + i);
+            const m256i b = simd::epi32::loadu(rhs.data() + j);
+
+            matched |= detail::match_any(a, b);
+
+            const uint32_t a_max = lhs[i + 7];
+            const uint32_t b_max = rhs[j + 7];
+            if (a_max <= b_max) {
+                out = detail::compress_store(out, a, ~matched & 0xFF);
+                matched = 0;
+                i += 8;
+            }
+
+            j += (b_max <= a_max) ? 8 : 0;
+        }
+
+        /* The current block of lhs may already have matched passed blocks of rhs */
+        if (matched) {
+            for (size_t k = 0; k < 8; ++k) {
+                if (!(matched & (1u << k)) && !std::ranges::binary_search(rhs.subspan(j), lhs[i + k])) {
+                    *out++ = lhs[i + k];
+                }
+            }
+
+            i += 8;
+        }
+
+        out += subtract_merge(lhs.subspan(i), rhs.subspan(j), out);
+
+        return out - begin;
+    }
+
+    /* IDs of lhs that aren't in rhs, galloping through rhs */
+    inline size_t subtract_gallop(std::span<const uint32_t> lhs, std::span<const uint32_t> rhs, uint32_t* out) {
+        uint32_t* begin = out;
+
+        size_t pos = 0;
+        for (uint32_t id : lhs) {
+            pos = gallop_to(rhs, pos, id);
+            if (pos == rhs.size() || rhs[pos] != id) {
+                *out++ = id;
+            }
+        }
+
+        return out - begin;
+    }
+
+    /* Size ratio from which galloping beats the block-wise intersection */
+    static constexpr size_t gallop_ratio = 64;
+
+    /* Intersection with the kernel that suits the sizes */
+    template <bool count_only = false>
+    inline size_t intersect(std::span<const uint32_t> lhs, std::span<const uint32_t> rhs, uint32_t* out) {
+        if (lhs.size() > rhs.size()) {
+            std::swap(lhs, rhs);
+        }
+
+        return (rhs.size() >= lhs.size() * gallop_ratio) ? intersect_gallop_simd<count_only>(lhs, rhs, out) : intersect_simd<count_only>(lhs, rhs, out);
+    }
+
+    /* Size of the intersection, nothing is written */
+    [[nodiscard]] inline size_t intersect_count(std::span<const uint32_t> lhs, std::span<const uint32_t> rhs) {
+        return intersect<true>(lhs, rhs, nullptr);
+    }
+}
+
+#endif /* SET_OPS_H */
@@ -5,6 +5,10 @@
 
 #include <ostream>
 #include <concepts>
+#include <array>
+#include <utility>
+#include <algorithm>
+#include <cstdint>
 
 #include <immintrin.h>
 
@@ -650,4 +654,90 @@ namespace simd::epi64 {
     }
 }
 
+/* Bit-packed blocks of 128 32-bit integers, interleaved over 8 lanes.
+ *
+ * Value i of a block lives in lane (i % 8), row (i / 8). Every lane packs its 16 values into
+ * `bits` consecutive 32-bit words, and word w of lane l is stored at index (w * 8) + l. A block
+ * of `bits` bits per value is therefore exactly `bits` 256-bit vectors.
+ */
+namespace simd::bitpack {
+    static constexpr size_t block_size = 128;
+    static constexpr size_t rows = block_size / 8;
+
+    namespace detail {
+        template <uint32_t bits, uint32_t row>
+        FORCE_INLINE m256i unpack_row(const __m256i* in, m256i mask) {
+            constexpr uint32_t pos = row * bits;
+            constexpr uint32_t word = pos / 32;
+            constexpr uint32_t shift = pos % 32;
+
+            m256i val = _mm256_srli_epi32(_mm256_load_si256(in + word), shift);
+            if constexpr (shift + bits > 32) {
+                val = _mm256_or_si256(val, _mm256_slli_epi32(_mm256_load_si256(in + word + 1), 32 - shift));
+            }
+
+            if constexpr (bits < 32) {
+                val = _mm256_and_si256(val, mask);
+            }
+
+            return val;
+        }
+
+        /* Inclusive prefix sum over the 8 lanes of a row, plus the running total of earlier rows */
+        FORCE_INLINE m256i prefix_sum(m256i val, m256i carry) {
+            val = _mm256_add_epi32(val, _mm256_slli_si256(val, 4));
+            val = _mm256_add_epi32(val, _mm256_slli_si256(val, 8));
+
+            /* Carry the low lane's total into the high lane */
+            val = _mm256_add_epi32(val, _mm256_slli_si256_dual<16>(_mm256_shuffle_epi32(val, 0b11'11'11'11)));
+
+            return _mm256_add_epi32(val, carry);
+        }
+
+        template <uint32_t bits>
+        void unpack_deltas(const void* packed, uint32_t base, uint32_t* out) {
+            const __m256i* in = static_cast<const __m256i*>(packed);
+            const m256i mask = _mm256_set1_epi32(static_cast<int>((bits < 32) ? ((1u << bits) - 1) : ~0u));
+            m256i carry = _mm256_set1_epi32(static_cast<int>(base));
+
+            [&]<uint32_t... row>(std::integer_sequence<uint32_t, row...>) {
+                ((carry = prefix_sum(unpack_row<bits, row>(in, mask), carry),
+                  _mm256_store_si256(reinterpret_cast<__m256i*>(out) + row, carry),
+                  carry = _mm256_permutevar8x32_epi32(carry, _mm256_set1_epi32(7))), ...);
+            }(std::make_integer_sequence<uint32_t, rows> {});
+        }
+
+        using unpack_func = void(*)(const void*, uint32_t, uint32_t*);
+
+        template <uint32_t... bits>
+        constexpr std::array<unpack_func, sizeof...(bits)> make_unpackers(std::integer_sequence<uint32_t, bits...>) {
+            return { &unpack_deltas<bits + 1>... };
+        }
+
+        inline constexpr std::array<unpack_func, 32> unpackers = make_unpackers(std::make_integer_sequence<uint32_t, 32> {});
+    }
+
+    /* Decode a block of `bits`-bit deltas (1 to 32) on top of `base` into 128 values, `out` must be 32-byte aligned */
+    FORCE_INLINE void unpack_deltas(const void* in, uint32_t bits, uint32_t base, uint32_t* out) {
+        detail::unpackers[bits - 1](in, base, out);
+    }
+
+    /* Scalar counterpart of the unpacking, `out` receives `bits` * 8 words */
+    inline void pack(const uint32_t* values, uint32_t bits, uint32_t* out) {
+        std::fill_n(out, bits * 8, 0);
+
+        for (uint32_t i = 0; i < block_size; ++i) {
+            const uint32_t lane = i % 8;
+            const uint32_t pos = (i / 8) * bits;
+            const uint32_t word = pos / 32;
+            const uint32_t shift = pos % 32;
+
+            out[(word * 8) + lane] |= values[i] << shift;
+            if (shift + bits > 32) {
+                out[((word + 1) * 8) + lane] |= values[i] >> (32 - shift);
+            }
+        }
+    }
+}
+
 #endif /* SIMD_H */
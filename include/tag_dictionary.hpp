@@ -0,0 +1,153 @@
+#ifndef TAG_DICTIONARY_H
+#define TAG_DICTIONARY_H
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <optional>
+#include <algorithm>
+#include <bit>
+#include <cstdint>
+#include <cstring>
+
+/* Tag name -> tag ID dictionary for the parsing hot loop.
+ *
+ * All names live back to back in a single string arena, and the table itself is a flat
+ * open-addressing array of (hash tag, entry) slots with linear probing. A lookup is one hash
+ * over the name, usually a single cache line of slots and one memcmp, with no allocations
+ * and no pointer chasing through nodes.
+ */
+class tag_dictionary {
+    struct entry {
+        uint64_t offset;
+        uint32_t length;
+        uint32_t id;
+    };
+
+    /* Upper hash bits to reject most mismatches without touching the arena, and entry index + 1 (0 is empty) */
+    struct slot {
+        uint32_t hash;
+        uint32_t entry;
+    };
+
+    std::string _arena;
+    std::vector<entry> _entries;
+    std::vector<slot> _slots;
+    uint64_t _mask = 0;
+    uint32_t _max_id = 0;
+
+    [[nodiscard]] static uint64_t _load(const char* p, size_t n) {
+        uint64_t v = 0;
+        std::memcpy(&v, p, n);
+        return v;
+    }
+
+    [[nodiscard]] static uint64_t _mix(uint64_t a, uint64_t b) {
+        __uint128_t r = static_cast<__uint128_t>(a) * b;
+        return static_cast<uint64_t>(r) ^ static_cast<uint64_t>(r >> 64);
+    }
+
+    /* Tag names are short, hash them 8 bytes at a time with a multiply-fold mixer */
+    [[nodiscard]] static uint64_t _hash(std::string_view s) {
+        static constexpr uint64_t seed0 = 0xa0761d6478bd642full;
+        static constexpr uint64_t seed1 = 0xe7037ed1a0b428dbull;
+
+        const char* p = s.data();
+        size_t n = s.size();
+        uint64_t h = seed0 ^ n;
+
+        for (; n > 8; n -= 8, p += 8) {
+            h = _mix(h ^ _load(p, 8), seed1);
+        }
+
+        return _mix(h ^ _load(p, n), seed1 ^ seed0);
+    }
+
+    [[nodiscard]] std::string_view _name(const entry& e) const {
+        return { _arena.data() + e.offset, e.length };
+    }
+
+    void _rehash(size_t slot_count) {
+        _slots.assign(slot_count, slot {});
+        _mask = slot_count - 1;
+
+        for (uint32_t i = 0; i < _entries.size(); ++i) {
+            uint64_t h = _hash(_name(_entries[i]));
+            size_t pos = h & _mask;
+
+            while (_slots[pos].entry != 0) {
+                pos = (pos + 1) & _mask;
+            }
+
+            _slots[pos] = { static_cast<uint32_t>(h >> 32), i + 1 };
+        }
+    }
+
+    public:
+    tag_dictionary() { _rehash(16); }
+
+    /* Reserve room for `count` names of `name_bytes` total length */
+    void reserve(size_t count, size_t name_bytes = 0) {
+        _entries.reserve(count);
+        _arena.reserve(name_bytes);
+
+        /* Keep the load factor at or below one half */
+        size_t slot_count = std::bit_ceil(std::max<size_t>(count * 2, 16));
+        if (slot_count > _slots.size()) {
+            _rehash(slot_count);
+        }
+    }
+
+    /* Returns false if the name was already present, the existing ID is kept */
+    bool insert(std::string_view name, uint32_t id) {
+        if ((_entries.size() + 1) * 2 > _slots.size()) {
+            _rehash(_slots.size() * 2);
+        }
+
+        uint64_t h = _hash(name);
+        uint32_t tag = h >> 32;
+        size_t pos = h & _mask;
+
+        for (; _slots[pos].entry != 0; pos = (pos + 1) & _mask) {
+            if (_slots[pos].hash == tag && _name(_entries[_slots[pos].entry - 1]) == name) {
+                return false;
+            }
+        }
+
+        _entries.push_back({ .offset = _arena.size(), .length = static_cast<uint32_t>(name.size()), .id = id });
+        _arena.append(name);
+        _slots[pos] = { tag, static_cast<uint32_t>(_entries.size()) };
+        _max_id = std::max(_max_id, id);
+
+        return true;
+    }
+
+    [[nodiscard]] std::optional<uint32_t> find(std::string_view name) const {
+        uint64_t h = _hash(name);
+        uint32_t tag = h >> 32;
+
+        for (size_t pos = h & _mask; _slots[pos].entry != 0; pos = (pos + 1) & _mask) {
+            const slot& s = _slots[pos];
+            if (s.hash == tag) {
+                const entry& e = _entries[s.entry - 1];
+                if (e.length == name.size() && std::memcmp(_arena.data() + e.offset, name.data(), name.size()) == 0) {
+                    return e.id;
+                }
+            }
+        }
+
+        return std::nullopt;
+    }
+
+    [[nodiscard]] size_t size() const { return _entries.size(); }
+    [[nodiscard]] bool empty() const { return _entries.empty(); }
+
+    /* Highest ID inserted so far */
+    [[nodiscard]] uint32_t max_id() const { return _max_id; }
+
+    /* Entries in insertion order */
+    [[nodiscard]] std::string_view name(size_t i) const { return _name(_entries[i]); }
+    [[nodiscard]] uint32_t id(size_t i) const { return _entries[i].id; }
+};
+
+#endif /* TAG_DICTIONARY_H */
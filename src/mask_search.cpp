@@ -17,11 +17,25 @@
 #include <ranges>
 #include <compare>
 #include <bitset>
+#include <bit>
+#include <cmath>
 #include <immintrin.h>
+#include <stdexcept>
+#include <charconv>
+#include <random>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
 
 #include "helper.hpp"
 #include "simd.hpp"
-#include "avx_buffer.hpp"
+#include "scratch_arena.hpp"
+#include "index_file.hpp"
+#include "query.hpp"
+#include "roaring.hpp"
+#include "set_ops.hpp"
+#include "bitmap_ops.hpp"
 
 using namespace simd::epi32_operators;
 namespace epi32 = simd::epi32;
@@ -35,38 +49,100 @@ struct overloaded : Ts... { using Ts::operator()...; };
 using mask_val_t = __uint128_t;
 static constexpr size_t MASK_SIZE = sizeof(mask_val_t) * CHAR_BIT;
 
+/* Bitmask view, backed by an aligned bitmap in the mapped index */
 struct mask_desc {
     uint32_t post_count;
-    avx_buffer<mask_val_t> mask;
+    std::span<const mask_val_t> mask;
 
-    mask_desc() = default;
-    mask_desc(mask_desc&&) noexcept = default;
-    mask_desc(const mask_desc&) = delete;
-    mask_desc(uint32_t post_count, size_t mask_count)
-        : post_count { post_count }, mask(avx_buffer<mask_val_t>::zero(mask_count)) { }
+    /* Zone map of a mask from the index, see index_format::zones_header. Empty for intermediate results */
+    std::span<const uint64_t> zones;
 
-    mask_desc& operator=(mask_desc&&) noexcept = default;
-    mask_desc& operator=(const mask_desc&) = default;
-
-    mask_val_t& operator[](size_t idx) { return mask[idx]; }
     const mask_val_t& operator[](size_t idx) const { return mask[idx]; }
+
+    [[nodiscard]] const __m256i* m256i(size_t i) const {
+        return reinterpret_cast<const __m256i*>(mask.data()) + i;
+    }
+
+    [[nodiscard]] std::span<const uint64_t> words() const {
+        return { reinterpret_cast<const uint64_t*>(mask.data()), mask.size() * (sizeof(mask_val_t) / sizeof(uint64_t)) };
+    }
 };
-using index_value_t = std::variant<std::monostate, std::vector<uint32_t>, mask_desc>;
 
-static overloaded sort_visitor {
-    [](std::monostate) -> size_t { return 0; },
-    [](const std::vector<uint32_t>& ids) -> size_t { return ids.size(); },
-    [](const mask_desc& mask) -> size_t { return mask.post_count; }
+/* Chunked containers, for tags that are only dense in some ID ranges */
+struct container_desc {
+    const roaring_bitmap* set;
+
+    const roaring_bitmap* operator->() const { return set; }
 };
 
+using index_value_t = std::variant<std::monostate, std::span<const uint32_t>, mask_desc, container_desc>;
+
 struct post_index {
+    index_file file;
     uint32_t max_post;
-    std::vector<index_value_t> data;
 
-    [[nodiscard]] size_t mask_size() const { return ((max_post + MASK_SIZE - 1) / MASK_SIZE); }
-    [[nodiscard]] const index_value_t& at(size_t idx) const { return data.at(idx); }
-    [[nodiscard]] index_value_t& operator[](size_t idx) { return data[idx]; }
-    [[nodiscard]] size_t size() const { return data.size(); }
+    /* Precomputed bitmasks for tags that are dense everywhere */
+    std::unordered_map<uint32_t, std::span<const mask_val_t>> masks;
+
+    /* Zone maps of the masks, if the index has them */
+    std::unordered_map<uint32_t, std::span<const uint64_t>> zones;
+
+    /* Containers for the other large tags, all remaining tags are used as ID lists */
+    std::unordered_map<uint32_t, roaring_bitmap> containers;
+
+    /* Include the bit for max_post itself */
+    [[nodiscard]] size_t mask_size() const { return (max_post / MASK_SIZE) + 1; }
+    [[nodiscard]] size_t size() const { return file.size(); }
+
+    [[nodiscard]] const name_dictionary& tag_names() const { return file.tag_names(); }
+    [[nodiscard]] std::optional<uint32_t> find_tag(std::string_view name) const { return file.find_tag(name); }
+
+    /* ID list of a tag, regardless of its representation. A compressed list is decoded into `storage`,
+     * borrowed from the thread's scratch arena, which the span then points into
+     */
+    [[nodiscard]] std::span<const uint32_t> posts(uint32_t idx, scratch_arena<uint32_t>::buffer& storage) const {
+        if (!file.is_compressed()) {
+            return file[idx];
+        }
+
+        const compressed_list list = file.compressed(idx);
+        storage = scratch_arena<uint32_t>::local().take(list.size());
+        list.decode(storage.data());
+        return storage;
+    }
+
+    /* ID lists of a compressed index are only decoded with `storage`, otherwise they come back empty
+     * and have to be read through file.compressed(). Their size is still file.post_count()
+     */
+    [[nodiscard]] index_value_t at(uint32_t idx, scratch_arena<uint32_t>::buffer* storage) const {
+        if (idx >= file.tag_count()) {
+            throw std::out_of_range { "tag " + std::to_string(idx) + " out of range" };
+        }
+
+        const uint32_t count = file.post_count(idx);
+        if (count == 0) {
+            return std::monostate {};
+        }
+
+        if (auto it = masks.find(idx); it != masks.end()) {
+            auto zones = this->zones.find(idx);
+            return mask_desc { .post_count = count, .mask = it->second, .zones = (zones != this->zones.end()) ? zones->second : std::span<const uint64_t> {} };
+        }
+
+        if (auto it = containers.find(idx); it != containers.end()) {
+            return container_desc { .set = &it->second };
+        }
+
+        if (!file.is_compressed()) {
+            return file[idx];
+        }
+
+        if (!storage) {
+            return std::span<const uint32_t> {};
+        }
+
+        return posts(idx, *storage);
+    }
 };
 
 using index_t = post_index;
@@ -78,164 +154,316 @@ struct timekeeping {
     duration sort;
     duration initialize;
     duration mask;
-    duration result;
 
     duration avg_sort() const { return sort / repeats; }
     duration avg_initialize() const { return initialize / repeats; }
     duration avg_mask() const { return mask / repeats; }
-    duration avg_result() const { return result / repeats; }
 
-    duration total() const { return sort + initialize + mask + result; }
+    duration total() const { return sort + initialize + mask; }
     duration avg_total() const { return total() / repeats; }
 };
 
-/* Minimum number of posts before we use a tag instead */
-static constexpr size_t MASK_THRESHOLD = 50'000;
-
 static index_t load_index(const fs::path& path) {
-    std::ifstream infile(path, std::ios::in | std::ios::binary);
-    if (!infile) {
-        throw std::runtime_error{"couldn't open index file"};
-    }
-
     std::cerr << "Loading " << path.filename() << '\n';
 
     auto begin = std::chrono::steady_clock::now();
 
-    /* Check magic number for raw array or numpy array */
-    std::array<char, 4> magic;
-    infile.read(magic.data(), magic.size());
-    if (!infile || magic != std::array{'A', 'w', 'o', 'o'}) {
-        throw std::runtime_error{"error reading magic string"};
-    }
-
-    size_t total_posts = 0;
+    index_t result { .file = index_file { path }, .max_post = 0, .masks = {}, .zones = {}, .containers = {} };
+    result.max_post = result.file.max_post();
 
-    index_t result;
+    /* The bitmaps for dense tags are stored in the index as-is */
+    std::span<const uint32_t> bitmap_tags = result.file.bitmap_tags();
+    for (size_t i = 0; i < bitmap_tags.size(); ++i) {
+        std::span<const std::byte> bitmap = result.file.bitmap(i);
 
-    infile.read(reinterpret_cast<char*>(&result.max_post), sizeof(result.max_post));
+        result.masks.insert({
+            bitmap_tags[i],
+            { reinterpret_cast<const mask_val_t*>(bitmap.data()), result.mask_size() }
+        });
 
-    uint32_t tag_count = 0;
-    infile.read(reinterpret_cast<char*>(&tag_count), sizeof(tag_count));
+        if (std::span<const uint64_t> zones = result.file.zones(i); !zones.empty()) {
+            result.zones.insert({ bitmap_tags[i], zones });
+        }
+    }
 
-    result.data.resize(tag_count);
+    /* Large tags have containers in the index, unless they're dense enough that the full bitmap isn't much larger */
+    const size_t mask_bytes = result.mask_size() * sizeof(mask_val_t);
+    size_t container_bytes = 0;
 
-    std::unordered_map<uint32_t, uint32_t> mask_sizes;
+    std::span<const index_format::container_set_entry> container_sets = result.file.container_sets();
+    for (size_t i = 0; i < container_sets.size(); ++i) {
+        roaring_bitmap set = result.file.containers(i);
 
-    size_t index_bytes = 0;
+        container_bytes += set.size_bytes();
+        result.masks.erase(container_sets[i].tag);
+        result.zones.erase(container_sets[i].tag);
+        result.containers.emplace(container_sets[i].tag, std::move(set));
+    }
 
-    size_t masks = 0;
+    size_t total_posts = 0;
     size_t id_lists = 0;
 
-    progress_bar p0 { "Reading tags", result.size() };
     for (uint32_t i = 0; i < result.size(); ++i) {
-        uint32_t post_count = 0;
-        infile.read(reinterpret_cast<char*>(&post_count), sizeof(post_count));
-
-        if (post_count == 0) {
-            continue;
+        if (uint32_t count = result.file.post_count(i); count > 0) {
+            total_posts += count;
+            ++id_lists;
         }
+    }
 
-        if (post_count >= MASK_THRESHOLD) {
-            result[i] = mask_desc(post_count, result.mask_size());
-
-            index_bytes += sizeof(mask_val_t)* result.mask_size();
-            mask_sizes.insert({ i, post_count });
+    const size_t masks = result.masks.size();
+    const size_t containers = result.containers.size();
+    id_lists -= masks + containers;
 
-            ++masks;
-        } else {
-            result[i] = std::vector<uint32_t>(post_count, 0);
-            index_bytes += post_count * sizeof(uint32_t);
+    auto elapsed = std::chrono::steady_clock::now() - begin;
 
-            ++id_lists;
-        }
+    const size_t tag_count = result.size();
 
-        total_posts += post_count;
+    std::cerr << "Read " << tag_count << " tags, "
+        << total_posts << " posts (up to ID " << result.max_post << ")\n"
+        << "  " << (tag_count - id_lists - masks - containers) << " empty tags, " << id_lists << " ID lists, " << masks << " mask arrays ("
+        << get_bytes(mask_bytes) << " per mask, threshold " << result.file.bitmap_threshold() << " posts), "
+        << containers << " container sets (" << get_bytes(container_bytes) << ")\n"
+        << "  " << get_bytes(result.file.size_bytes()) << " mapped in " << get_time(elapsed) << "\n"
+        << "  Using " << bitmap_ops::isa_names[static_cast<size_t>(bitmap_ops::active_isa())] << " bitmap kernels\n\n";
 
-        p0.advance();
-    }
+    return result;
+}
 
-    p0.finish();
+static void usage(const char* argv0) {
+    std::cerr << "Usage:\n\n"
+              << argv0 << " <index_file> [options] [query...]\n\n"
+              << "Searches for posts matching a query, or runs the built-in queries if none is given.\n"
+              << "Queries are tag names, -tag to exclude a tag, ~tag for any of several tags,\n"
+              << "and ( ... ) to group terms, with the parentheses separated by spaces.\n"
+              << "Queries run with the planner and with the fixed merge and bitmask strategies, for comparison.\n\n"
+              << "Options:\n"
+              << "  --limit <n>   Only find the n newest posts, stopping as soon as they're found\n"
+              << "  --before <id> Only find posts older than this one, for the next page of a --limit query\n"
+              << "  --count       Only count the posts, without collecting their IDs\n"
+              << "  --estimate <n> Count, but estimate from a sample of the post IDs if more than n posts could match\n"
+              << "  --threads <n> Also run the query on n threads, each taking stripes of the post IDs\n\n";
 
-    progress_bar p1 { "Reading posts", result.size() };
-    for (uint32_t i = 0; i < result.size(); ++i) {
-        index_value_t& tag = result[i];
+}
 
+/* Words of a bitmask that and_blocks() combines at a time, 4 KiB of every set so all of them fit in L1.
+ * A block is exactly one zone of the zone maps.
+ */
+static constexpr size_t and_block_words = index_format::zone_posts / MASK_SIZE;
+
+/* Zones that every kept set has posts in, one bit per block of and_blocks(). Masks bring their zone
+ * maps from the index, lists are cheap to summarize by jumping from zone to zone and containers
+ * by the extent of every chunk. Masks without a zone map leave every zone in.
+ */
+static scratch_arena<uint64_t>::buffer live_zones(size_t blocks, std::span<const index_value_t> sets, size_t kept) {
+    auto live = scratch_arena<uint64_t>::local().take((blocks + 63) / 64);
+    auto zones = scratch_arena<uint64_t>::local().take(live.size());
+    std::ranges::fill(live, ~uint64_t { 0 });
+
+    for (const index_value_t& set : sets.first(kept)) {
         std::visit(overloaded {
-            /* Empty */
-            [](std::monostate) { },
-            
-            /* Raw post IDs */
-            [&](std::span<uint32_t> posts) {
-                infile.read(reinterpret_cast<char*>(posts.data()), posts.size_bytes());
+            [&](std::monostate) {
+                std::ranges::fill(live, 0);
             },
+            [&](std::span<const uint32_t> ids) {
+                std::ranges::fill(zones, 0);
+                for (auto it = ids.begin(); it != ids.end();) {
+                    const uint32_t zone = *it / index_format::zone_posts;
+                    zones[zone / 64] |= uint64_t { 1 } << (zone % 64);
+                    it = std::lower_bound(it, ids.end(), (zone + 1) * index_format::zone_posts);
+                }
 
-            /* Bitmask*/
-            [&](mask_desc& mask) {
-                /* Read in the usual 4KiB chunks */
-                ssize_t posts_remaining = mask_sizes.at(i);
-
-                while (posts_remaining > 0) {
-                    std::array<uint32_t, 4096/sizeof(uint32_t)> buf;
+                bitmap_ops::and_into(live, zones);
+            },
+            [&](const mask_desc& mask) {
+                if (mask.zones.size() >= live.size()) {
+                    bitmap_ops::and_into(live, mask.zones.first(live.size()));
+                }
+            },
+            [&](const container_desc& containers) {
+                std::ranges::fill(zones, 0);
+                containers->for_each_extent([&zones](uint32_t first, uint32_t last) {
+                    for (uint32_t zone = first / index_format::zone_posts; zone <= last / index_format::zone_posts; ++zone) {
+                        zones[zone / 64] |= uint64_t { 1 } << (zone % 64);
+                    }
+                });
 
-                    const uint32_t posts_to_read = std::min<uint32_t>(posts_remaining, buf.size());
-                    infile.read(reinterpret_cast<char*>(buf.data()), posts_to_read * sizeof(uint32_t));
-                    posts_remaining -= posts_to_read;
+                bitmap_ops::and_into(live, zones);
+            },
+        }, set);
+    }
 
-                    /* Set every bit corresponding to a post */
-                    for (uint32_t j = 0; j < posts_to_read; ++j) {
-                        uint32_t index = buf[j] / MASK_SIZE;
-                        uint32_t offset = buf[j] % MASK_SIZE;
+    return live;
+}
 
-                        mask[index] |= mask_val_t{1} << offset;
-                    }
+/* result &= every set of `sets`, the first `kept` of them as they are and the rest negated. With `load`,
+ * the first set replaces result instead.
+ *
+ * `dirty` has a bit per block of result that may be non-zero, see scratch_arena. Blocks that end up
+ * cleared are dropped from it, blocks a loaded set filled are added.
+ *
+ * Rather than a full pass over result per set, every block of words gets all sets applied before
+ * moving on, so result is read and written once and every set read once. finish(first_word, words)
+ * is called with every finished block while it's still in cache, to extract or count it.
+ *
+ * Blocks outside the live_zones() of the kept sets can't have any bits left, they're only cleared
+ * and never reach finish().
+ */
+template <typename Finish>
+static void and_blocks(std::span<mask_val_t> result, std::span<uint64_t> dirty, std::span<const index_value_t> sets, size_t kept, bool load, Finish&& finish) {
+    static_assert(scratch_arena<mask_val_t>::block_size == and_block_words);
+
+    /* Position of every list in its IDs, all IDs of the previous blocks are consumed */
+    auto positions = scratch_arena<size_t>::local().take(sets.size());
+    std::ranges::fill(positions, 0);
+
+    /* Containers are expanded one block at a time */
+    std::array<uint64_t, and_block_words * (sizeof(mask_val_t) / sizeof(uint64_t))> expanded;
+
+    const auto live = live_zones((result.size() + and_block_words - 1) / and_block_words, sets, kept);
+
+    for (size_t first = 0; first < result.size(); first += and_block_words) {
+        const size_t size = std::min(and_block_words, result.size() - first);
+        const std::span<uint64_t> words { reinterpret_cast<uint64_t*>(result.data() + first), size * (sizeof(mask_val_t) / sizeof(uint64_t)) };
+        const size_t first_word = first * (sizeof(mask_val_t) / sizeof(uint64_t));
+
+        const auto begin = static_cast<uint32_t>(first * MASK_SIZE);
+        const auto end = static_cast<uint32_t>((first + size) * MASK_SIZE);
+
+        if (const size_t block = first / and_block_words; ((live[block / 64] >> (block % 64)) & 1) == 0) {
+            std::ranges::fill(words, 0);
+
+            /* Lists still have to move past the block */
+            for (size_t k = 0; k < sets.size(); ++k) {
+                if (const auto* ids = std::get_if<std::span<const uint32_t>>(&sets[k]); ids) {
+                    positions[k] = std::lower_bound(ids->begin() + positions[k], ids->end(), end) - ids->begin();
                 }
             }
-        }, tag);
-        
-        p1.advance();
-    }
 
-    p1.finish();
+            continue;
+        }
 
-    auto elapsed = std::chrono::steady_clock::now() - begin;
+        for (size_t k = 0; k < sets.size(); ++k) {
+            const bool replace = load && k == 0;
+            const bool keep = k < kept;
 
-    const size_t total_bytes = 4 + 4 + (tag_count * sizeof(uint32_t)) + (total_posts * sizeof(uint32_t));
+            std::visit(overloaded {
+                [&](std::monostate) {
+                    if (replace || keep) {
+                        std::ranges::fill(words, 0);
+                    }
+                },
+                [&](std::span<const uint32_t> ids) {
+                    size_t& pos = positions[k];
+
+                    if (replace) {
+                        std::ranges::fill(words, 0);
+                        for (; pos < ids.size() && ids[pos] < end; ++pos) {
+                            words[(ids[pos] - begin) / 64] |= uint64_t { 1 } << (ids[pos] % 64);
+                        }
+                    } else if (keep) {
+                        /* Collect the bits of all IDs in the same word, words without any IDs are cleared */
+                        size_t next_word = 0;
+                        while (pos < ids.size() && ids[pos] < end) {
+                            const uint32_t word = (ids[pos] - begin) / 64;
+
+                            uint64_t bits = 0;
+                            for (; pos < ids.size() && ids[pos] < end && ((ids[pos] - begin) / 64) == word; ++pos) {
+                                bits |= uint64_t { 1 } << (ids[pos] % 64);
+                            }
 
-    std::cerr << "Read " << tag_count << " tags, "
-        << total_posts << " posts (up to ID " << result.max_post << ")\n"
-        << "  " << (tag_count - id_lists - masks) << " empty tags, " << id_lists << " ID lists, " << masks << " mask arrays ("
-        << get_bytes(sizeof(mask_val_t) * result.mask_size()) << " per mask)\n"
-        << "  " << get_bytes(index_bytes) << " total memory, "
-        << get_bytes(total_bytes) << " in " << get_time(elapsed) << " (" << get_bytes(total_bytes / (elapsed.count() / 1e9)) << "/s)\n\n";
+                            std::fill(words.begin() + next_word, words.begin() + word, 0);
+                            words[word] &= bits;
+                            next_word = word + 1;
+                        }
 
-    return result;
+                        std::fill(words.begin() + next_word, words.end(), 0);
+                    } else {
+                        for (; pos < ids.size() && ids[pos] < end; ++pos) {
+                            words[(ids[pos] - begin) / 64] &= ~(uint64_t { 1 } << (ids[pos] % 64));
+                        }
+                    }
+                },
+                [&](const mask_desc& mask) {
+                    const std::span<const uint64_t> bits = mask.words().subspan(first_word, words.size());
+                    if (replace) {
+                        std::ranges::copy(bits, words.begin());
+                    } else if (keep) {
+                        bitmap_ops::and_into(words, bits);
+                    } else {
+                        bitmap_ops::andnot_into(words, bits);
+                    }
+                },
+                [&](const container_desc& containers) {
+                    const std::span<uint64_t> bits = replace ? words : std::span<uint64_t> { expanded.data(), words.size() };
+                    std::ranges::fill(bits, 0);
+                    containers->or_range_into(first_word, bits);
+
+                    if (replace) {
+                        return;
+                    }
+
+                    if (keep) {
+                        bitmap_ops::and_into(words, bits);
+                    } else {
+                        bitmap_ops::andnot_into(words, bits);
+                    }
+                },
+            }, sets[k]);
+        }
+
+        finish(begin, std::span<const uint64_t> { words });
+    }
+
+    /* Only blocks that lie entirely within result can become clean, a partial last block may still hold
+     * something past the end from whoever used the storage before
+     */
+    const size_t whole = result.size() / and_block_words;
+    const size_t blocks = (result.size() + and_block_words - 1) / and_block_words;
+    const auto first_bits = [](size_t n, size_t i) {
+        return ((i + 1) * 64 <= n) ? ~uint64_t { 0 } : (n <= i * 64) ? 0 : (uint64_t { 1 } << (n % 64)) - 1;
+    };
+
+    for (size_t i = 0; i < dirty.size(); ++i) {
+        const uint64_t kept_blocks = load ? live[i] : (dirty[i] & live[i]);
+        dirty[i] = (dirty[i] & ~first_bits(whole, i)) | (kept_blocks & first_bits(blocks, i));
+    }
 }
 
-static void usage(const char* argv0) {
-    std::cerr << "Usage:\n\n"
-              << argv0 << " <index_file>\n\n";
+/* Set the bits of sorted IDs in a mask, marking every block they land in as dirty once */
+static void scatter_ids(scratch_arena<mask_val_t>::buffer& mask, std::span<const uint32_t> ids) {
+    static constexpr size_t block_posts = scratch_arena<mask_val_t>::block_size * MASK_SIZE;
+
+    for (size_t i = 0; i < ids.size(); ++i) {
+        if (i == 0 || ids[i] / block_posts != ids[i - 1] / block_posts) {
+            mask.touch(ids[i] / MASK_SIZE, 1);
+        }
 
+        mask[ids[i] / MASK_SIZE] |= mask_val_t{1} << (ids[i] % MASK_SIZE);
+    }
 }
 
-std::vector<uint32_t> search(timekeeping& trace, index_t& index, std::vector<uint32_t> search_ids) {
+/* Results go to `results`, so its capacity carries over between searches */
+void search(timekeeping& trace, const index_t& index, std::span<const uint32_t> tags, std::vector<uint32_t>& results) {
     auto a = std::chrono::steady_clock::now();
-    std::ranges::sort(search_ids, [&index](uint32_t lhs, uint32_t rhs) {
-        size_t lhs_size = std::visit(sort_visitor, index.at(lhs));
-        size_t rhs_size = std::visit(sort_visitor, index.at(rhs));
 
-        return lhs_size < rhs_size;
+    auto search_ids = scratch_arena<uint32_t>::local().take(tags.size());
+    std::ranges::copy(tags, search_ids.begin());
+    std::ranges::sort(search_ids, [&index](uint32_t lhs, uint32_t rhs) {
+        return index.file.post_count(lhs) < index.file.post_count(rhs);
     });
 
     auto b = std::chrono::steady_clock::now();
 
     //std::vector<mask_val_t> result_mask(index.mask_size(), 0);
-    auto result_mask = avx_buffer<mask_val_t>::zero(index.mask_size());
+    auto result_mask = scratch_arena<mask_val_t>::local().zero(index.mask_size());
+
+    /* The same bits as 64-bit words, for the container kernels */
+    std::span<uint64_t> result_words { reinterpret_cast<uint64_t*>(result_mask.data()), result_mask.size() * (sizeof(mask_val_t) / sizeof(uint64_t)) };
 #if 0
     overloaded initialize_visitor {
         [](std::monostate) { },
 
-        [&result_mask](const std::vector<uint32_t>& ids) {
+        [&result_mask](std::span<const uint32_t> ids) {
             for (uint32_t id : ids) {
                 uint32_t index = id / MASK_SIZE;
                 uint32_t offset = id % MASK_SIZE;
@@ -259,209 +487,138 @@ std::vector<uint32_t> search(timekeeping& trace, index_t& index, std::vector<uin
     /* Separately combine the first two */
     overloaded first_tag_visitor {
         [](std::monostate, std::monostate) { },
-        [](std::monostate, const std::vector<uint32_t>&) { },
+        [](std::monostate, std::span<const uint32_t>) { },
         [](std::monostate, const mask_desc&) { },
-        [](const std::vector<uint32_t>&, std::monostate) { },
+        [](std::span<const uint32_t>, std::monostate) { },
         [](const mask_desc&, std::monostate) { },
+        [](std::monostate, const container_desc&) { },
+        [](const container_desc&, std::monostate) { },
 
-        [&result_mask](const std::vector<uint32_t>& lhs, const std::vector<uint32_t>& rhs) {
-            auto left_it = lhs.begin();
-            auto right_it = rhs.begin();
-
-            while (left_it != lhs.end() && right_it != rhs.end()) {
-                auto order = *left_it <=> *right_it;
+        [&result_mask](std::span<const uint32_t> lhs, std::span<const uint32_t> rhs) {
+            auto common = scratch_arena<uint32_t>::local().take(std::min(lhs.size(), rhs.size()) + set_ops::slack);
+            common.resize(set_ops::intersect(lhs, rhs, common.data()));
 
-                if (order == std::strong_ordering::less) {
-                    ++left_it;
-                } else if (order == std::strong_ordering::greater) {
-                    ++right_it;
-                } else {
-                    uint32_t index = *left_it++ / MASK_SIZE;
-                    uint32_t offset = *right_it++ % MASK_SIZE;
-
-                    result_mask[index] |= mask_val_t{1} << offset;
-                }
-            }
+            scatter_ids(result_mask, common);
         },
 
-        [&result_mask](const std::vector<uint32_t>& lhs, const mask_desc& rhs) {
-            for (uint32_t id : lhs) {
-                uint32_t index = id / MASK_SIZE;
-                uint32_t offset = id % MASK_SIZE;
+        [&result_mask](std::span<const uint32_t> lhs, const mask_desc& rhs) {
+            /* Probe the list against the mask a batch at a time, only the survivors are scattered */
+            auto common = scratch_arena<uint32_t>::local().take(lhs.size() + bitmap_ops::slack);
+            common.resize(bitmap_ops::probe(rhs.words(), lhs, true, common.data()));
 
-                auto mask = mask_val_t{1} << offset;
-                result_mask[index] |= mask & rhs[index];
-            }
+            scatter_ids(result_mask, common);
         },
 
-        [&result_mask](const mask_desc& lhs, const std::vector<uint32_t>& rhs) {
-            for (uint32_t id : rhs) {
-                uint32_t index = id / MASK_SIZE;
-                uint32_t offset = id % MASK_SIZE;
+        [&result_mask](const mask_desc& lhs, std::span<const uint32_t> rhs) {
+            auto common = scratch_arena<uint32_t>::local().take(rhs.size() + bitmap_ops::slack);
+            common.resize(bitmap_ops::probe(lhs.words(), rhs, true, common.data()));
 
-                auto mask = mask_val_t{1} << offset;
-                result_mask[index] |= mask & lhs[index];
-            }
+            scatter_ids(result_mask, common);
         },
 
         [&result_mask](const mask_desc& lhs, const mask_desc& rhs) {
-            for (size_t i = 0; i < result_mask.size_m256i(); ++i) {
+            result_mask.touch_all();
+
+            /* Rounded up, the storage is padded like an avx_buffer */
+            __m256i* result_m256i = reinterpret_cast<__m256i*>(result_mask.data());
+            for (size_t i = 0; i < ((result_mask.size() * sizeof(mask_val_t)) + sizeof(__m256i) - 1) / sizeof(__m256i); ++i) {
                 //result_mask[i] = lhs[i] & rhs[i];
                 //mask_val_t res = lhs[i] & rhs[i];
                 //if (res) {
                 //    result_mask[i] = res;
                 //}
-                m256i l = _mm256_load_si256(lhs.mask.m256i(i));
-                m256i r = _mm256_load_si256(rhs.mask.m256i(i));
+                m256i l = _mm256_load_si256(lhs.m256i(i));
+                m256i r = _mm256_load_si256(rhs.m256i(i));
 
                 m256i result = l & r;
-                _mm256_store_si256(result_mask.m256i(i), result);
+                _mm256_store_si256(result_m256i + i, result);
             }
         },
-    };
-
-    std::visit(first_tag_visitor, index.at(search_ids[0]), index.at(search_ids[1]));
-
-    static constexpr size_t drop_count = 2;
-
-#endif
-
-    auto c = std::chrono::steady_clock::now();
 
-    /* Effectively bitwise AND on the result_mask */
-    overloaded visitor {
-        [](std::monostate) { },
-
-        [&result_mask](const std::vector<uint32_t>& ids) {
-            for (uint32_t id : ids) {
-                uint32_t index = id / MASK_SIZE;
-                uint32_t offset = id % MASK_SIZE;
-
-                mask_val_t& current = result_mask[index];
-                if (current) {
-                    current &= mask_val_t{1} << offset;
+        [&result_mask](std::span<const uint32_t> lhs, const container_desc& rhs) {
+            for (uint32_t id : lhs) {
+                if (rhs->contains(id)) {
+                    result_mask[id / MASK_SIZE] |= mask_val_t{1} << (id % MASK_SIZE);
+                    result_mask.touch(id / MASK_SIZE, 1);
                 }
             }
         },
 
-        [&result_mask](const mask_desc& mask) {
-            for (size_t i = 0; i < result_mask.size_m256i(); ++i) {
-                m256i next = _mm256_load_si256(mask.mask.m256i(i));
-
-                if (!epi32::is_zero(next)) {
-                    m256i cur = _mm256_load_si256(result_mask.m256i(i));
-
-                    m256i result = cur & next;
-
-                    epi32::store(result_mask.m256i(i), result);
+        [&result_mask](const container_desc& lhs, std::span<const uint32_t> rhs) {
+            for (uint32_t id : rhs) {
+                if (lhs->contains(id)) {
+                    result_mask[id / MASK_SIZE] |= mask_val_t{1} << (id % MASK_SIZE);
+                    result_mask.touch(id / MASK_SIZE, 1);
                 }
             }
-            //for (size_t i = 0; i < result_mask.size(); ++i) {
-                //mask_val_t& current = result_mask[i];
-                //if (current) {
-                    //current &= mask[i];
-                //}
-            //}
         },
-    };
-
-#define DROP_END 1
-
-    for (size_t i = drop_count; i < (search_ids.size() - DROP_END); ++i) {
-        std::visit(visitor, index.at(search_ids[i]));
-    }
-
-    auto d = std::chrono::steady_clock::now();
-
-    std::vector<uint32_t> results;
 
-#if DROP_END == 0
-    uint32_t idx = 0;
-    for (mask_val_t mask : result_mask) {
+        [&result_mask, result_words](const mask_desc& lhs, const container_desc& rhs) {
+            result_mask.touch_all();
+            std::ranges::copy(lhs.mask, result_mask.data());
+            rhs->and_into(result_words);
+        },
 
-#if 0
+        [&result_mask, result_words](const container_desc& lhs, const mask_desc& rhs) {
+            result_mask.touch_all();
+            std::ranges::copy(rhs.mask, result_mask.data());
+            lhs->and_into(result_words);
+        },
 
-        for (size_t i = 0; i < (MASK_SIZE / 64); ++i) {
-            uint64_t submask = (mask >> (i * 64)) & 0xFFFFFFFFFFFFFFFFull;
-            while (submask) {
-                int trailing = __builtin_ctzll(submask);
+        [&result_mask, result_words](const container_desc& lhs, const container_desc& rhs) {
+            /* Only chunks present in both are combined */
+            const roaring_bitmap common = *lhs.set & *rhs.set;
+            common.for_each_extent([&result_mask](uint32_t first, uint32_t last) {
+                result_mask.touch(first / MASK_SIZE, (last / MASK_SIZE) - (first / MASK_SIZE) + 1);
+            });
 
-                results.push_back(idx + trailing);
-                submask &= ~(uint64_t{1} << trailing);
-            }
+            common.or_into(result_words);
+        },
+    };
 
-            idx += 64;
-        }
+    /* ID lists of a compressed index are decoded for the query only */
+    auto decoded = scratch_vectors<scratch_arena<uint32_t>::buffer>::local().take();
+    decoded.resize(search_ids.size());
+    std::visit(first_tag_visitor, index.at(search_ids[0], &decoded[0]), index.at(search_ids[1], &decoded[1]));
 
-#else
+    static constexpr size_t drop_count = 2;
 
-        if (mask) {
-            for (uint32_t i = 0; i < MASK_SIZE; ++i, ++idx) {
-                if (mask & (mask_val_t{1} << i)) {
-                    results.push_back(idx);
-                }
-            }
-        } else {
-            idx += MASK_SIZE;
-        }
 #endif
-    }
-#else
-
-    /* Perform last merge and result writing directly */
-    overloaded final_visitor {
-        [](std::monostate) { },
-
-        [&results, &result_mask](const std::vector<uint32_t>& ids) {
-            for (uint32_t id : ids) {
-                uint32_t index = id / MASK_SIZE;
-                uint32_t offset = id % MASK_SIZE;
 
-                if (result_mask[index] & (mask_val_t{1} << offset)) {
-                    results.push_back(id);
-                }
-            }
-        },
+    auto c = std::chrono::steady_clock::now();
 
-        [&results, &result_mask](const mask_desc& masks) {
-            for (size_t i = 0; i < result_mask.size(); ++i) {
-                if (mask_val_t val = masks[i]; val) {
-                    if (mask_val_t masked = result_mask[i] & val; masked) {
-                        for (uint32_t j = 0; j < MASK_SIZE; ++j) {
-                            if (masked & (mask_val_t{1} << j)) {
-                                results.push_back((i * MASK_SIZE) + j);
-                            }
-                        }
-                    }
-                }
-            }
-        },
-    };
+    /* AND the remaining tags into result_mask a block at a time, extracting every block once it's done */
+    auto remaining = scratch_vectors<index_value_t>::local().take();
+    for (size_t i = drop_count; i < search_ids.size(); ++i) {
+        remaining.push_back(index.at(search_ids[i], &decoded[i]));
+    }
 
-    std::visit(final_visitor, index.at(search_ids.back()));
+    results.clear();
+    and_blocks(result_mask, result_mask.dirty(), remaining, remaining.size(), false, [&results](uint32_t base, std::span<const uint64_t> words) {
+        const size_t count = results.size();
+        results.resize(count + bitmap_ops::count(words) + bitmap_ops::slack);
+        results.resize(count + bitmap_ops::extract(words, base, results.data() + count));
+    });
 
-#endif
-    auto e = std::chrono::steady_clock::now();
+    auto d = std::chrono::steady_clock::now();
 
     trace.sort += (b - a);
     trace.initialize += (c - b);
     trace.mask += (d - c);
-    trace.result += (e - d);
-
-    return results;
 }
 
-static void search_helper(index_t& index, std::span<uint32_t> search_ids, std::optional<std::span<uint32_t>> expected = {}) {
+static void search_helper(const index_t& index, std::span<uint32_t> search_ids, std::optional<std::span<uint32_t>> expected = {}) {
     std::vector<uint32_t> sorted_search_ids { search_ids.begin(), search_ids.end() };
     std::ranges::sort(sorted_search_ids);
 
     for (uint32_t id : sorted_search_ids) {
         std::cerr << "Tag " << id << " -> ";
 
-        switch (index.at(id).index()) {
+        switch (index.at(id, nullptr).index()) {
             case 0: std::cerr << "unknown\n"; break;
             case 1: std::cerr << "ID list\n"; break;
             case 2: std::cerr << "Bitmask\n";  break;
+            case 3: std::cerr << "Containers\n"; break;
         }
     }
 
@@ -471,7 +628,7 @@ static void search_helper(index_t& index, std::span<uint32_t> search_ids, std::o
 
     timekeeping trace{};
     for (size_t i = 0; i < repeats; ++i) {
-        results = search(trace, index, { search_ids.begin(), search_ids.end() });
+        search(trace, index, search_ids, results);
     }
 
     std::cerr << "Found " << results.size() << " results in "
@@ -481,8 +638,7 @@ static void search_helper(index_t& index, std::span<uint32_t> search_ids, std::o
     std::cerr << "  Sort:         " << get_time(trace.avg_sort()) << '\n'
               << "  Initial mask: " << get_time(trace.avg_initialize()) << " ("
               << get_bytes((index.mask_size() * sizeof(mask_val_t)) / (trace.avg_initialize().count() / 1e9)) << "/s)\n"
-              << "  Mask:         " << get_time(trace.avg_mask()) << '\n'
-              << "  Read result:  " << get_time(trace.avg_result()) << '\n';
+              << "  Mask, result: " << get_time(trace.avg_mask()) << '\n';
 
     if (!expected.has_value()) {
         std::cerr << '\n';
@@ -523,43 +679,1881 @@ static void search_helper(index_t& index, std::span<uint32_t> search_ids, std::o
     std::cerr << '\n';
 }
 
-int main(int argc, char** argv) {
-    if (argc != 2) {
-        usage(*argv);
-        return EXIT_FAILURE;
+/* Query execution.
+ *
+ * Every operator produces either a sorted ID list or a full-width bitmask. Tags are used straight
+ * from the index as list, bitmask or container view, and only intermediate results are materialized.
+ *
+ * The form every step of a conjunction runs in is picked from a cost model over the tag sizes and
+ * representations, see plan_all(). The fixed strategies run every step the same way instead, which
+ * is what search and search() above do, and are kept around to compare the planner against.
+ */
+
+/* Intermediate results are borrowed from the thread's scratch arenas and go back once the query is done
+ * with them, so repeated queries reuse the same memory. Masks only get the blocks cleared that an earlier
+ * query left anything in, everything writing into them keeps their dirty blocks up to date.
+ */
+using bitmask_t = scratch_arena<mask_val_t>::buffer;
+using id_list = scratch_arena<uint32_t>::buffer;
+
+enum class strategy {
+    /* Cheapest form and operator per step */
+    planned,
+
+    /* Sorted lists and linear merges only, like search */
+    merge,
+
+    /* Bitmasks only, like search() above */
+    bitmask,
+};
+
+static constexpr std::array strategy_names { "Planned", "Merge", "Bitmask" };
+
+/* Form of an intermediate result */
+enum class form { list, bitmask };
+
+/* What becomes of an operand */
+enum class output {
+    /* Input to another operator */
+    nested,
+
+    /* The query's result, as a list of IDs */
+    ids,
+
+    /* The query's result, but only its size is needed */
+    count,
+};
+
+struct operand {
+    /* View of a tag from the index or of `list` / `mask` */
+    index_value_t value;
+
+    /* Expected number of posts */
+    size_t estimate;
+
+    /* Sorted IDs, for tags and list results. Tags stored as bitmask or containers have both */
+    std::optional<std::span<const uint32_t>> ids;
+
+    id_list list;
+    bitmask_t mask;
+
+    /* How the operand was computed, only filled in when explaining a query */
+    std::string plan;
+
+    /* Exact number of posts, when counting fused the last step so there is no value */
+    std::optional<size_t> count;
+};
+
+[[nodiscard]] static operand make_operand(id_list list) {
+    operand result { .value = std::monostate {}, .estimate = list.size(), .ids = {}, .list = std::move(list), .mask = {}, .plan = {}, .count = {} };
+    result.value = std::span<const uint32_t> { result.list };
+    result.ids = std::span<const uint32_t> { result.list };
+    return result;
+}
+
+[[nodiscard]] static operand make_operand(bitmask_t mask, size_t estimate) {
+    operand result { .value = std::monostate {}, .estimate = estimate, .ids = {}, .list = {}, .mask = std::move(mask), .plan = {}, .count = {} };
+    result.value = mask_desc { .post_count = static_cast<uint32_t>(estimate), .mask = { result.mask.data(), result.mask.size() }, .zones = {} };
+    return result;
+}
+
+[[nodiscard]] static std::span<uint64_t> as_words(std::span<mask_val_t> mask) {
+    return { reinterpret_cast<uint64_t*>(mask.data()), mask.size() * (sizeof(mask_val_t) / sizeof(uint64_t)) };
+}
+
+/* A new mask, with every bit cleared */
+[[nodiscard]] static bitmask_t zero_mask(size_t size) {
+    return scratch_arena<mask_val_t>::local().zero(size);
+}
+
+/* A new mask with unspecified bits, for masks that are written in full before being read */
+[[nodiscard]] static bitmask_t take_mask(size_t size) {
+    return scratch_arena<mask_val_t>::local().take(size);
+}
+
+/* A new list of `size` unspecified IDs */
+[[nodiscard]] static id_list take_list(size_t size) {
+    return scratch_arena<uint32_t>::local().take(size);
+}
+
+/* An empty vector for the planner's bookkeeping, keeping the capacity earlier queries gave it */
+template <typename T>
+[[nodiscard]] static scratch_vectors<T>::vector take_vector() {
+    return scratch_vectors<T>::local().take();
+}
+
+/* Posts of a bitmask in ascending order */
+[[nodiscard]] static id_list to_list(std::span<const mask_val_t> mask) {
+    const std::span<const uint64_t> words { reinterpret_cast<const uint64_t*>(mask.data()), mask.size() * (sizeof(mask_val_t) / sizeof(uint64_t)) };
+
+    id_list result = take_list(bitmap_ops::count(words) + bitmap_ops::slack);
+    result.resize(bitmap_ops::extract(words, 0, result.data()));
+    return result;
+}
+
+/* k-way union of sorted lists through a min-heap of cursors */
+[[nodiscard]] static id_list union_lists(std::span<const std::span<const uint32_t>> lists) {
+    if (lists.size() == 2) {
+        id_list result = take_list(lists[0].size() + lists[1].size());
+        result.resize(std::ranges::set_union(lists[0], lists[1], result.begin()).out - result.begin());
+        return result;
     }
 
-    fs::path index_path = argv[1];
+    using cursor = std::pair<const uint32_t*, const uint32_t*>;
+    auto order = [](const cursor& lhs, const cursor& rhs) { return *lhs.first > *rhs.first; };
 
-    if (!exists(index_path) || !is_regular_file(index_path)) {
-        std::cerr << "Index file does not exist or is not a file: " << index_path.string() << '\n';
-        usage(*argv);
-        return EXIT_FAILURE;
+    auto heap = take_vector<cursor>();
+    size_t total = 0;
+    for (std::span<const uint32_t> list : lists) {
+        if (!list.empty()) {
+            heap.emplace_back(list.data(), list.data() + list.size());
+            total += list.size();
+        }
     }
 
-    index_t index = load_index(index_path);
-    
-    {
-        std::array<uint32_t, 5> search_ids {
-            470575, 212816, 13197, 29, 1283444, // 1girl solo long_hair touhou fate/grand_order
-        };
+    std::ranges::make_heap(heap, order);
 
-        std::array<uint32_t, 17> expected {
-            2380549, 2420287, 2423105, 2523394, 2646037,
-            2683860, 2705783, 2745868, 2746265, 2752461,
-            2905088, 2917346, 3114201, 4081318, 4718669,
-            5639802, 6055186
-        };
+    id_list result = take_list(total);
+    result.clear();
 
-        search_helper(index, search_ids, expected);
+    while (!heap.empty()) {
+        std::ranges::pop_heap(heap, order);
+        cursor& top = heap.back();
+
+        if (result.empty() || result.back() != *top.first) {
+            result.push_back(*top.first);
+        }
+
+        if (++top.first == top.second) {
+            heap.pop_back();
+        } else {
+            std::ranges::push_heap(heap, order);
+        }
     }
 
-    {
-        std::array<uint32_t, 2> search_ids {
-            1574450, 1665885, // t-doll_contract girls'_frontline
-        };
+    return result;
+}
 
-        search_helper(index, search_ids);
+/* Rough cost of the operators in nanoseconds, fitted to the built-in query mix.
+ *
+ * Most of these kernels are bound by branch mispredictions rather than memory, which is what makes
+ * merging lists of similar sizes and extracting sparse bitmasks expensive.
+ */
+namespace cost {
+    /* Per ID of both lists in a block-wise merge, which doesn't branch on how the lists interleave */
+    static constexpr double merge = 0.7;
+
+    /* Per ID of the smaller list and search step in a galloping merge */
+    static constexpr double gallop = 1.5;
+
+    /* Per ID tested against a bitmask, a batch of IDs at a time with one gather */
+    static constexpr double probe = 2.0;
+
+    /* Per ID tested against containers, a binary search over the chunks and usually another inside one */
+    static constexpr double contains = 25.0;
+
+    /* Per ID set or cleared in a bitmask */
+    static constexpr double scatter = 2.5;
+
+    /* Per ID of a list ANDed into a bitmask */
+    static constexpr double group = 8.0;
+
+    /* Per 128-bit word streamed through a bitmask operation */
+    static constexpr double word = 1.0;
+
+    /* Per ID extracted from a bitmask, and per non-empty word */
+    static constexpr double extract = 0.4;
+    static constexpr double extract_word = 12.0;
+
+    /* Per ID and merged list in a heap union */
+    static constexpr double heap = 4.0;
+}
+
+/* How a list is filtered through a set */
+enum class list_op { none, merge, gallop, probe, contains };
+
+static constexpr std::array list_op_names { "none", "merge", "gallop", "probe", "contains" };
+
+/* Cheapest operator for filtering n sorted IDs through a set, and its cost */
+[[nodiscard]] static std::pair<list_op, double> list_step(double n, const operand& set, strategy strat) {
+    if (std::holds_alternative<std::monostate>(set.value)) {
+        return { list_op::none, 0.0 };
+    }
+
+    std::pair best { list_op::none, std::numeric_limits<double>::infinity() };
+    auto consider = [&best](list_op op, double cost) {
+        if (cost < best.second) {
+            best = { op, cost };
+        }
+    };
+
+    if (set.ids) {
+        const double m = static_cast<double>(set.ids->size());
+        consider(list_op::merge, cost::merge * (n + m));
+
+        if (strat != strategy::merge) {
+            consider(list_op::gallop, cost::gallop * n * (1 + (2 * std::log2((m / std::max(n, 1.0)) + 1))));
+        }
+    }
+
+    if (strat != strategy::merge) {
+        if (std::holds_alternative<mask_desc>(set.value)) {
+            consider(list_op::probe, cost::probe * n);
+        } else if (std::holds_alternative<container_desc>(set.value)) {
+            consider(list_op::contains, cost::contains * n);
+        }
+    }
+
+    return best;
+}
+
+/* Cost of combining a set into a bitmask, clearing words without IDs of the set if `keep` */
+[[nodiscard]] static double bitmask_step(const index_t& index, const index_value_t& set, bool keep) {
+    const double words = static_cast<double>(index.mask_size());
+
+    /* Array containers are combined value by value, like a list */
+    auto list_cost = [&](double n) {
+        return keep ? cost::group * n : cost::scatter * n;
+    };
+
+    return std::visit(overloaded {
+        [&](std::monostate) { return keep ? cost::word * words : 0.0; },
+        [&](std::span<const uint32_t> ids) { return list_cost(static_cast<double>(ids.size())) + (keep ? cost::word * words : 0.0); },
+        [&](const mask_desc&) { return cost::word * words; },
+        [&](const container_desc& containers) {
+            const double arrays = static_cast<double>(containers->count(roaring_bitmap::container_type::array)) / static_cast<double>(containers->container_count());
+            return list_cost(arrays * static_cast<double>(containers->cardinality())) + (cost::word * words);
+        },
+    }, set);
+}
+
+[[nodiscard]] static double to_list_cost(const index_t& index, double n) {
+    return (cost::extract * n) + (cost::extract_word * std::min(static_cast<double>(index.mask_size()), n));
+}
+
+[[nodiscard]] static double to_bitmask_cost(const index_t& index, double n) {
+    return (cost::word * static_cast<double>(index.mask_size())) + (cost::scatter * n);
+}
+
+/* Cost of starting a conjunction from a set in either form */
+[[nodiscard]] static double load_cost(const index_t& index, const operand& set, form target) {
+    const double n = static_cast<double>(set.estimate);
+    if (target == form::list && set.ids) {
+        return 0.0;
+    }
+
+    return std::visit(overloaded {
+        [](std::monostate) { return 0.0; },
+        [&](std::span<const uint32_t>) { return (target == form::list) ? 0.0 : to_bitmask_cost(index, n); },
+        [&](const mask_desc&) { return (target == form::list) ? to_list_cost(index, n) : 2 * cost::word * static_cast<double>(index.mask_size()); },
+        [&](const container_desc& containers) {
+            return (target == form::list) ? cost::extract * n : (cost::word * static_cast<double>(index.mask_size())) + bitmask_step(index, containers, false);
+        },
+    }, set.value);
+}
+
+/* Forms of a conjunction's running result, after loading the first operand and after every further step */
+struct and_plan {
+    scratch_vectors<form>::vector forms;
+    double cost;
+    double estimate;
+};
+
+/* Pick the cheapest forms for a conjunction.
+ *
+ * `steps` are the included operands from the smallest up, followed by the excluded ones. The result
+ * only ever shrinks, so every step is costed at the expected size of the running result, assuming
+ * tags are independent. Each step can keep the current form or convert first, which makes this a
+ * shortest path over two states per step.
+ */
+[[nodiscard]] static and_plan plan_all(const index_t& index, std::span<const operand> steps, size_t included, strategy strat, bool to_list) {
+    static constexpr double unreachable = std::numeric_limits<double>::infinity();
+    static constexpr size_t list = static_cast<size_t>(form::list);
+    static constexpr size_t bitmask = static_cast<size_t>(form::bitmask);
+
+    const double posts = static_cast<double>(index.mask_size() * MASK_SIZE);
+
+    std::array<double, 2> total {
+        (strat == strategy::bitmask) ? unreachable : load_cost(index, steps[0], form::list),
+        (strat == strategy::merge) ? unreachable : load_cost(index, steps[0], form::bitmask),
+    };
+
+    /* Form before every step, for each form after it */
+    auto previous = take_vector<std::array<form, 2>>();
+    previous.resize(steps.size());
+
+    double n = static_cast<double>(steps[0].estimate);
+    for (size_t i = 1; i < steps.size(); ++i) {
+        const bool keep = i < included;
+
+        const double list_cost = list_step(n, steps[i], strat).second;
+        const double mask_cost = bitmask_step(index, steps[i].value, keep);
+
+        std::array<double, 2> next {};
+
+        const double list_from_list = total[list] + list_cost;
+        const double list_from_mask = total[bitmask] + to_list_cost(index, n) + list_cost;
+        next[list] = std::min(list_from_list, list_from_mask);
+        previous[i][list] = (list_from_list <= list_from_mask) ? form::list : form::bitmask;
+
+        const double mask_from_mask = total[bitmask] + mask_cost;
+        const double mask_from_list = total[list] + to_bitmask_cost(index, n) + mask_cost;
+        next[bitmask] = std::min(mask_from_mask, mask_from_list);
+        previous[i][bitmask] = (mask_from_mask <= mask_from_list) ? form::bitmask : form::list;
+
+        if (strat == strategy::merge) {
+            next[bitmask] = unreachable;
+        } else if (strat == strategy::bitmask) {
+            next[list] = unreachable;
+        }
+
+        total = next;
+
+        const double m = static_cast<double>(steps[i].estimate);
+        n = keep ? std::min(n, n * m / posts) : n * std::max(0.0, 1 - (m / posts));
+    }
+
+    if (to_list) {
+        total[bitmask] += to_list_cost(index, n);
+    }
+
+    and_plan result { .forms = take_vector<form>(), .cost = 0, .estimate = n };
+    result.forms.resize(steps.size());
+
+    form current = (total[list] <= total[bitmask]) ? form::list : form::bitmask;
+    result.cost = total[static_cast<size_t>(current)];
+
+    for (size_t i = steps.size() - 1; i > 0; --i) {
+        result.forms[i] = current;
+        current = previous[i][static_cast<size_t>(current)];
+    }
+
+    result.forms[0] = current;
+
+    return result;
+}
+
+/* Filter a sorted list through a set, keeping the IDs that are (or aren't) in it */
+[[nodiscard]] static id_list filter_list(std::span<const uint32_t> ids, const operand& set, bool keep, list_op op) {
+    auto filter = [&](auto&& contains) {
+        id_list result = take_list(ids.size());
+        result.clear();
+        for (uint32_t id : ids) {
+            if (contains(id) == keep) {
+                result.push_back(id);
+            }
+        }
+
+        return result;
+    };
+
+    id_list result;
+
+    switch (op) {
+        case list_op::none:
+            if (!keep) {
+                result.assign(ids);
+            }
+
+            return result;
+
+        case list_op::merge:
+        case list_op::gallop:
+            if (keep) {
+                result.resize(std::min(ids.size(), set.ids->size()) + set_ops::slack);
+                result.resize((op == list_op::gallop)
+                    ? set_ops::intersect_gallop_simd(ids, *set.ids, result.data())
+                    : set_ops::intersect_simd(ids, *set.ids, result.data()));
+            } else {
+                result.resize(ids.size() + set_ops::slack);
+                result.resize((op == list_op::gallop)
+                    ? set_ops::subtract_gallop(ids, *set.ids, result.data())
+                    : set_ops::subtract_simd(ids, *set.ids, result.data()));
+            }
+
+            return result;
+
+        case list_op::probe: {
+            const mask_desc& mask = std::get<mask_desc>(set.value);
+            result.resize(ids.size() + bitmap_ops::slack);
+            result.resize(bitmap_ops::probe(mask.words(), ids, keep, result.data()));
+            return result;
+        }
+
+        case list_op::contains: {
+            const container_desc& containers = std::get<container_desc>(set.value);
+            return filter([&containers](uint32_t id) { return containers->contains(id); });
+        }
+    }
+
+    return result;
+}
+
+/* Number of IDs of a sorted list that are (or aren't) in a set, like filter_list() but without writing them */
+[[nodiscard]] static size_t count_list(std::span<const uint32_t> ids, const operand& set, bool keep, list_op op) {
+    size_t matches = 0;
+
+    switch (op) {
+        case list_op::none:
+            break;
+
+        case list_op::merge:
+            matches = set_ops::intersect_simd<true>(ids, *set.ids, nullptr);
+            break;
+
+        case list_op::gallop:
+            matches = set_ops::intersect_gallop_simd<true>(ids, *set.ids, nullptr);
+            break;
+
+        case list_op::probe: {
+            const mask_desc& mask = std::get<mask_desc>(set.value);
+            matches = bitmap_ops::probe_count(mask.words(), ids);
+            break;
+        }
+
+        case list_op::contains: {
+            const container_desc& containers = std::get<container_desc>(set.value);
+            matches = std::ranges::count_if(ids, [&containers](uint32_t id) { return containers->contains(id); });
+            break;
+        }
+    }
+
+    return keep ? matches : ids.size() - matches;
+}
+
+/* result |= set */
+static void or_into(bitmask_t& result, const index_value_t& set) {
+    std::visit(overloaded {
+        [&](std::monostate) { },
+        [&](std::span<const uint32_t> ids) {
+            for (uint32_t id : ids) {
+                result[id / MASK_SIZE] |= mask_val_t{1} << (id % MASK_SIZE);
+                result.touch(id / MASK_SIZE, 1);
+            }
+        },
+        [&](const mask_desc& mask) {
+            if (mask.zones.size() >= result.dirty().size()) {
+                bitmap_ops::or_into(result.dirty(), mask.zones.first(result.dirty().size()));
+            } else {
+                result.touch_all();
+            }
+
+            bitmap_ops::or_into(as_words(result), mask.words());
+        },
+        [&](const container_desc& containers) {
+            containers->for_each_extent([&result](uint32_t first, uint32_t last) {
+                result.touch(first / MASK_SIZE, (last / MASK_SIZE) - (first / MASK_SIZE) + 1);
+            });
+
+            containers->or_into(as_words(result));
+        },
+    }, set);
+}
+
+[[nodiscard]] static std::string describe(const operand& value) {
+    static constexpr std::array names { "empty", "list", "bitmask", "containers" };
+    return value.plan + '[' + names[value.value.index()] + ' ' + std::to_string(value.estimate) + ']';
+}
+
+[[nodiscard]] static operand evaluate(const index_t& index, const query_node& node, strategy strat, output out, bool explain);
+
+[[nodiscard]] static operand evaluate_any(const index_t& index, const query_node& node, strategy strat, output out, bool explain) {
+    auto children = take_vector<operand>();
+    size_t estimate = 0;
+    bool all_lists = true;
+
+    for (const query_node& child : node.children) {
+        children.push_back(evaluate(index, child, strat, output::nested, explain));
+        estimate += children.back().estimate;
+        all_lists &= children.back().ids.has_value() || std::holds_alternative<std::monostate>(children.back().value);
+    }
+
+    estimate = std::min<size_t>(estimate, index.mask_size() * MASK_SIZE);
+
+    /* A heap merge pays a log factor per ID, a bitmask pays for every word */
+    bool use_list = (strat == strategy::merge);
+    if (strat == strategy::planned && all_lists) {
+        double mask_cost = (cost::word * static_cast<double>(index.mask_size())) + ((out == output::ids) ? to_list_cost(index, static_cast<double>(estimate)) : 0.0);
+        for (const operand& child : children) {
+            mask_cost += bitmask_step(index, child.value, false);
+        }
+
+        const double list_cost = cost::heap * static_cast<double>(estimate) * std::log2(static_cast<double>(children.size()) + 1);
+        use_list = list_cost <= mask_cost;
+    }
+
+    operand result;
+    if (use_list) {
+        auto lists = take_vector<std::span<const uint32_t>>();
+        for (const operand& child : children) {
+            if (child.ids) {
+                lists.push_back(*child.ids);
+            }
+        }
+
+        result = make_operand(union_lists(lists));
+    } else {
+        bitmask_t mask = zero_mask(index.mask_size());
+        for (const operand& child : children) {
+            or_into(mask, child.value);
+        }
+
+        result = make_operand(std::move(mask), estimate);
+    }
+
+    if (explain) {
+        result.plan = use_list ? "union(" : "or(";
+        for (size_t i = 0; i < children.size(); ++i) {
+            if (i > 0) {
+                result.plan += ' ';
+            }
+
+            result.plan += describe(children[i]);
+        }
+
+        result.plan += ')';
+    }
+
+    return result;
+}
+
+[[nodiscard]] static operand evaluate_all(const index_t& index, const query_node& node, strategy strat, output out, bool explain) {
+    auto steps = take_vector<operand>();
+    auto excluded = take_vector<operand>();
+
+    for (const query_node& child : node.children) {
+        (child.negated ? excluded : steps).push_back(evaluate(index, child, strat, output::nested, explain));
+    }
+
+    /* Start from the smallest set, the result can only shrink */
+    std::ranges::sort(steps, {}, &operand::estimate);
+
+    if (std::holds_alternative<std::monostate>(steps.front().value)) {
+        return make_operand(id_list {});
+    }
+
+    const size_t included = steps.size();
+    std::ranges::move(excluded, std::back_inserter(steps));
+
+    const and_plan plan = plan_all(index, steps, included, strat, out == output::ids);
+
+    id_list ids;
+    std::span<const uint32_t> view;
+    bitmask_t mask;
+
+    /* List that the next run of bitmask steps loads the mask from */
+    id_list source;
+    bool loading = false;
+
+    std::string description;
+
+    form current = plan.forms[0];
+    if (current == form::list) {
+        if (steps[0].ids) {
+            view = *steps[0].ids;
+        } else if (auto bits = std::get_if<mask_desc>(&steps[0].value)) {
+            ids = to_list(bits->mask);
+            view = ids;
+        } else if (auto containers = std::get_if<container_desc>(&steps[0].value)) {
+            ids = take_list(steps[0].estimate);
+            ids.clear();
+            (*containers)->for_each([&ids](uint32_t id) { ids.push_back(id); });
+            view = ids;
+        }
+    } else {
+        /* Loaded by the first run of bitmask steps, which writes every word */
+        mask = take_mask(index.mask_size());
+    }
+
+    if (explain) {
+        description = describe(steps[0]);
+    }
+
+    /* When counting, the last step only counts its result */
+    std::optional<size_t> count;
+
+    for (size_t i = (current == form::list) ? 1 : 0; i < steps.size(); ++i) {
+        const bool keep = i < included;
+        const bool last = (out == output::count) && (i + 1 == steps.size());
+
+        if (i > 0 && plan.forms[i] != current) {
+            if (plan.forms[i] == form::list) {
+                ids = to_list(mask);
+                view = ids;
+            } else {
+                /* Loaded by the bitmask steps, so the list narrows down their zones as well.
+                 * The IDs move out of the way in case the result is extracted into ids again.
+                 */
+                mask = take_mask(index.mask_size());
+                std::swap(source, ids);
+                loading = true;
+            }
+
+            current = plan.forms[i];
+
+            if (explain) {
+                description += (current == form::list) ? " to-list" : " to-bitmask";
+            }
+        }
+
+        if (current == form::list) {
+            const list_op op = list_step(static_cast<double>(view.size()), steps[i], strat).first;
+            if (last) {
+                count = count_list(view, steps[i], keep, op);
+            } else {
+                ids = filter_list(view, steps[i], keep, op);
+                view = ids;
+            }
+
+            if (explain) {
+                description += std::string { " " } + list_op_names[static_cast<size_t>(op)] + (keep ? " " : " -") + describe(steps[i]);
+            }
+        } else {
+            /* All consecutive bitmask steps are applied in one blocked pass, along with extracting or counting the result */
+            size_t end = i + 1;
+            while (end < steps.size() && plan.forms[end] == form::bitmask) {
+                ++end;
+            }
+
+            auto sets = take_vector<index_value_t>();
+            if (loading) {
+                sets.push_back(view);
+            }
+
+            for (size_t k = i; k < end; ++k) {
+                sets.push_back(steps[k].value);
+            }
+
+            const size_t kept = std::clamp(included, i, end) - i + (loading ? 1 : 0);
+            const bool load = i == 0 || loading;
+            loading = false;
+
+            if (end == steps.size() && out == output::count) {
+                count = 0;
+                and_blocks(mask, mask.dirty(), sets, kept, load, [&count](uint32_t, std::span<const uint64_t> words) {
+                    *count += bitmap_ops::count(words);
+                });
+            } else if (end == steps.size() && out == output::ids) {
+                ids.clear();
+                and_blocks(mask, mask.dirty(), sets, kept, load, [&ids](uint32_t base, std::span<const uint64_t> words) {
+                    const size_t size = ids.size();
+                    ids.resize(size + bitmap_ops::count(words) + bitmap_ops::slack);
+                    ids.resize(size + bitmap_ops::extract(words, base, ids.data() + size));
+                });
+
+                view = ids;
+                current = form::list;
+            } else {
+                and_blocks(mask, mask.dirty(), sets, kept, load, [](uint32_t, std::span<const uint64_t>) { });
+            }
+
+            if (explain) {
+                for (size_t k = std::max<size_t>(i, 1); k < end; ++k) {
+                    description += ((k < included) ? " and " : " andnot ") + describe(steps[k]);
+                }
+            }
+
+            i = end - 1;
+        }
+    }
+
+    operand result;
+    if (count) {
+        result = { .value = std::monostate {}, .estimate = *count, .ids = {}, .list = {}, .mask = {}, .plan = {}, .count = count };
+    } else if (current == form::list) {
+        if (view.data() != ids.data()) {
+            ids.assign(view);
+        }
+
+        result = make_operand(std::move(ids));
+    } else {
+        result = make_operand(std::move(mask), static_cast<size_t>(plan.estimate));
+    }
+
+    if (explain) {
+        result.plan = (out == output::nested) ? '(' + description + ')' : description;
+    }
+
+    return result;
+}
+
+[[nodiscard]] static operand evaluate(const index_t& index, const query_node& node, strategy strat, output out, bool explain) {
+    switch (node.type) {
+        case query_node::node_type::tag: {
+            operand result { .value = std::monostate {}, .estimate = index.file.post_count(node.tag), .ids = {}, .list = {}, .mask = {}, .plan = {}, .count = {} };
+            result.value = index.at(node.tag, &result.list);
+
+            /* The merge strategy reads every tag as a list, no matter how the index stores it */
+            if (strat == strategy::merge && result.estimate > 0 && !std::holds_alternative<std::span<const uint32_t>>(result.value)) {
+                result.value = index.posts(node.tag, result.list);
+            }
+
+            /* Tags with other representations only have their list at hand when it isn't compressed */
+            if (const auto* ids = std::get_if<std::span<const uint32_t>>(&result.value)) {
+                result.ids = *ids;
+            } else if (result.estimate > 0 && !index.file.is_compressed()) {
+                result.ids = index.file[node.tag];
+            }
+
+            if (explain) {
+                result.plan = std::to_string(node.tag);
+            }
+
+            return result;
+        }
+
+        case query_node::node_type::any:
+            return evaluate_any(index, node, strat, out, explain);
+
+        case query_node::node_type::all:
+            return evaluate_all(index, node, strat, out, explain);
+    }
+
+    return make_operand(id_list {});
+}
+
+/* Run a query and return the matching posts in ascending order. The list is borrowed from the calling
+ * thread's scratch arena, and has to be dropped on that thread too.
+ */
+[[nodiscard]] static id_list execute(const index_t& index, const query_node& node, strategy strat = strategy::planned) {
+    operand result = evaluate(index, node, strat, output::ids, false);
+
+    if (!result.list.empty()) {
+        return std::move(result.list);
+    }
+
+    id_list ids;
+    if (result.ids) {
+        ids.assign(*result.ids);
+        return ids;
+    }
+
+    std::visit(overloaded {
+        [](std::monostate) { },
+        [&ids](std::span<const uint32_t> list) { ids.assign(list); },
+        [&ids](const mask_desc& mask) { ids = to_list(mask.mask); },
+        [&ids](const container_desc& containers) {
+            ids = take_list(containers->cardinality());
+            ids.clear();
+            containers->for_each([&ids](uint32_t id) { ids.push_back(id); });
+        },
+    }, result.value);
+
+    return ids;
+}
+
+/* Number of posts matching a query, like execute().size() without collecting them. The last step of a
+ * conjunction is fused with counting its result, a single tag is counted by the index alone.
+ */
+[[nodiscard]] static size_t execute_count(const index_t& index, const query_node& node, strategy strat = strategy::planned) {
+    operand result = evaluate(index, node, strat, output::count, false);
+
+    if (result.count) {
+        return *result.count;
+    }
+
+    if (result.ids) {
+        return result.ids->size();
+    }
+
+    return std::visit(overloaded {
+        [](std::monostate) { return size_t { 0 }; },
+        [](std::span<const uint32_t> ids) { return ids.size(); },
+        [](const mask_desc& mask) { return bitmap_ops::count(mask.words()); },
+        [](const container_desc& containers) { return static_cast<size_t>(containers->cardinality()); },
+    }, result.value);
+}
+
+/* Posts matching a node within blocks of `block_words` words starting at the words `firsts`, packed one
+ * after another into `out`. Everything is evaluated as bitmasks over the blocks alone, so the work only
+ * depends on the size of the blocks, not on the size of the index.
+ */
+static void evaluate_blocks(const index_t& index, const query_node& node, std::span<const size_t> firsts, size_t block_words, std::span<mask_val_t> out) {
+    std::ranges::fill(out, 0);
+
+    switch (node.type) {
+        case query_node::node_type::tag: {
+            const index_value_t value = index.at(node.tag, nullptr);
+            if (const auto* mask = std::get_if<mask_desc>(&value)) {
+                for (size_t b = 0; b < firsts.size(); ++b) {
+                    const size_t words = std::min(block_words, mask->mask.size() - firsts[b]);
+                    std::copy_n(mask->mask.begin() + firsts[b], words, out.begin() + (b * block_words));
+                }
+            } else if (const auto* containers = std::get_if<container_desc>(&value)) {
+                const size_t words_per_block = block_words * (sizeof(mask_val_t) / sizeof(uint64_t));
+
+                for (size_t b = 0; b < firsts.size(); ++b) {
+                    (*containers)->or_range_into(firsts[b] * (sizeof(mask_val_t) / sizeof(uint64_t)), as_words(out).subspan(b * words_per_block, words_per_block));
+                }
+            } else if (!std::holds_alternative<std::monostate>(value) && index.file.is_compressed()) {
+                /* Only the blocks of the list that overlap the sample are decoded */
+                const std::span<uint64_t> words = as_words(out);
+                compressed_cursor cursor { index.file.compressed(node.tag) };
+
+                for (size_t b = 0; b < firsts.size(); ++b) {
+                    const uint32_t begin = static_cast<uint32_t>(firsts[b] * MASK_SIZE);
+                    const uint32_t end = static_cast<uint32_t>((firsts[b] + block_words) * MASK_SIZE);
+                    const uint32_t base = static_cast<uint32_t>(b * block_words * MASK_SIZE);
+
+                    if (!cursor.seek(begin)) {
+                        break;
+                    }
+
+                    for (; !cursor.done() && cursor.value() < end; cursor.next()) {
+                        const uint32_t bit = base + (cursor.value() - begin);
+                        words[bit / 64] |= uint64_t { 1 } << (bit % 64);
+                    }
+                }
+            } else if (!std::holds_alternative<std::monostate>(value)) {
+                const std::span<const uint32_t> ids = std::get<std::span<const uint32_t>>(value);
+                const std::span<uint64_t> words = as_words(out);
+
+                size_t pos = 0;
+                for (size_t b = 0; b < firsts.size(); ++b) {
+                    const uint32_t begin = static_cast<uint32_t>(firsts[b] * MASK_SIZE);
+                    const uint32_t end = static_cast<uint32_t>((firsts[b] + block_words) * MASK_SIZE);
+                    const uint32_t base = static_cast<uint32_t>(b * block_words * MASK_SIZE);
+
+                    for (pos = set_ops::gallop_to(ids, pos, begin); pos < ids.size() && ids[pos] < end; ++pos) {
+                        const uint32_t bit = base + (ids[pos] - begin);
+                        words[bit / 64] |= uint64_t { 1 } << (bit % 64);
+                    }
+                }
+            }
+
+            return;
+        }
+
+        case query_node::node_type::any: {
+            bitmask_t child = take_mask(out.size());
+            for (const query_node& next : node.children) {
+                evaluate_blocks(index, next, firsts, block_words, child);
+                bitmap_ops::or_into(as_words(out), as_words(child));
+            }
+
+            return;
+        }
+
+        case query_node::node_type::all: {
+            /* Included children first, so the excluded ones have something to clear */
+            bool started = false;
+            bitmask_t child = take_mask(out.size());
+
+            for (bool negated : { false, true }) {
+                for (const query_node& next : node.children) {
+                    if (next.negated != negated) {
+                        continue;
+                    }
+
+                    if (!started) {
+                        evaluate_blocks(index, next, firsts, block_words, out);
+                        started = true;
+                        continue;
+                    }
+
+                    evaluate_blocks(index, next, firsts, block_words, child);
+                    if (negated) {
+                        bitmap_ops::andnot_into(as_words(out), as_words(child));
+                    } else {
+                        bitmap_ops::and_into(as_words(out), as_words(child));
+                    }
+                }
+            }
+
+            return;
+        }
+    }
+}
+
+/* Approximate counts.
+ *
+ * The post ID range is cut into blocks of `block_words` words and split into `blocks` strata of
+ * consecutive blocks. One block is drawn from every stratum and the query is evaluated exactly on the
+ * drawn blocks alone, packed one after another into a small bitmask, and their total scaled up to the
+ * whole range. The spread of the per-block counts gives a confidence interval, which is conservative
+ * since stratifying only reduces the variance.
+ *
+ * The work is fixed by the sample, so the larger the index, the more is saved against an exact count.
+ */
+namespace sampling {
+    /* Words per block, 2048 posts */
+    static constexpr size_t block_words = 16;
+
+    /* Blocks drawn, indexes with no more blocks than this are counted exactly */
+    static constexpr size_t blocks = 64;
+
+    /* Normal quantile of the 95% confidence interval */
+    static constexpr double z = 1.96;
+
+    /* Fixed, so a query always gets the same estimate */
+    static constexpr uint32_t seed = 1;
+}
+
+struct count_estimate {
+    size_t count;
+
+    /* Confidence interval, equal to count when it's exact */
+    size_t low;
+    size_t high;
+
+    bool exact;
+};
+
+/* Expected share of posts matching a node, assuming tags are independent like the planner does */
+[[nodiscard]] static double match_ratio(const index_t& index, const query_node& node) {
+    switch (node.type) {
+        case query_node::node_type::tag:
+            return static_cast<double>(index.file.post_count(node.tag)) / static_cast<double>(index.mask_size() * MASK_SIZE);
+
+        case query_node::node_type::any: {
+            double none = 1;
+            for (const query_node& child : node.children) {
+                none *= 1 - match_ratio(index, child);
+            }
+
+            return 1 - none;
+        }
+
+        case query_node::node_type::all: {
+            double result = 1;
+            for (const query_node& child : node.children) {
+                const double ratio = match_ratio(index, child);
+                result *= child.negated ? 1 - ratio : ratio;
+            }
+
+            return result;
+        }
+    }
+
+    return 0;
+}
+
+/* Count the posts matching a query, estimating the count from a sample if more than `threshold` posts are expected to match */
+[[nodiscard]] static count_estimate estimate_count(const index_t& index, const query_node& node, size_t threshold) {
+    const size_t total_blocks = (index.mask_size() + sampling::block_words - 1) / sampling::block_words;
+    const double expected = match_ratio(index, node) * static_cast<double>(index.mask_size() * MASK_SIZE);
+
+    /* A single tag is counted by the index for free */
+    if (node.type == query_node::node_type::tag || expected <= static_cast<double>(threshold) || total_blocks <= sampling::blocks) {
+        const size_t count = execute_count(index, node);
+        return { .count = count, .low = count, .high = count, .exact = true };
+    }
+
+    /* The last block may be partial, draw full ones only */
+    const size_t full_blocks = index.mask_size() / sampling::block_words;
+
+    std::minstd_rand rng { sampling::seed };
+    std::array<size_t, sampling::blocks> firsts;
+    for (size_t i = 0; i < sampling::blocks; ++i) {
+        std::uniform_int_distribution<size_t> stratum { (i * full_blocks) / sampling::blocks, (((i + 1) * full_blocks) / sampling::blocks) - 1 };
+        firsts[i] = stratum(rng) * sampling::block_words;
+    }
+
+    bitmask_t sample = take_mask(sampling::blocks * sampling::block_words);
+    evaluate_blocks(index, node, firsts, sampling::block_words, sample);
+
+    const std::span<uint64_t> words = as_words(sample);
+    const size_t words_per_block = words.size() / sampling::blocks;
+
+    double sum = 0;
+    double sum_squares = 0;
+    for (size_t b = 0; b < sampling::blocks; ++b) {
+        const double count = static_cast<double>(bitmap_ops::count(words.subspan(b * words_per_block, words_per_block)));
+        sum += count;
+        sum_squares += count * count;
+    }
+
+    const double n = static_cast<double>(sampling::blocks);
+    const double population = static_cast<double>(index.mask_size()) / static_cast<double>(sampling::block_words);
+
+    const double mean = sum / n;
+    const double variance = std::max(0.0, (sum_squares - (n * mean * mean)) / (n - 1));
+
+    /* Standard error of the total, with the finite population correction */
+    const double error = population * std::sqrt((variance / n) * std::max(0.0, 1 - (n / population)));
+    const double estimate = mean * population;
+
+    /* The sampled posts match for sure, and the other blocks can't hold more than they have room for */
+    const double max_count = sum + ((population - n) * static_cast<double>(sampling::block_words * MASK_SIZE));
+
+    return {
+        .count = static_cast<size_t>(std::llround(estimate)),
+        .low = static_cast<size_t>(std::llround(std::max(sum, estimate - (sampling::z * error)))),
+        .high = static_cast<size_t>(std::llround(std::min(max_count, estimate + (sampling::z * error)))),
+        .exact = false,
+    };
+}
+
+/* Intra-query parallelism.
+ *
+ * The post ID range is cut into stripes of `stripe_words` words, small enough that a stripe of every
+ * operand stays in the L2 cache. Every stripe evaluates the whole query through evaluate_blocks() and
+ * counts its matches, and once all are counted, extracts its IDs straight into their place in the result.
+ */
+static constexpr size_t stripe_words = 512;
+
+/* Posts per word a query must be able to match to be striped */
+static constexpr size_t stripe_min_density = 4;
+
+/* Persistent workers, so a query doesn't pay for starting threads. Tasks are claimed from a shared
+ * counter like parse's parallel_for(), the calling thread included, so whoever finishes early takes
+ * over the remaining stripes.
+ */
+class stripe_pool {
+    std::vector<std::jthread> _workers;
+
+    std::mutex _mutex;
+    std::condition_variable _start;
+    std::condition_variable _done;
+
+    /* Current job, a type-erased func(task) */
+    const void* _func = nullptr;
+    void (*_call)(const void*, size_t) = nullptr;
+    size_t _tasks = 0;
+    std::atomic<size_t> _next = 0;
+
+    /* Bumped for every job, workers run each generation once */
+    size_t _generation = 0;
+    size_t _busy = 0;
+    bool _stop = false;
+
+    void _claim() {
+        for (size_t task; (task = _next.fetch_add(1)) < _tasks;) {
+            _call(_func, task);
+        }
+    }
+
+    void _work() {
+        for (size_t seen = 0;;) {
+            {
+                std::unique_lock lock { _mutex };
+                _start.wait(lock, [&] { return _stop || _generation != seen; });
+                if (_stop) {
+                    return;
+                }
+
+                seen = _generation;
+            }
+
+            _claim();
+
+            std::lock_guard lock { _mutex };
+            if (--_busy == 0) {
+                _done.notify_one();
+            }
+        }
+    }
+
+    public:
+    /* Runs on `threads` threads, the calling one included */
+    explicit stripe_pool(size_t threads) {
+        for (size_t i = 1; i < threads; ++i) {
+            _workers.emplace_back([this] { _work(); });
+        }
+    }
+
+    ~stripe_pool() {
+        {
+            std::lock_guard lock { _mutex };
+            _stop = true;
+        }
+
+        _start.notify_all();
+
+        /* Joined here, the workers still need the mutex and condition variables to wake up */
+        _workers.clear();
+    }
+
+    stripe_pool(const stripe_pool&) = delete;
+    stripe_pool& operator=(const stripe_pool&) = delete;
+
+    [[nodiscard]] size_t size() const { return _workers.size() + 1; }
+
+    /* Call func(task) for every task in [0, tasks) and wait for all of them */
+    template <typename Func>
+    void run(size_t tasks, Func&& func) {
+        {
+            std::lock_guard lock { _mutex };
+            _func = &func;
+            _call = [](const void* f, size_t task) { (*static_cast<const std::remove_reference_t<Func>*>(f))(task); };
+            _tasks = tasks;
+            _next = 0;
+            _busy = _workers.size();
+            ++_generation;
+        }
+
+        _start.notify_all();
+        _claim();
+
+        std::unique_lock lock { _mutex };
+        _done.wait(lock, [&] { return _busy == 0; });
+    }
+};
+
+/* Most posts a node can match, from the tag sizes alone */
+[[nodiscard]] static size_t max_matches(const index_t& index, const query_node& node) {
+    switch (node.type) {
+        case query_node::node_type::tag:
+            return index.file.post_count(node.tag);
+
+        case query_node::node_type::any: {
+            size_t result = 0;
+            for (const query_node& child : node.children) {
+                result += max_matches(index, child);
+            }
+
+            return std::min(result, index.mask_size() * MASK_SIZE);
+        }
+
+        case query_node::node_type::all: {
+            size_t result = std::numeric_limits<size_t>::max();
+            for (const query_node& child : node.children) {
+                if (!child.negated) {
+                    result = std::min(result, max_matches(index, child));
+                }
+            }
+
+            return result;
+        }
+    }
+
+    return 0;
+}
+
+/* Like bitmap_ops::extract(), but without writing past the IDs, so neighbouring parts of a list can be
+ * extracted concurrently. The last words, enough of them to hold `slack` IDs, go through a small buffer.
+ */
+static size_t extract_exact(std::span<const uint64_t> words, uint32_t base, uint32_t* out) {
+    size_t split = words.size();
+    size_t tail_ids = 0;
+    while (split > 0 && tail_ids < bitmap_ops::slack) {
+        tail_ids += std::popcount(words[--split]);
+    }
+
+    /* Whatever the head writes past its IDs lands where the tail's go */
+    const size_t head = bitmap_ops::extract(words.first(split), base, out);
+
+    std::array<uint32_t, (2 * bitmap_ops::slack) + 64> tail;
+    const size_t count = bitmap_ops::extract(words.subspan(split), base + static_cast<uint32_t>(split * 64), tail.data());
+    std::copy_n(tail.data(), count, out + head);
+
+    return head + count;
+}
+
+/* Run a query on the threads of a pool and return the matching posts in ascending order.
+ * Stripes evaluate everything as bitmasks, so sparse queries are left to the planner, which would use
+ * lists for them.
+ */
+[[nodiscard]] static id_list execute_parallel(const index_t& index, const query_node& node, stripe_pool& pool) {
+    if (node.type == query_node::node_type::tag || max_matches(index, node) < stripe_min_density * index.mask_size()) {
+        return execute(index, node);
+    }
+
+    const size_t stripes = (index.mask_size() + stripe_words - 1) / stripe_words;
+
+    /* Every stripe's mask is kept until all of them are counted, then the stripes extract their IDs straight
+     * into place. The buffers are the calling thread's, the workers only write into their own parts of them.
+     */
+    bitmask_t masks = take_mask(stripes * stripe_words);
+    id_list offsets = take_list(stripes + 1);
+    offsets[0] = 0;
+
+    auto stripe_mask = [&masks](size_t stripe) {
+        return std::span<mask_val_t> { masks }.subspan(stripe * stripe_words, stripe_words);
+    };
+
+    pool.run(stripes, [&](size_t stripe) {
+        const std::array<size_t, 1> first { stripe * stripe_words };
+
+        evaluate_blocks(index, node, first, stripe_words, stripe_mask(stripe));
+        offsets[stripe + 1] = static_cast<uint32_t>(bitmap_ops::count(as_words(stripe_mask(stripe))));
+    });
+
+    for (size_t i = 0; i < stripes; ++i) {
+        offsets[i + 1] += offsets[i];
+    }
+
+    id_list result = take_list(offsets[stripes]);
+    pool.run(stripes, [&](size_t stripe) {
+        extract_exact(as_words(stripe_mask(stripe)), static_cast<uint32_t>(stripe * stripe_words * MASK_SIZE), result.data() + offsets[stripe]);
+    });
+
+    return result;
+}
+
+/* Newest-first pages.
+ *
+ * Instead of materialising every result, the query is walked from the highest post ID down, one match
+ * at a time, until the page is full. Every node finds the largest match below a bound:
+ *   - ID lists through a cursor that starts with a seek through the list's skip entries, and then
+ *     gallops backwards from where the previous bound left it
+ *   - bitmasks by scanning their words in reverse, all masks of a conjunction fused into one scan
+ *   - conjunctions by leapfrogging between their children, starting from the smallest
+ *   - unions by taking the largest match of any child
+ *
+ * The bounds passed to a node must never increase, which the cursors rely on.
+ */
+static constexpr uint32_t no_post = std::numeric_limits<uint32_t>::max();
+
+struct page_cursor {
+    enum class kind { list, masks, all, any };
+
+    kind type = kind::list;
+    bool negated = false;
+    size_t estimate = 0;
+
+    /* list: the IDs, their skip entries, and how many of them are below the last bound */
+    std::span<const uint32_t> ids;
+    std::span<const uint32_t> skips;
+    size_t pos = 0;
+    bool started = false;
+
+    /* list of a compressed index: walked block by block instead */
+    std::optional<compressed_reverse_cursor> compressed;
+
+    /* masks: posts in all of `masks` and none of `excluded` */
+    std::vector<std::span<const uint64_t>> masks;
+    std::vector<std::span<const uint64_t>> excluded;
+
+    /* all, any: positive children first, the smallest first */
+    std::vector<page_cursor> children;
+};
+
+[[nodiscard]] static page_cursor make_page_cursor(const index_t& index, const query_node& node) {
+    page_cursor result;
+
+    if (node.type == query_node::node_type::tag) {
+        index_value_t value = index.at(node.tag, nullptr);
+        result.estimate = index.file.post_count(node.tag);
+
+        if (auto mask = std::get_if<mask_desc>(&value)) {
+            result.type = page_cursor::kind::masks;
+            result.masks.push_back(mask->words());
+        } else if (index.file.is_compressed()) {
+            result.type = page_cursor::kind::list;
+            result.compressed.emplace(index.file.compressed(node.tag));
+        } else {
+            result.type = page_cursor::kind::list;
+            result.ids = (result.estimate > 0) ? index.file[node.tag] : std::span<const uint32_t> {};
+            result.skips = index.file.skips(node.tag);
+            result.pos = result.ids.size();
+        }
+
+        return result;
+    }
+
+    if (node.type == query_node::node_type::any) {
+        result.type = page_cursor::kind::any;
+        for (const query_node& child : node.children) {
+            result.children.push_back(make_page_cursor(index, child));
+            result.estimate += result.children.back().estimate;
+        }
+
+        return result;
+    }
+
+    result.type = page_cursor::kind::all;
+
+    /* Tags stored as bitmasks are scanned together */
+    page_cursor masks;
+    masks.type = page_cursor::kind::masks;
+    masks.estimate = no_post;
+
+    for (const query_node& child : node.children) {
+        page_cursor cursor = make_page_cursor(index, child);
+        cursor.negated = child.negated;
+
+        if (child.type == query_node::node_type::tag && cursor.type == page_cursor::kind::masks) {
+            if (child.negated) {
+                masks.excluded.push_back(cursor.masks.front());
+            } else {
+                masks.masks.push_back(cursor.masks.front());
+                masks.estimate = std::min(masks.estimate, cursor.estimate);
+            }
+
+            continue;
+        }
+
+        result.children.push_back(std::move(cursor));
+    }
+
+    /* Excluded masks alone can't produce candidates, they're tested one by one instead */
+    if (masks.masks.empty()) {
+        for (std::span<const uint64_t> words : masks.excluded) {
+            page_cursor& excluded = result.children.emplace_back();
+            excluded.type = page_cursor::kind::masks;
+            excluded.negated = true;
+            excluded.masks.push_back(words);
+        }
+    } else {
+        result.children.push_back(std::move(masks));
+    }
+
+    std::ranges::sort(result.children, [](const page_cursor& lhs, const page_cursor& rhs) {
+        return std::pair { lhs.negated, lhs.estimate } < std::pair { rhs.negated, rhs.estimate };
+    });
+
+    result.estimate = result.children.front().estimate;
+
+    return result;
+}
+
+/* Largest post below `bound` that matches, or no_post */
+[[nodiscard]] static uint32_t previous_match(page_cursor& cursor, uint32_t bound) {
+    switch (cursor.type) {
+        case page_cursor::kind::list:
+            if (cursor.compressed) {
+                return cursor.compressed->seek_below(bound) ? cursor.compressed->value() : no_post;
+            }
+
+            cursor.pos = cursor.started
+                ? set_ops::gallop_back(cursor.ids, cursor.pos, bound)
+                : set_ops::seek_skips(cursor.ids, cursor.skips, index_format::skip_posts, bound);
+
+            cursor.started = true;
+            return (cursor.pos > 0) ? cursor.ids[cursor.pos - 1] : no_post;
+
+        case page_cursor::kind::masks: {
+            const size_t words = cursor.masks.front().size();
+            if (bound == 0 || words == 0) {
+                return no_post;
+            }
+
+            /* Only the bits below the bound in the first word */
+            size_t word = (bound - 1) / 64;
+            uint64_t below = ~uint64_t { 0 } >> (63 - ((bound - 1) % 64));
+            if (word >= words) {
+                word = words - 1;
+                below = ~uint64_t { 0 };
+            }
+
+            for (;; --word) {
+                uint64_t bits = below;
+                for (std::span<const uint64_t> mask : cursor.masks) {
+                    bits &= mask[word];
+                }
+
+                for (std::span<const uint64_t> mask : cursor.excluded) {
+                    bits &= ~mask[word];
+                }
+
+                if (bits) {
+                    return static_cast<uint32_t>((word * 64) + 63 - std::countl_zero(bits));
+                }
+
+                if (word == 0) {
+                    return no_post;
+                }
+
+                below = ~uint64_t { 0 };
+            }
+        }
+
+        case page_cursor::kind::any: {
+            uint32_t result = no_post;
+            for (page_cursor& child : cursor.children) {
+                const uint32_t id = previous_match(child, bound);
+                if (id != no_post && (result == no_post || id > result)) {
+                    result = id;
+                }
+            }
+
+            return result;
+        }
+
+        case page_cursor::kind::all: {
+            std::span<page_cursor> children = cursor.children;
+            const size_t positive = std::ranges::count(children, false, &page_cursor::negated);
+
+            uint32_t candidate = previous_match(children.front(), bound);
+            size_t agreed = 1;
+            size_t next = 1 % positive;
+
+            while (candidate != no_post) {
+                if (agreed < positive) {
+                    const uint32_t id = previous_match(children[next], candidate + 1);
+                    if (id == candidate) {
+                        ++agreed;
+                    } else {
+                        candidate = id;
+                        agreed = 1;
+                    }
+
+                    next = (next + 1) % positive;
+                    continue;
+                }
+
+                const bool excluded = std::ranges::any_of(children.subspan(positive), [candidate](page_cursor& child) {
+                    return previous_match(child, candidate + 1) == candidate;
+                });
+
+                if (!excluded) {
+                    return candidate;
+                }
+
+                candidate = previous_match(children.front(), candidate);
+                agreed = 1;
+                next = 1 % positive;
+            }
+
+            return no_post;
+        }
+    }
+
+    return no_post;
+}
+
+/* Up to `limit` matching posts below `before`, newest first */
+[[nodiscard]] static std::vector<uint32_t> execute_page(const index_t& index, const query_node& node, size_t limit, uint32_t before = no_post) {
+    page_cursor cursor = make_page_cursor(index, node);
+
+    std::vector<uint32_t> result;
+
+    for (uint32_t bound = before; result.size() < limit;) {
+        bound = previous_match(cursor, bound);
+        if (bound == no_post) {
+            break;
+        }
+
+        result.push_back(bound);
+    }
+
+    return result;
+}
+
+using strategy_times = std::array<std::chrono::steady_clock::duration, strategy_names.size()>;
+
+/* Run a query with every strategy, checking that they agree, and return their average times */
+static strategy_times query_helper(const index_t& index, const query_node& query) {
+    std::cerr << "Plan: " << describe(evaluate(index, query, strategy::planned, output::ids, true)) << '\n';
+
+    strategy_times times {};
+    id_list planned;
+
+    for (size_t s = 0; s < strategy_names.size(); ++s) {
+        /* Untimed first run, so the first strategy doesn't pay for faulting in the index */
+        id_list results = execute(index, query, static_cast<strategy>(s));
+
+        auto start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < repeats; ++i) {
+            results = execute(index, query, static_cast<strategy>(s));
+        }
+
+        auto elapsed = std::chrono::steady_clock::now() - start;
+        times[s] = elapsed / repeats;
+
+        if (s == 0) {
+            std::cerr << "Found " << results.size() << " results in "
+                      << get_time(elapsed / repeats) << " average ("
+                      << get_time(elapsed) << " total for " << repeats << " iterations)\n";
+
+            planned = std::move(results);
+        } else if (!std::ranges::equal(results, planned)) {
+            std::cerr << "  " << strategy_names[s] << " strategy found " << results.size() << " results instead\n";
+        }
+    }
+
+    for (size_t s = 0; s < strategy_names.size(); ++s) {
+        std::cerr << "  " << std::left << std::setw(9) << (std::string { strategy_names[s] } + ':') << std::right
+                  << get_time(times[s]);
+
+        if (s > 0) {
+            std::cerr << " (" << std::fixed << std::setprecision(2)
+                      << (std::chrono::duration<double>(times[s]) / std::chrono::duration<double>(times[0])) << "x planned)";
+            std::cerr.unsetf(std::ios::floatfield);
+        }
+
+        std::cerr << '\n';
+    }
+
+    std::cerr << '\n';
+
+    return times;
+}
+
+/* Find a newest-first page of a query, checking it against the full results, and return its average time */
+static std::chrono::steady_clock::duration page_helper(const index_t& index, const query_node& query, size_t limit, uint32_t before) {
+    std::vector<uint32_t> results = execute_page(index, query, limit, before);
+
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < repeats; ++i) {
+        results = execute_page(index, query, limit, before);
+    }
+
+    const auto page_time = (std::chrono::steady_clock::now() - start) / repeats;
+
+    id_list full = execute(index, query);
+
+    start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < repeats; ++i) {
+        full = execute(index, query);
+    }
+
+    const auto full_time = (std::chrono::steady_clock::now() - start) / repeats;
+
+    std::cerr << "Found " << results.size() << " newest of " << full.size() << " results in " << get_time(page_time) << " average";
+    if (!results.empty()) {
+        std::cerr << " (" << results.front() << " to " << results.back() << ')';
+    }
+
+    std::cerr << "\n  Full query: " << get_time(full_time) << " (" << std::fixed << std::setprecision(2)
+              << (std::chrono::duration<double>(full_time) / std::chrono::duration<double>(page_time)) << "x page)\n";
+    std::cerr.unsetf(std::ios::floatfield);
+
+    std::vector<uint32_t> expected;
+    for (uint32_t id : full | std::views::reverse) {
+        if (expected.size() == limit) {
+            break;
+        }
+
+        if (id < before) {
+            expected.push_back(id);
+        }
+    }
+
+    if (results != expected) {
+        std::cerr << "  Page does not match the full results\n";
+    }
+
+    std::cerr << '\n';
+
+    return page_time;
+}
+
+/* Count the results of a query, checking the count against the full results, and return its average time */
+static std::chrono::steady_clock::duration count_helper(const index_t& index, const query_node& query) {
+    size_t count = execute_count(index, query);
+
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < repeats; ++i) {
+        count = execute_count(index, query);
+    }
+
+    const auto count_time = (std::chrono::steady_clock::now() - start) / repeats;
+
+    id_list full = execute(index, query);
+
+    start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < repeats; ++i) {
+        full = execute(index, query);
+    }
+
+    const auto full_time = (std::chrono::steady_clock::now() - start) / repeats;
+
+    std::cerr << "Counted " << count << " results in " << get_time(count_time) << " average\n"
+              << "  Full query: " << get_time(full_time) << " (" << std::fixed << std::setprecision(2)
+              << (std::chrono::duration<double>(full_time) / std::chrono::duration<double>(count_time)) << "x count)\n";
+    std::cerr.unsetf(std::ios::floatfield);
+
+    if (count != full.size()) {
+        std::cerr << "  Count does not match the full results (" << full.size() << ")\n";
+    }
+
+    std::cerr << '\n';
+
+    return count_time;
+}
+
+/* Estimate the count of a query, checking it against the exact count, and return its average time */
+static std::chrono::steady_clock::duration estimate_helper(const index_t& index, const query_node& query, size_t threshold) {
+    count_estimate estimate = estimate_count(index, query, threshold);
+
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < repeats; ++i) {
+        estimate = estimate_count(index, query, threshold);
+    }
+
+    const auto estimate_time = (std::chrono::steady_clock::now() - start) / repeats;
+
+    size_t count = execute_count(index, query);
+
+    start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < repeats; ++i) {
+        count = execute_count(index, query);
+    }
+
+    const auto count_time = (std::chrono::steady_clock::now() - start) / repeats;
+
+    if (estimate.exact) {
+        std::cerr << "Counted " << estimate.count << " results exactly in " << get_time(estimate_time) << " average\n";
+    } else {
+        std::cerr << "Estimated " << estimate.count << " results (" << estimate.low << " to " << estimate.high << ") in "
+                  << get_time(estimate_time) << " average\n";
+    }
+
+    std::cerr << "  Exact count: " << count << " in " << get_time(count_time) << " (" << std::fixed << std::setprecision(2)
+              << (std::chrono::duration<double>(count_time) / std::chrono::duration<double>(estimate_time)) << "x estimate)\n";
+    std::cerr.unsetf(std::ios::floatfield);
+
+    if (count < estimate.low || count > estimate.high) {
+        std::cerr << "  Exact count is outside the confidence interval\n";
+    }
+
+    std::cerr << '\n';
+
+    return estimate_time;
+}
+
+/* Run a query on the threads of a pool, checking the results against execute(), and return its average time */
+static std::chrono::steady_clock::duration parallel_helper(const index_t& index, const query_node& query, stripe_pool& pool) {
+    id_list results = execute_parallel(index, query, pool);
+
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < repeats; ++i) {
+        results = execute_parallel(index, query, pool);
+    }
+
+    const auto parallel_time = (std::chrono::steady_clock::now() - start) / repeats;
+
+    id_list expected = execute(index, query);
+
+    start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < repeats; ++i) {
+        expected = execute(index, query);
+    }
+
+    const auto single_time = (std::chrono::steady_clock::now() - start) / repeats;
+
+    std::cerr << "Found " << results.size() << " results on " << pool.size() << " threads in " << get_time(parallel_time) << " average\n"
+              << "  One thread: " << get_time(single_time) << " (" << std::fixed << std::setprecision(2)
+              << (std::chrono::duration<double>(single_time) / std::chrono::duration<double>(parallel_time)) << "x parallel)\n";
+    std::cerr.unsetf(std::ios::floatfield);
+
+    if (!std::ranges::equal(results, expected)) {
+        std::cerr << "  Parallel results do not match\n";
+    }
+
+    std::cerr << '\n';
+
+    return parallel_time;
+}
+
+/* Posts per page in the query mix */
+static constexpr size_t page_size = 20;
+
+/* Expected matches from which the query mix estimates counts */
+static constexpr size_t estimate_threshold = 10'000;
+
+/* Mix of query shapes from our traffic, for comparing the strategies */
+static constexpr std::array query_mix {
+    "1girl solo long_hair touhou fate/grand_order",
+    "t-doll_contract girls'_frontline",
+    "girls'_frontline 1girl",
+    "t-doll_contract 1girl solo",
+    "1girl solo -long_hair",
+    "1girl ~touhou ~fate/grand_order",
+    "girls'_frontline -1girl",
+    "solo ~t-doll_contract ~girls'_frontline",
+};
+
+static void query_mix_helper(const index_t& index) {
+    strategy_times totals {};
+    std::chrono::steady_clock::duration page_total {};
+    std::chrono::steady_clock::duration count_total {};
+    std::chrono::steady_clock::duration estimate_total {};
+    std::chrono::steady_clock::duration parallel_total {};
+
+    /* Only worth timing with more than one core */
+    std::optional<stripe_pool> pool;
+    if (std::thread::hardware_concurrency() > 1) {
+        pool.emplace(std::thread::hardware_concurrency());
+    }
+
+    for (std::string_view text : query_mix) {
+        std::cerr << "Query: " << text << '\n';
+
+        try {
+            query_node query = parse_query(text, [&index](std::string_view name) { return index.find_tag(name); });
+
+            strategy_times times = query_helper(index, query);
+            for (size_t s = 0; s < strategy_names.size(); ++s) {
+                totals[s] += times[s];
+            }
+
+            page_total += page_helper(index, query, page_size, no_post);
+            count_total += count_helper(index, query);
+            estimate_total += estimate_helper(index, query, estimate_threshold);
+
+            if (pool) {
+                parallel_total += parallel_helper(index, query, *pool);
+            }
+        } catch (const query_error& e) {
+            std::cerr << "  Skipped: " << e.what() << "\n\n";
+        }
+    }
+
+    std::cerr << "Query mix total:\n";
+    for (size_t s = 0; s < strategy_names.size(); ++s) {
+        std::cerr << "  " << std::left << std::setw(9) << (std::string { strategy_names[s] } + ':') << std::right
+                  << get_time(totals[s]) << '\n';
+    }
+
+    std::cerr << "  " << std::left << std::setw(9) << "Page:" << std::right << get_time(page_total) << " (newest " << page_size << ")\n";
+    std::cerr << "  " << std::left << std::setw(9) << "Count:" << std::right << get_time(count_total) << '\n';
+    std::cerr << "  " << std::left << std::setw(9) << "Estimate:" << std::right << get_time(estimate_total) << " (sampled above " << estimate_threshold << " expected)\n";
+
+    if (pool) {
+        std::cerr << "  " << std::left << std::setw(9) << "Parallel:" << std::right << get_time(parallel_total) << " (" << pool->size() << " threads)\n";
+    }
+
+    std::cerr << '\n';
+}
+
+template <std::integral T>
+static std::optional<T> parse_number(std::string_view str) {
+    T val {};
+    auto [ptr, ec] = std::from_chars(str.data(), str.data() + str.size(), val);
+    if (ec != std::errc {} || ptr != str.data() + str.size()) {
+        return std::nullopt;
+    }
+
+    return val;
+}
+
+/* Parse a query from the command line, resolving tag names through the index's dictionary */
+static std::optional<query_node> parse_arguments(const index_t& index, std::span<char*> args) {
+    auto begin = std::chrono::steady_clock::now();
+
+    std::string query;
+    for (std::string_view arg : args) {
+        query.append(arg).push_back(' ');
+    }
+
+    try {
+        query_node result = parse_query(query, [&index](std::string_view name) { return index.find_tag(name); });
+
+        auto elapsed = std::chrono::steady_clock::now() - begin;
+        std::cerr << "Parsed query in " << get_time(elapsed) << '\n';
+
+        return result;
+    } catch (const query_error& e) {
+        std::cerr << "Invalid query: " << e.what() << '\n';
+        return std::nullopt;
+    }
+}
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        usage(*argv);
+        return EXIT_FAILURE;
+    }
+
+    fs::path index_path = argv[1];
+
+    if (!exists(index_path) || !is_regular_file(index_path)) {
+        std::cerr << "Index file does not exist or is not a file: " << index_path.string() << '\n';
+        usage(*argv);
+        return EXIT_FAILURE;
+    }
+
+    index_t index = load_index(index_path);
+
+    std::optional<size_t> limit;
+    uint32_t before = no_post;
+    bool count_only = false;
+    std::optional<size_t> estimate_threshold;
+    std::optional<size_t> threads;
+
+    int first_term = 2;
+    for (; first_term < argc; ++first_term) {
+        std::string_view arg = argv[first_term];
+
+        if (arg == "--limit" && (first_term + 1) < argc) {
+            limit = parse_number<size_t>(argv[++first_term]);
+            if (!limit) {
+                std::cerr << "Invalid limit: " << argv[first_term] << '\n';
+                return EXIT_FAILURE;
+            }
+        } else if (arg == "--before" && (first_term + 1) < argc) {
+            auto val = parse_number<uint32_t>(argv[++first_term]);
+            if (!val) {
+                std::cerr << "Invalid post ID: " << argv[first_term] << '\n';
+                return EXIT_FAILURE;
+            }
+
+            before = *val;
+        } else if (arg == "--count") {
+            count_only = true;
+        } else if (arg == "--threads" && (first_term + 1) < argc) {
+            auto val = parse_number<size_t>(argv[++first_term]);
+            if (!val || *val == 0) {
+                std::cerr << "Invalid thread count: " << argv[first_term] << '\n';
+                return EXIT_FAILURE;
+            }
+
+            threads = *val;
+        } else if (arg == "--estimate" && (first_term + 1) < argc) {
+            estimate_threshold = parse_number<size_t>(argv[++first_term]);
+            if (!estimate_threshold) {
+                std::cerr << "Invalid threshold: " << argv[first_term] << '\n';
+                return EXIT_FAILURE;
+            }
+        } else {
+            break;
+        }
+    }
+
+    if ((count_only || estimate_threshold) && (limit || before != no_post)) {
+        std::cerr << "--count and --estimate can't be combined with --limit or --before\n";
+        return EXIT_FAILURE;
+    }
+
+    if (first_term < argc) {
+        if (index.tag_names().empty()) {
+            std::cerr << "Index has no tag names, rebuild it to search by name\n";
+            return EXIT_FAILURE;
+        }
+
+        std::optional<query_node> query = parse_arguments(index, { argv + first_term, argv + argc });
+        if (!query) {
+            return EXIT_FAILURE;
+        }
+
+        if (estimate_threshold) {
+            (void) estimate_helper(index, *query, *estimate_threshold);
+        } else if (count_only) {
+            (void) count_helper(index, *query);
+        } else if (threads) {
+            stripe_pool pool { *threads };
+            (void) parallel_helper(index, *query, pool);
+        } else if (limit || before != no_post) {
+            (void) page_helper(index, *query, limit.value_or(std::numeric_limits<size_t>::max()), before);
+        } else {
+            (void) query_helper(index, *query);
+        }
+
+        return EXIT_SUCCESS;
+    } else if (first_term > 2) {
+        std::cerr << "Options need a query\n";
+        usage(*argv);
+        return EXIT_FAILURE;
+    }
+
+    {
+        std::array<uint32_t, 5> search_ids {
+            470575, 212816, 13197, 29, 1283444, // 1girl solo long_hair touhou fate/grand_order
+        };
+
+        std::array<uint32_t, 17> expected {
+            2380549, 2420287, 2423105, 2523394, 2646037,
+            2683860, 2705783, 2745868, 2746265, 2752461,
+            2905088, 2917346, 3114201, 4081318, 4718669,
+            5639802, 6055186
+        };
+
+        search_helper(index, search_ids, expected);
+    }
+
+    {
+        std::array<uint32_t, 2> search_ids {
+            1574450, 1665885, // t-doll_contract girls'_frontline
+        };
+
+        search_helper(index, search_ids);
+    }
+
+    if (!index.tag_names().empty()) {
+        query_mix_helper(index);
     }
 
     return EXIT_SUCCESS;
@@ -3,81 +3,221 @@
 #include <fstream>
 #include <string>
 #include <vector>
+#include <array>
 #include <chrono>
 #include <sstream>
 #include <iomanip>
 #include <set>
 #include <cmath>
 #include <functional>
-#include <unordered_map>
 #include <ranges>
+#include <algorithm>
+#include <optional>
+#include <charconv>
+#include <thread>
+#include <atomic>
+#include <exception>
 
 #include <simdjson.h>
 
 #include "helper.hpp"
+#include "index_format.hpp"
+#include "mapped_file.hpp"
+#include "index_writer.hpp"
+#include "tag_dictionary.hpp"
+#include "name_dictionary.hpp"
 
 namespace fs = std::filesystem;
 
 using namespace std::literals;
 
-struct tag_descriptor {
-    uint32_t id;
+/* Tag name -> tag ID */
+using tag_map_t = tag_dictionary;
+
+/* Posting lists in compressed sparse row form, the posts of tag t are
+ * posts[offsets[t], offsets[t] + counts[t]).
+ *
+ * Every row starts on an index_format alignment boundary with zeroed padding in
+ * between, so `posts` is the postings section of index.bin as-is.
+ */
+struct posting_arena {
+    std::vector<uint64_t> offsets;
+    std::vector<uint32_t> counts;
     std::vector<uint32_t> posts;
-};
 
-struct string_hash {
-    using hash_type = std::hash<std::string_view>;
-    using is_transparent = void;
+    [[nodiscard]] size_t tag_count() const { return counts.size(); }
+
+    [[nodiscard]] std::span<uint32_t> operator[](uint32_t tag) {
+        return std::span { posts }.subspan(offsets[tag], counts[tag]);
+    }
 
-    std::size_t operator()(std::string_view sv) const { return hash_type{}(sv); }
-    std::size_t operator()(const std::string& s) const { return hash_type{}(s); }
+    [[nodiscard]] std::span<const uint32_t> operator[](uint32_t tag) const {
+        return std::span { posts }.subspan(offsets[tag], counts[tag]);
+    }
 };
 
-using tag_map_t = std::unordered_map<std::string, tag_descriptor, string_hash, std::equal_to<>>;
+/* Default minimum number of posts for a tag to get a precomputed bitmap */
+static constexpr uint32_t DEFAULT_MASK_THRESHOLD = 50'000;
+
+struct options {
+    fs::path data_dir;
+    uint32_t mask_threshold = DEFAULT_MASK_THRESHOLD;
+    size_t threads = std::max(1u, std::thread::hardware_concurrency());
+
+    /* Store delta-encoded, bit-packed posting lists instead of raw post IDs */
+    bool compress = false;
 
-using tag_id_map_t = std::unordered_map<uint32_t, std::vector<uint32_t>>;
+    /* Build with bounded memory by spilling sorted runs to temp_dir */
+    std::optional<size_t> memory_budget;
+    fs::path temp_dir;
+};
 
 static void usage(const char* argv0) {
     std::cerr << "Usage:\n\n"
-              << argv0 << " <index_file> <tags_file>\n\n";
+              << argv0 << " [options] <data_dir>\n\n"
+              << "Options:\n"
+              << "  --mask-threshold <n>  Store a bitmap for every tag with at least n posts (default "
+              << DEFAULT_MASK_THRESHOLD << ", 0 disables bitmaps)\n"
+              << "  --threads <n>         Number of threads used to parse posts.json (default: all cores)\n"
+              << "  --compress            Store compressed posting lists\n"
+              << "  --memory-budget <n>   Build in at most n MiB of posting buffers, spilling sorted runs to disk\n"
+              << "  --temp-dir <dir>      Directory for spilled runs (default: data_dir)\n\n";
+}
+
+template <std::integral T>
+static std::optional<T> parse_number(std::string_view str) {
+    T val {};
+    auto [ptr, ec] = std::from_chars(str.data(), str.data() + str.size(), val);
+    if (ec != std::errc {} || ptr != str.data() + str.size()) {
+        return std::nullopt;
+    }
 
+    return val;
+}
+
+static std::optional<options> parse_options(int argc, char** argv) {
+    options opts;
+    std::optional<fs::path> data_dir;
+
+    for (int i = 1; i < argc; ++i) {
+        std::string_view arg = argv[i];
+
+        if (arg == "--mask-threshold" && (i + 1) < argc) {
+            auto val = parse_number<uint32_t>(argv[++i]);
+            if (!val) {
+                std::cerr << "Invalid mask threshold: " << argv[i] << '\n';
+                return std::nullopt;
+            }
+
+            opts.mask_threshold = *val;
+        } else if (arg == "--threads" && (i + 1) < argc) {
+            auto val = parse_number<size_t>(argv[++i]);
+            if (!val || *val == 0) {
+                std::cerr << "Invalid thread count: " << argv[i] << '\n';
+                return std::nullopt;
+            }
+
+            opts.threads = *val;
+        } else if (arg == "--compress") {
+            opts.compress = true;
+        } else if (arg == "--memory-budget" && (i + 1) < argc) {
+            auto val = parse_number<size_t>(argv[++i]);
+            if (!val || *val == 0) {
+                std::cerr << "Invalid memory budget: " << argv[i] << '\n';
+                return std::nullopt;
+            }
+
+            opts.memory_budget = *val * 1024 * 1024;
+        } else if (arg == "--temp-dir" && (i + 1) < argc) {
+            opts.temp_dir = argv[++i];
+        } else if (!arg.starts_with("-") && !data_dir) {
+            data_dir = arg;
+        } else {
+            std::cerr << "Unexpected argument: " << arg << '\n';
+            return std::nullopt;
+        }
+    }
+
+    if (!data_dir) {
+        return std::nullopt;
+    }
+
+    opts.data_dir = *data_dir;
+    return opts;
+}
+
+/* Map an NDJSON input file, it's only ever read front to back */
+static mapped_file map_input(const fs::path& path) {
+    mapped_file file { path };
+    file.advise(0, file.size(), MADV_SEQUENTIAL);
+
+    return file;
+}
+
+/* Call func for every document in a range of newline-delimited JSON, without copying it.
+ *
+ * simdjson may read up to SIMDJSON_PADDING bytes past the end of its input. Inside a mapping
+ * that's always allowed, except near the end of a file that (almost) fills its last page.
+ * If fewer than SIMDJSON_PADDING bytes are readable past `input`, the last few lines are
+ * parsed from a padded copy instead.
+ */
+template <typename Func>
+static void for_each_document(simdjson::ondemand::parser& parser, std::string_view input,
+                              size_t readable_padding, Func&& func) {
+    std::string_view tail;
+    if (readable_padding < simdjson::SIMDJSON_PADDING) {
+        size_t cut = (input.size() > simdjson::SIMDJSON_PADDING)
+            ? input.rfind('\n', input.size() - simdjson::SIMDJSON_PADDING - 1)
+            : std::string_view::npos;
+
+        cut = (cut == std::string_view::npos) ? 0 : (cut + 1);
+
+        tail = input.substr(cut);
+        input = input.substr(0, cut);
+    }
+
+    auto parse = [&](const char* data, size_t size) {
+        if (size == 0) {
+            return;
+        }
+
+        simdjson::ondemand::document_stream stream = parser.iterate_many(data, size, simdjson::ondemand::DEFAULT_BATCH_SIZE);
+        for (auto doc : stream) {
+            func(doc);
+        }
+    };
+
+    parse(input.data(), input.size());
+
+    if (!tail.empty()) {
+        simdjson::padded_string padded { tail };
+        parse(padded.data(), padded.size());
+    }
 }
 
 tag_map_t read_tags(simdjson::ondemand::parser& parser, const fs::path& tags_json) {
-    std::ifstream tags_file { tags_json };
-    if (!tags_file) {
-        std::cerr << "Failed opening tags.json\n";
+    mapped_file tags_file;
+    try {
+        tags_file = map_input(tags_json);
+    } catch (const std::runtime_error& e) {
+        std::cerr << "Failed opening tags.json: " << e.what() << '\n';
         std::exit(EXIT_FAILURE);
     }
 
     static constexpr size_t tag_count = 1138080;
     tag_map_t tags;
+    tags.reserve(tag_count);
 
     auto tag_start = std::chrono::steady_clock::now();
 
-    size_t tag_bytes_read = 0;
-
     progress_bar progress{ "Reading tags", tag_count };
-    for (std::string line; std::getline(tags_file, line);) {
-        tag_bytes_read += line.size();
-
-        simdjson::padded_string padded = line;
-        auto doc = parser.iterate(padded);
-
-        tag_descriptor desc {
-            .id = static_cast<uint32_t>(doc["id"].get_uint64()),
-            .posts = {}
-        };
+    for_each_document(parser, tags_file.chars(), tags_file.padding(), [&](auto& doc) {
+        uint32_t id = static_cast<uint32_t>(doc["id"].get_uint64());
 
-        desc.posts.reserve(doc["post_count"].get_uint64());
-
-        tags.insert({
-            std::string { doc["name"].get_string().value() },
-            std::move(desc)
-        });
+        tags.insert(doc["name"].get_string().value(), id);
 
         progress.advance();
-    }
+    });
 
     progress.finish();
 
@@ -85,90 +225,421 @@ tag_map_t read_tags(simdjson::ondemand::parser& parser, const fs::path& tags_jso
     auto tag_read_elapsed = tag_end - tag_start;
 
     std::cerr << "Read " << tags.size() << " tags in " << get_time(tag_read_elapsed) << " ("
-              << get_bytes(tag_bytes_read / (tag_read_elapsed.count() / 1e9)) << "/s)\n";
+              << get_bytes(tags_file.size() / (tag_read_elapsed.count() / 1e9)) << "/s)\n";
 
     return tags;
 }
 
-uint32_t read_posts(simdjson::ondemand::parser& parser, const fs::path& posts_json,
-                tag_map_t& tags) {
+/* Shared between the workers and the thread reporting progress */
+struct read_progress {
+    std::atomic<size_t> posts = 0;
+    std::atomic<size_t> workers_done = 0;
+};
 
-    std::ifstream posts_file { posts_json };
-    if (!posts_file) {
-        std::cerr << "Failed opening posts.json\n";
-        std::exit(EXIT_FAILURE);
+/* Run func(begin, end) on up to `thread_count` threads, for blocks of `grain` elements of [0, count) */
+template <typename Func>
+static void parallel_for(size_t count, size_t thread_count, size_t grain, Func&& func) {
+    std::atomic<size_t> next = 0;
+
+    auto worker = [&] {
+        for (size_t begin; (begin = next.fetch_add(grain)) < count;) {
+            func(begin, std::min(begin + grain, count));
+        }
+    };
+
+    std::vector<std::jthread> threads;
+    for (size_t i = 1; i < std::min(thread_count, (count + grain - 1) / grain); ++i) {
+        threads.emplace_back(worker);
     }
 
+    worker();
+}
+
+/* Split a buffer into up to `count` ranges that all start at the beginning of a line */
+static std::vector<std::string_view> split_lines(std::string_view input, size_t count) {
+    std::vector<std::string_view> ranges;
+
+    size_t begin = 0;
+    for (size_t i = 1; i <= count && begin < input.size(); ++i) {
+        size_t end = input.size();
+
+        if (i < count) {
+            /* Extend to the end of the line containing the target */
+            end = input.find('\n', std::max(begin, (input.size() * i) / count));
+            end = (end == std::string_view::npos) ? input.size() : (end + 1);
+        }
+
+        ranges.push_back(input.substr(begin, end - begin));
+        begin = end;
+    }
+
+    return ranges;
+}
+
+/* Parse posts.json on up to `thread_count` threads, each worker handling one newline-aligned
+ * part of the file. Calls on_posting(worker, tag, post) for every posting, in file order per worker,
+ * and on_done(worker) once a worker is finished. The split only depends on the file and
+ * `thread_count`, so repeated calls hand every worker the same part.
+ *
+ * Returns the highest post ID.
+ */
+template <typename PostingFunc, typename DoneFunc>
+static uint32_t read_posts(const mapped_file& posts_file, const tag_map_t& tags, size_t thread_count,
+                           std::string_view prompt, PostingFunc&& on_posting, DoneFunc&& on_done) {
     auto post_start = std::chrono::steady_clock::now();
 
     static constexpr size_t post_count = 6196347;
 
-    size_t post_bytes_read = 0;
-    size_t posts_read = 0;
-    uint32_t max_post = 0;
-    progress_bar progress("Reading posts", post_count);
-    for (std::string line; std::getline(posts_file, line);) {
-        post_bytes_read += line.size();
+    std::vector<std::string_view> ranges = split_lines(posts_file.chars(), thread_count);
+    std::vector<uint32_t> max_posts(ranges.size());
+    std::vector<std::exception_ptr> errors(ranges.size());
+
+    read_progress progress_state;
+
+    auto worker = [&](size_t worker, size_t readable_padding) {
+        try {
+            simdjson::ondemand::parser parser;
 
-        simdjson::padded_string padded = line;
-        auto doc = parser.iterate(padded);
+            for_each_document(parser, ranges[worker], readable_padding, [&](auto& doc) {
+                uint32_t id = doc["id"].get_uint64();
 
-        uint32_t id = doc["id"].get_uint64();
+                if (id > max_posts[worker]) {
+                    max_posts[worker] = id;
+                }
 
-        if (id > max_post) {
-            max_post = id;
+                std::string_view tag_string = doc["tag_string"].get_string();
+
+                for (const auto tag_subrange : std::views::split(tag_string, ' ')) {
+                    std::string_view tag { tag_subrange.begin(), tag_subrange.end() };
+
+                    if (std::optional<uint32_t> tag_id = tags.find(tag)) {
+                        on_posting(worker, *tag_id, id);
+                    } else {
+                        throw std::runtime_error("unknown tag: "s + std::string(tag.begin(), tag.end()));
+                    }
+                }
+
+                progress_state.posts.fetch_add(1, std::memory_order_relaxed);
+            });
+
+            on_done(worker);
+        } catch (...) {
+            errors[worker] = std::current_exception();
         }
 
-        std::string_view tag_string = doc["tag_string"].get_string();
+        progress_state.workers_done.fetch_add(1);
+    };
+
+    {
+        std::vector<std::jthread> workers;
+        workers.reserve(ranges.size());
 
-        for (const auto tag_subrange : std::views::split(tag_string, ' ')) {
-            std::string_view tag { tag_subrange.begin(), tag_subrange.end() };
+        for (size_t i = 0; i < ranges.size(); ++i) {
+            /* Everything after a range up to the end of the mapping can be read as padding */
+            const size_t readable_padding = (posts_file.chars().end() - ranges[i].end()) + posts_file.padding();
 
-            auto it = tags.find(tag);
-            if (it != tags.end()) {
-                it->second.posts.push_back(id);
-            } else {
-                throw std::runtime_error("unknown tag: "s + std::string(tag.begin(), tag.end()));
+            workers.emplace_back(worker, i, readable_padding);
+        }
+
+        progress_bar progress(prompt, post_count);
+
+        size_t reported = 0;
+        while (progress_state.workers_done.load() < workers.size()) {
+            std::this_thread::sleep_for(50ms);
+
+            size_t current = progress_state.posts.load(std::memory_order_relaxed);
+            progress.advance(current - reported);
+            reported = current;
+        }
+
+        progress.finish();
+    }
+
+    for (const std::exception_ptr& error : errors) {
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    }
+
+    auto post_read_elapsed = std::chrono::steady_clock::now() - post_start;
+
+    std::cerr << "Read " << progress_state.posts.load() << " posts using " << ranges.size() << " threads in " << get_time (post_read_elapsed) << " ("
+              << get_bytes(posts_file.size() / (post_read_elapsed.count() / 1e9)) << "/s)\n";
+
+    return std::ranges::max(max_posts);
+}
+
+/* Build all posting lists in memory.
+ *
+ * posts.json is parsed twice: the first pass only counts postings per tag and worker, which gives
+ * every row its exact size and every worker its position within each row. The second pass writes
+ * each posting straight to its place in the arena, so the postings are never buffered elsewhere.
+ */
+static uint32_t build_arena(const mapped_file& posts_file, const tag_map_t& tags, posting_arena& arena, size_t thread_count) {
+    const size_t tag_count = arena.tag_count();
+
+    /* Number of postings per tag, later the position of the worker's next posting in every row */
+    std::vector<std::vector<uint32_t>> positions(thread_count);
+
+    read_posts(posts_file, tags, thread_count, "Counting posts",
+        [&positions, tag_count](size_t worker, uint32_t tag, uint32_t) {
+            std::vector<uint32_t>& counts = positions[worker];
+            if (counts.empty()) {
+                counts.resize(tag_count);
+            }
+
+            ++counts[tag];
+        },
+        [](size_t) { });
+
+    auto build_start = std::chrono::steady_clock::now();
+
+    /* Row sizes are the sum of the per-worker counts, which in turn become every worker's position in the row */
+    parallel_for(tag_count, thread_count, 4096, [&](size_t begin, size_t end) {
+        for (size_t tag = begin; tag < end; ++tag) {
+            uint32_t total = 0;
+            for (std::vector<uint32_t>& counts : positions) {
+                /* Workers that read no postings have nothing to place */
+                if (!counts.empty()) {
+                    total += std::exchange(counts[tag], total);
+                }
             }
+
+            arena.counts[tag] = total;
         }
+    });
 
-        progress.advance();
-        ++posts_read;
+    uint64_t arena_size = 0;
+    for (size_t tag = 0; tag < tag_count; ++tag) {
+        arena.offsets[tag] = arena_size;
+        arena_size += index_format::align_posts(arena.counts[tag]);
     }
 
-    progress.finish();
+    /* Allocated exactly once, zero-initialized so the padding is too */
+    arena.posts.resize(arena_size);
 
-    auto post_end = std::chrono::steady_clock::now();
-    auto post_read_elapsed = post_end - post_start;
+    auto build_elapsed = std::chrono::steady_clock::now() - build_start;
 
-    std::cerr << "Read " << posts_read << " posts in " << get_time (post_read_elapsed) << " ("
-              << get_bytes(post_bytes_read / (post_read_elapsed.count() / 1e9)) << "/s)\n";
+    /* Workers write to disjoint positions, in file order within every row */
+    uint32_t max_post = read_posts(posts_file, tags, thread_count, "Reading posts",
+        [&](size_t worker, uint32_t tag, uint32_t post) {
+            arena.posts[arena.offsets[tag] + positions[worker][tag]++] = post;
+        },
+        [&positions](size_t worker) { positions[worker] = {}; });
+
+    build_start = std::chrono::steady_clock::now();
+
+    /* posts.json is usually ordered by ID already, only sort the rows that aren't */
+    std::atomic<size_t> sorted_rows = 0;
+    parallel_for(tag_count, thread_count, 4096, [&](size_t begin, size_t end) {
+        for (size_t tag = begin; tag < end; ++tag) {
+            std::span<uint32_t> row = arena[tag];
+            if (!std::ranges::is_sorted(row)) {
+                std::ranges::sort(row);
+                sorted_rows.fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+    });
+
+    build_elapsed += std::chrono::steady_clock::now() - build_start;
+
+    std::cerr << "Built " << tag_count << " posting lists (" << get_bytes(arena.posts.size() * sizeof(uint32_t))
+              << ", " << sorted_rows.load() << " sorted) in " << get_time(build_elapsed) << '\n';
 
     return max_post;
 }
 
-template <std::integral T>
-struct bin_helper {
-    T val;
+/* Paths of the runs spilled to disk, every file is removed again when this goes out of scope */
+class spill_files {
+    fs::path _dir;
+    std::vector<std::vector<fs::path>> _paths;
+
+    public:
+    spill_files(fs::path dir, size_t worker_count)
+        : _dir { std::move(dir) }, _paths(worker_count) { }
+
+    spill_files(const spill_files&) = delete;
+    spill_files& operator=(const spill_files&) = delete;
+
+    ~spill_files() {
+        for (const std::vector<fs::path>& paths : _paths) {
+            for (const fs::path& path : paths) {
+                std::error_code ec;
+                fs::remove(path, ec);
+            }
+        }
+    }
+
+    /* Claims the path of the next run of `worker` before anything is written to it,
+     * so a partially written run is removed as well. Every worker may only claim its own runs.
+     */
+    const fs::path& next(size_t worker) {
+        std::vector<fs::path>& paths = _paths[worker];
+        return paths.emplace_back(_dir / ("index.bin.run" + std::to_string(worker) + "." + std::to_string(paths.size())));
+    }
+
+    [[nodiscard]] const std::vector<std::vector<fs::path>>& paths() const { return _paths; }
 };
 
-template <std::integral T>
-auto binary(T val) {
-    return bin_helper { .val = val };
-}
+/* A sorted run of (tag << 32 | post) pairs spilled to disk, the file itself is owned by spill_files */
+class spill_run {
+    std::ifstream _in;
+    std::vector<uint64_t> _buffer;
+    size_t _pos = 0;
+    size_t _size = 0;
+
+    public:
+    static void write(const fs::path& path, std::span<const uint64_t> pairs) {
+        std::ofstream out { path, std::ios::out | std::ios::binary | std::ios::trunc };
+        out.write(reinterpret_cast<const char*>(pairs.data()), pairs.size_bytes());
+        if (!out) {
+            throw std::runtime_error { "failed writing " + path.string() };
+        }
+    }
 
-template <std::integral T>
-std::ostream& operator<<(std::ostream& os, bin_helper<T> val) {
-    return os.write(reinterpret_cast<char*>(&val.val), sizeof(T));
+    spill_run(const fs::path& path, size_t buffer_size)
+        : _in { path, std::ios::in | std::ios::binary }, _buffer(buffer_size) {
+        if (!_in) {
+            throw std::runtime_error { "failed opening " + path.string() };
+        }
+    }
+
+    /* Returns false once the run is exhausted */
+    [[nodiscard]] bool refill() {
+        if (_pos < _size) {
+            return true;
+        }
+
+        _in.read(reinterpret_cast<char*>(_buffer.data()), _buffer.size() * sizeof(uint64_t));
+        _size = _in.gcount() / sizeof(uint64_t);
+        _pos = 0;
+
+        return _size > 0;
+    }
+
+    [[nodiscard]] uint64_t front() const { return _buffer[_pos]; }
+    void pop() { ++_pos; }
+};
+
+/* Build the posting lists in bounded memory: sorted runs of at most `memory_budget` bytes
+ * in total are spilled to `temp_dir`, then k-way merged straight into the index.
+ */
+static uint32_t build_external(const mapped_file& posts_file, const tag_map_t& tags, index_writer& writer,
+                               size_t thread_count, size_t memory_budget, const fs::path& temp_dir) {
+    /* Every worker gets an equal share of the budget for its run */
+    const size_t run_capacity = std::max<size_t>(memory_budget / sizeof(uint64_t) / thread_count, 1024);
+
+    std::vector<std::vector<uint64_t>> buffers(thread_count);
+    spill_files files { temp_dir, thread_count };
+
+    auto spill = [&](size_t worker) {
+        std::vector<uint64_t>& buffer = buffers[worker];
+        if (buffer.empty()) {
+            return;
+        }
+
+        std::ranges::sort(buffer);
+
+        spill_run::write(files.next(worker), buffer);
+
+        buffer.clear();
+    };
+
+    uint32_t max_post = read_posts(posts_file, tags, thread_count, "Reading posts",
+        [&](size_t worker, uint32_t tag, uint32_t post) {
+            std::vector<uint64_t>& buffer = buffers[worker];
+            if (buffer.capacity() == 0) {
+                buffer.reserve(run_capacity);
+            }
+
+            buffer.push_back((uint64_t { tag } << 32) | post);
+
+            if (buffer.size() == run_capacity) {
+                spill(worker);
+            }
+        },
+        spill);
+
+    buffers = {};
+
+    auto merge_start = std::chrono::steady_clock::now();
+
+    /* The merge gets the whole budget for its read buffers */
+    std::vector<spill_run> runs;
+    size_t total_runs = 0;
+    for (const std::vector<fs::path>& paths : files.paths()) {
+        total_runs += paths.size();
+    }
+
+    const size_t read_buffer = std::max<size_t>(memory_budget / sizeof(uint64_t) / std::max<size_t>(total_runs, 1) / 2, 1024);
+
+    for (const std::vector<fs::path>& paths : files.paths()) {
+        for (const fs::path& path : paths) {
+            runs.emplace_back(path, read_buffer);
+        }
+    }
+
+    /* Min-heap of run indices, ordered by their current pair */
+    auto heap_order = [&runs](size_t lhs, size_t rhs) { return runs[lhs].front() > runs[rhs].front(); };
+    std::vector<size_t> heap;
+    for (size_t i = 0; i < runs.size(); ++i) {
+        if (runs[i].refill()) {
+            heap.push_back(i);
+        }
+    }
+
+    std::ranges::make_heap(heap, heap_order);
+
+    /* Consecutive posts of the same tag are written in batches */
+    std::vector<uint32_t> batch;
+    batch.reserve(std::max<size_t>(memory_budget / sizeof(uint32_t) / 2, 1024));
+    uint32_t batch_tag = 0;
+
+    while (!heap.empty()) {
+        std::ranges::pop_heap(heap, heap_order);
+        spill_run& run = runs[heap.back()];
+
+        uint64_t pair = run.front();
+        run.pop();
+
+        if (run.refill()) {
+            std::ranges::push_heap(heap, heap_order);
+        } else {
+            heap.pop_back();
+        }
+
+        uint32_t tag = pair >> 32;
+        if ((tag != batch_tag && !batch.empty()) || batch.size() == batch.capacity()) {
+            writer.append(batch_tag, batch);
+            batch.clear();
+        }
+
+        batch_tag = tag;
+        batch.push_back(static_cast<uint32_t>(pair));
+    }
+
+    if (!batch.empty()) {
+        writer.append(batch_tag, batch);
+    }
+
+    runs.clear();
+
+    auto merge_elapsed = std::chrono::steady_clock::now() - merge_start;
+
+    std::cerr << "Merged " << total_runs << " runs (" << writer.posts_written() << " postings) in "
+              << get_time(merge_elapsed) << '\n';
+
+    return max_post;
 }
 
 int main(int argc, char** argv) {
-    if (argc != 2) {
+    std::optional<options> opts = parse_options(argc, argv);
+    if (!opts) {
         usage(*argv);
         return EXIT_FAILURE;
     }
 
-    fs::path data_dir = argv[1];
+    const fs::path& data_dir = opts->data_dir;
     fs::path tags_json = data_dir / "tags.json";
     fs::path posts_json = data_dir / "posts.json";
     fs::path out_bin = data_dir / "index.bin";
@@ -185,80 +656,77 @@ int main(int argc, char** argv) {
         return EXIT_FAILURE;
     }
 
-    std::ofstream outfile(out_bin, std::ios::out | std::ios::binary);
-    if (!outfile) {
-        std::cerr << "Failed to open index.bin\n";
-        return EXIT_FAILURE;
-    }
-
     simdjson::ondemand::parser parser;
 
     tag_map_t tag_map = read_tags(parser, tags_json);
-    uint32_t max_post = read_posts(parser, posts_json, tag_map);
 
-    /* Re-shape tag map since we don't need tag names anymore */
-    tag_id_map_t id_map;
+    /* Tag IDs are used as indices directly, so include the highest one */
+    const uint32_t tag_count = tag_map.max_id() + 1;
 
-    /* Also find higehst tag number */
-    uint32_t max_tag = 0;
-    for (const auto& [name, desc] : tag_map) {
-        if (desc.id > max_tag) {
-            max_tag = desc.id;
-        }
-
-        id_map.insert({ desc.id, std::move(desc.posts) });
+    std::optional<index_writer> writer;
+    try {
+        writer.emplace(out_bin, tag_count, opts->mask_threshold, opts->compress);
+    } catch (const std::runtime_error& e) {
+        std::cerr << "Failed to open index.bin: " << e.what() << '\n';
+        return EXIT_FAILURE;
     }
 
-    auto write_start = std::chrono::steady_clock::now();
+    {
+        /* Stored sorted and front-coded, so the query tools can resolve names without a hash map */
+        std::vector<std::pair<std::string_view, uint32_t>> names;
+        names.reserve(tag_map.size());
+        for (size_t i = 0; i < tag_map.size(); ++i) {
+            names.emplace_back(tag_map.name(i), tag_map.id(i));
+        }
 
-    progress_bar progress("Writing index", max_tag);
+        writer->add_section(index_format::section_type::tag_names, name_dictionary::encode(names));
+    }
 
-    size_t bytes_written = 4 + 4 + 4;
-    size_t posts_written = 0;
+    mapped_file posts_file;
+    try {
+        posts_file = map_input(posts_json);
+    } catch (const std::runtime_error& e) {
+        std::cerr << "Failed opening posts.json: " << e.what() << '\n';
+        return EXIT_FAILURE;
+    }
 
-    /* Magic number */
-    outfile.write("Awoo", 4);
+    uint32_t max_post = 0;
 
-    /* All 32-bit ints */
-    
-    /* Highest post numer */
-    outfile << binary<uint32_t>(max_post);
+    auto write_start = std::chrono::steady_clock::now();
 
-    /* Tag count is the highest tag number */
-    outfile << binary<uint32_t>(max_tag);
+    /* Caught so the stack unwinds and spilled runs are removed again */
+    try {
+        if (opts->memory_budget) {
+            const fs::path& temp_dir = opts->temp_dir.empty() ? data_dir : opts->temp_dir;
 
-    /* Post count for every tag number */
-    for (uint32_t i = 0; i < max_tag; ++i) {
-        auto it = id_map.find(i);
-        if (it == id_map.end()) {
-            /* No posts */
-            outfile << binary<uint32_t>(0);
+            max_post = build_external(posts_file, tag_map, *writer, opts->threads, *opts->memory_budget, temp_dir);
         } else {
-            outfile << binary<uint32_t>(it->second.size());
-        }
+            posting_arena arena {
+                .offsets = std::vector<uint64_t>(tag_count),
+                .counts = std::vector<uint32_t>(tag_count),
+                .posts = {},
+            };
 
-        bytes_written += 4;
-    }
-
-    /* Posts for every tag that exists */
-    for (uint32_t i = 0; i < max_tag; ++i) {
-        auto it = id_map.find(i);
-        if (it != id_map.end()) {
-            posts_written += it->second.size();
+            max_post = build_arena(posts_file, tag_map, arena, opts->threads);
 
-            const size_t bytes = it->second.size() * sizeof(uint32_t);
-            outfile.write(reinterpret_cast<char*>(it->second.data()), bytes);
+            write_start = std::chrono::steady_clock::now();
 
-            bytes_written += bytes;
+            /* The arena is already laid out like the postings section */
+            writer->append_section(arena.posts, arena.offsets, arena.counts);
         }
-
-        progress.advance();
+    } catch (const std::runtime_error& e) {
+        std::cerr << "Failed building posting lists: " << e.what() << '\n';
+        return EXIT_FAILURE;
     }
-    progress.finish();
+
+    /* Tag names are encoded already, we don't need the lookup table anymore */
+    tag_map = {};
+
+    writer->finish(max_post);
 
     auto write_elapsed = std::chrono::steady_clock::now() - write_start;
 
-    std::cerr << "Wrote " << get_bytes(bytes_written) << ", " << max_tag << " post counts, "
-              << posts_written << " posts in " << get_time(write_elapsed)
-              << " (" << get_bytes(bytes_written / (write_elapsed.count() / 1e9)) << "/s)\n";
+    std::cerr << "Wrote " << get_bytes(writer->bytes_written()) << ", " << tag_count << " post counts, "
+              << writer->posts_written() << " posts, " << writer->bitmaps_written() << " bitmaps, " << writer->containers_written() << " container sets in " << get_time(write_elapsed)
+              << " (" << get_bytes(writer->bytes_written() / (write_elapsed.count() / 1e9)) << "/s)\n";
 }
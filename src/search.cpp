@@ -11,121 +11,259 @@
 #include <set>
 #include <optional>
 #include <limits>
+#include <stdexcept>
+#include <charconv>
 
 #include "helper.hpp"
+#include "index_file.hpp"
+#include "query.hpp"
+#include "set_ops.hpp"
 
 namespace fs = std::filesystem;
 
-using index_t = std::vector<std::vector<uint32_t>>;
+using index_t = index_file;
 
 static index_t load_index(const fs::path& path) {
-    std::ifstream infile(path, std::ios::in | std::ios::binary);
-    if (!infile) {
-        throw std::runtime_error{"couldn't open index file"};
-    }
-
     std::cerr << "Loading " << path.filename() << '\n';
 
     auto begin = std::chrono::steady_clock::now();
 
-    /* Check magic number for raw array or numpy array */
-    std::array<char, 4> magic;
-    infile.read(magic.data(), magic.size());
-    if (!infile || magic != std::array{'A', 'w', 'o', 'o'}) {
-        throw std::runtime_error{"error reading magic string"};
-    }
+    index_t result { path };
 
-    size_t total_posts = 0;
+    auto elapsed = std::chrono::steady_clock::now() - begin;
 
-    uint32_t max_post = 0;
-    infile.read(reinterpret_cast<char*>(&max_post), sizeof(max_post));
+    std::cerr << "Mapped " << result.tag_count() << " tags (up to post ID " << result.max_post() << "), "
+        << get_bytes(result.size_bytes()) << (result.is_compressed() ? " compressed" : "") << " in " << get_time(elapsed) << '\n';
 
-    uint32_t tag_count = 0;
-    infile.read(reinterpret_cast<char*>(&tag_count), sizeof(tag_count));
+    return result;
+}
 
-    index_t result(tag_count);
-    for (std::vector<uint32_t>& tag : result) {
-        uint32_t post_count = 0;
-        infile.read(reinterpret_cast<char*>(&post_count), sizeof(post_count));
+static void usage(const char* argv0) {
+    std::cerr << "Usage:\n\n"
+              << argv0 << " <index_file> [options] [tag_name...]\n\n"
+              << "Searches for posts with all given tags, or runs the built-in queries if none are given.\n\n"
+              << "Options:\n"
+              << "  --limit <n>   Only find the n newest posts, stopping as soon as they're found\n"
+              << "  --before <id> Only find posts older than this one, for the next page of a --limit query\n"
+              << "  --count       Only count the posts, without collecting their IDs\n\n";
 
-        if (post_count == 0) {
-            continue;
-        }
+}
 
-        tag.resize(post_count);
+static constexpr uint32_t no_post = std::numeric_limits<uint32_t>::max();
+
+/* Same join as search(), but over compressed lists. Cursors skip blocks by their maximum and only decode blocks they land in.
+ * Every post with all tags is passed to match(uint32_t).
+ */
+template <typename Match>
+static void join_compressed(const index_t& index, std::span<const uint32_t> search_ids, uint32_t before, Match&& match) {
+    std::vector<compressed_cursor> cursors;
+    cursors.reserve(search_ids.size());
+    for (uint32_t tag : search_ids) {
+        cursors.emplace_back(index.compressed(tag));
+    }
+
+    /* Search from least to most populated tag */
+    for (compressed_cursor& lead = cursors.front(); !lead.done() && lead.value() < before; lead.next()) {
+        const uint32_t next_post = lead.value();
+
+        size_t i = 1;
+        for (; i < cursors.size(); ++i) {
+            if (!cursors[i].seek(next_post)) {
+                /* Reached end, no more joins possible */
+                return;
+            }
+
+            if (cursors[i].value() != next_post) {
+                break;
+            }
+        }
 
-        total_posts += post_count;
+        if (i == cursors.size()) {
+            /* Join on all! */
+            match(next_post);
+        }
     }
+}
 
-    for (std::span<uint32_t> tag : result) {
-        infile.read(reinterpret_cast<char*>(tag.data()), tag.size_bytes());
+/* Posts of a raw list below `before`, found through its skip entries */
+[[nodiscard]] static std::span<const uint32_t> posts_before(const index_t& index, uint32_t tag, uint32_t before) {
+    std::span<const uint32_t> posts = index[tag];
+    if (before == no_post) {
+        return posts;
     }
 
-    auto elapsed = std::chrono::steady_clock::now() - begin;
+    return posts.first(set_ops::seek_skips(posts, index.skips(tag), index_format::skip_posts, before));
+}
 
-    const size_t total_bytes = 4 + 4 + (tag_count * sizeof(uint32_t)) + (total_posts * sizeof(uint32_t));
+/* Posts with all tags below `before`, in ascending order */
+std::vector<uint32_t> search(const index_t& index, std::vector<uint32_t> search_ids, uint32_t before = no_post) {
+    std::ranges::sort(search_ids, [&index](uint32_t lhs, uint32_t rhs ) {
+        return index.post_count(lhs) < index.post_count(rhs);
+    });
 
-    std::cerr << "Read " << tag_count << " tags, " << total_posts << " posts (up to ID " << max_post << "), "
-        << get_bytes(total_bytes) << " in " << get_time(elapsed) << " (" << get_bytes(total_bytes / (elapsed.count() / 1e9)) << "/s)\n";
+    if (index.is_compressed()) {
+        std::vector<uint32_t> result;
+        join_compressed(index, search_ids, before, [&result](uint32_t post) { result.push_back(post); });
+        return result;
+    }
 
-    return result;
-}
+    /* Intersect one list at a time from least to most populated tag, the running result only shrinks.
+     * set_ops::intersect() picks block-wise SIMD comparisons or galloping from the size ratio.
+     */
+    std::span<const uint32_t> lead = posts_before(index, search_ids.front(), before);
+    if (search_ids.size() == 1) {
+        return { lead.begin(), lead.end() };
+    }
 
-static void usage(const char* argv0) {
-    std::cerr << "Usage:\n\n"
-              << argv0 << " <index_file>\n\n";
+    std::vector<uint32_t> result(lead.size() + set_ops::slack);
+    std::vector<uint32_t> next(result.size());
+
+    size_t count = set_ops::intersect(lead, posts_before(index, search_ids[1], before), result.data());
+    for (size_t i = 2; i < search_ids.size() && count > 0; ++i) {
+        count = set_ops::intersect({ result.data(), count }, posts_before(index, search_ids[i], before), next.data());
+        result.swap(next);
+    }
 
+    result.resize(count);
+
+    return result;
 }
 
-std::vector<uint32_t> search(index_t& index, std::vector<uint32_t> search_ids) {
+/* Number of posts with all tags below `before`, like search().size() but without collecting them.
+ * Only the intermediate results of three or more tags are written, the last intersection just counts.
+ */
+size_t search_count(const index_t& index, std::vector<uint32_t> search_ids, uint32_t before = no_post) {
     std::ranges::sort(search_ids, [&index](uint32_t lhs, uint32_t rhs ) {
-        return index.at(lhs).size() < index.at(rhs).size();
+        return index.post_count(lhs) < index.post_count(rhs);
     });
 
+    if (search_ids.size() == 1 && before == no_post) {
+        return index.post_count(search_ids.front());
+    }
+
+    if (index.is_compressed()) {
+        size_t count = 0;
+        join_compressed(index, search_ids, before, [&count](uint32_t) { ++count; });
+        return count;
+    }
+
+    std::span<const uint32_t> lead = posts_before(index, search_ids.front(), before);
+    if (search_ids.size() == 1) {
+        return lead.size();
+    }
+
     std::vector<uint32_t> result;
+    std::vector<uint32_t> next;
+    if (search_ids.size() > 2) {
+        result.resize(lead.size() + set_ops::slack);
+        next.resize(result.size());
 
-    std::vector<uint32_t> cursor(search_ids.size(), 0);
+        const size_t count = set_ops::intersect(lead, posts_before(index, search_ids[1], before), result.data());
+        lead = { result.data(), count };
+    }
 
-    /* Search from least to most populated tag */
-    for (uint32_t next_post : index[search_ids.front()]) {
-        bool no_join = false;
-        uint32_t i = 1;
-        for (; i < search_ids.size(); ++i) {
-            /* For every post in every remaining search id */
-            std::span<uint32_t> posts = index[search_ids[i]];
-            uint32_t j = cursor[i];
-            for (; j < posts.size(); ++j) {
-                uint32_t post = posts[j];
-
-                if (post >= next_post) {
-                    no_join = (post > next_post);
-                    break;
-                }
-            }
+    for (size_t i = 2; i + 1 < search_ids.size() && !lead.empty(); ++i) {
+        const size_t count = set_ops::intersect(lead, posts_before(index, search_ids[i], before), next.data());
+        result.swap(next);
+        lead = { result.data(), count };
+    }
 
-            cursor[i] = j;
+    return set_ops::intersect_count(lead, posts_before(index, search_ids.back(), before));
+}
 
-            if (no_join) {
-                break;
-            } else if (j == posts.size()) {
-                /* Reached end, no more joins possible */
+/* Backward cursor over a raw list. The first seek goes through the skip entries, later ones gallop
+ * backwards from the previous position.
+ */
+class list_reverse_cursor {
+    std::span<const uint32_t> _posts;
+    std::span<const uint32_t> _skips;
+
+    /* Number of posts below the last bound */
+    size_t _pos;
+    bool _started = false;
+
+    public:
+    list_reverse_cursor(std::span<const uint32_t> posts, std::span<const uint32_t> skips) : _posts { posts }, _skips { skips }, _pos { posts.size() } { }
+
+    /* Move to the last post below bound, bounds must not increase. Returns false when there is none */
+    bool seek_below(uint32_t bound) {
+        _pos = _started
+            ? set_ops::gallop_back(_posts, _pos, bound)
+            : set_ops::seek_skips(_posts, _skips, index_format::skip_posts, bound);
+
+        _started = true;
+        return _pos > 0;
+    }
+
+    [[nodiscard]] uint32_t value() const { return _posts[_pos - 1]; }
+};
+
+/* Leapfrog join from the newest post down: every cursor in turn seeks to the last post up to the current
+ * candidate, and one that lands lower makes that the new candidate, until all of them agree.
+ */
+template <typename Cursor>
+static std::vector<uint32_t> search_page(std::span<Cursor> cursors, size_t limit, uint32_t before) {
+    std::vector<uint32_t> result;
+
+    for (uint32_t bound = before; result.size() < limit; ) {
+        if (!cursors.front().seek_below(bound)) {
+            break;
+        }
+
+        uint32_t candidate = cursors.front().value();
+        for (size_t i = 1 % cursors.size(), agreed = 1; agreed < cursors.size(); i = (i + 1) % cursors.size()) {
+            if (!cursors[i].seek_below(candidate + 1)) {
                 return result;
             }
-        }
 
-        if (i == search_ids.size()) {
-            /* Join on all! */
-            result.push_back(next_post);
+            if (cursors[i].value() == candidate) {
+                ++agreed;
+            } else {
+                candidate = cursors[i].value();
+                agreed = 1;
+            }
         }
+
+        result.push_back(candidate);
+        bound = candidate;
     }
 
     return result;
 }
 
-static void search_helper(index_t& index, std::span<uint32_t> search_ids, std::optional<std::span<uint32_t>> expected = {}) {
+/* Up to `limit` posts with all tags below `before`, newest first */
+std::vector<uint32_t> search_page(const index_t& index, std::vector<uint32_t> search_ids, size_t limit, uint32_t before = no_post) {
+    std::ranges::sort(search_ids, [&index](uint32_t lhs, uint32_t rhs ) {
+        return index.post_count(lhs) < index.post_count(rhs);
+    });
+
+    if (index.is_compressed()) {
+        std::vector<compressed_reverse_cursor> cursors;
+        cursors.reserve(search_ids.size());
+        for (uint32_t tag : search_ids) {
+            cursors.emplace_back(index.compressed(tag));
+        }
+
+        return search_page(std::span { cursors }, limit, before);
+    }
+
+    std::vector<list_reverse_cursor> cursors;
+    cursors.reserve(search_ids.size());
+    for (uint32_t tag : search_ids) {
+        cursors.emplace_back(index[tag], index.skips(tag));
+    }
+
+    return search_page(std::span { cursors }, limit, before);
+}
+
+static void search_helper(const index_t& index, std::span<uint32_t> search_ids, std::optional<std::span<uint32_t>> expected = {}) {
     std::cerr << search_ids.size() << " tags to search:\n";
     for (uint32_t tag_id : search_ids) {
-        std::cerr << "  " << tag_id << " -> " << index.at(tag_id).size() << " posts\n";
+        if (tag_id >= index.tag_count()) {
+            throw std::out_of_range { "tag " + std::to_string(tag_id) + " out of range" };
+        }
+
+        std::cerr << "  " << tag_id << " -> " << index.post_count(tag_id) << " posts\n";
     }
     std::cerr << '\n';
 
@@ -182,8 +320,106 @@ static void search_helper(index_t& index, std::span<uint32_t> search_ids, std::o
     std::cerr << '\n';
 }
 
+/* Find a newest-first page, checking it against the full search */
+static void page_helper(const index_t& index, std::span<uint32_t> search_ids, size_t limit, uint32_t before) {
+    static constexpr size_t repeats = 100;
+
+    std::vector<uint32_t> results;
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < repeats; ++i) {
+        results = search_page(index, { search_ids.begin(), search_ids.end() }, limit, before);
+    }
+
+    const auto page_time = (std::chrono::steady_clock::now() - start) / repeats;
+
+    std::vector<uint32_t> full;
+    start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < repeats; ++i) {
+        full = search(index, { search_ids.begin(), search_ids.end() }, before);
+    }
+
+    const auto full_time = (std::chrono::steady_clock::now() - start) / repeats;
+
+    std::cerr << "Found " << results.size() << " newest of " << full.size() << " results in " << get_time(page_time) << " average";
+    if (!results.empty()) {
+        std::cerr << " (" << results.front() << " to " << results.back() << ')';
+    }
+
+    std::cerr << "\n  Full search: " << get_time(full_time) << '\n';
+
+    std::vector<uint32_t> expected { full.rbegin(), full.rbegin() + static_cast<ptrdiff_t>(std::min(limit, full.size())) };
+    if (results != expected) {
+        std::cerr << "  Page does not match the full results\n";
+    }
+
+    std::cerr << '\n';
+}
+
+/* Count the results, checking the count against the full search */
+static void count_helper(const index_t& index, std::span<uint32_t> search_ids, uint32_t before) {
+    static constexpr size_t repeats = 100;
+
+    size_t count = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < repeats; ++i) {
+        count = search_count(index, { search_ids.begin(), search_ids.end() }, before);
+    }
+
+    const auto count_time = (std::chrono::steady_clock::now() - start) / repeats;
+
+    std::vector<uint32_t> full;
+    start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < repeats; ++i) {
+        full = search(index, { search_ids.begin(), search_ids.end() }, before);
+    }
+
+    const auto full_time = (std::chrono::steady_clock::now() - start) / repeats;
+
+    std::cerr << "Counted " << count << " results in " << get_time(count_time) << " average\n"
+              << "  Full search: " << get_time(full_time) << '\n';
+
+    if (count != full.size()) {
+        std::cerr << "  Count does not match the full results (" << full.size() << ")\n";
+    }
+
+    std::cerr << '\n';
+}
+
+template <std::integral T>
+static std::optional<T> parse_number(std::string_view str) {
+    T val {};
+    auto [ptr, ec] = std::from_chars(str.data(), str.data() + str.size(), val);
+    if (ec != std::errc {} || ptr != str.data() + str.size()) {
+        return std::nullopt;
+    }
+
+    return val;
+}
+
+/* Parse a query from the command line, resolving tag names through the index's dictionary */
+static std::optional<query_node> parse_arguments(const index_t& index, std::span<char*> args) {
+    auto begin = std::chrono::steady_clock::now();
+
+    std::string query;
+    for (std::string_view arg : args) {
+        query.append(arg).push_back(' ');
+    }
+
+    try {
+        query_node result = parse_query(query, [&index](std::string_view name) { return index.find_tag(name); });
+
+        auto elapsed = std::chrono::steady_clock::now() - begin;
+        std::cerr << "Parsed query in " << get_time(elapsed) << '\n';
+
+        return result;
+    } catch (const query_error& e) {
+        std::cerr << "Invalid query: " << e.what() << '\n';
+        return std::nullopt;
+    }
+}
+
 int main(int argc, char** argv) {
-    if (argc != 2) {
+    if (argc < 2) {
         usage(*argv);
         return EXIT_FAILURE;
     }
@@ -197,7 +433,73 @@ int main(int argc, char** argv) {
     }
 
     index_t index = load_index(index_path);
-    
+
+    std::optional<size_t> limit;
+    uint32_t before = no_post;
+    bool count_only = false;
+
+    int first_term = 2;
+    for (; first_term < argc; ++first_term) {
+        std::string_view arg = argv[first_term];
+
+        if (arg == "--limit" && (first_term + 1) < argc) {
+            limit = parse_number<size_t>(argv[++first_term]);
+            if (!limit) {
+                std::cerr << "Invalid limit: " << argv[first_term] << '\n';
+                return EXIT_FAILURE;
+            }
+        } else if (arg == "--before" && (first_term + 1) < argc) {
+            auto val = parse_number<uint32_t>(argv[++first_term]);
+            if (!val) {
+                std::cerr << "Invalid post ID: " << argv[first_term] << '\n';
+                return EXIT_FAILURE;
+            }
+
+            before = *val;
+        } else if (arg == "--count") {
+            count_only = true;
+        } else {
+            break;
+        }
+    }
+
+    if (count_only && limit) {
+        std::cerr << "--count and --limit can't be combined\n";
+        return EXIT_FAILURE;
+    }
+
+    if (first_term < argc) {
+        if (index.tag_names().empty()) {
+            std::cerr << "Index has no tag names, rebuild it to search by name\n";
+            return EXIT_FAILURE;
+        }
+
+        std::optional<query_node> query = parse_arguments(index, { argv + first_term, argv + argc });
+        if (!query) {
+            return EXIT_FAILURE;
+        }
+
+        if (!query->is_conjunction()) {
+            std::cerr << "Only plain tag lists are supported, use mask_search for -, ~ and ( )\n";
+            return EXIT_FAILURE;
+        }
+
+        std::vector<uint32_t> search_ids = query->tags();
+        if (count_only) {
+            count_helper(index, search_ids, before);
+        } else if (limit || before != no_post) {
+            page_helper(index, search_ids, limit.value_or(std::numeric_limits<size_t>::max()), before);
+        } else {
+            search_helper(index, search_ids);
+        }
+
+        return EXIT_SUCCESS;
+    } else if (first_term > 2) {
+        std::cerr << "Options need a query\n";
+        usage(*argv);
+        return EXIT_FAILURE;
+    }
+
     {
         std::array<uint32_t, 5> search_ids {
             470575, 212816, 13197, 29, 1283444, // 1girl solo long_hair touhou fate/grand_order